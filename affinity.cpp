@@ -0,0 +1,124 @@
+#include "affinity.h"
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool parse_cpu_list(const char* list, cpu_set_t* set)
+{
+    CPU_ZERO(set);
+    const char* p = list;
+    while(*p)
+    {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if(end == p || first < 0 || first >= CPU_SETSIZE)
+            return false;
+        long last = first;
+        p = end;
+        if(*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            if(end == p + 1 || last < first || last >= CPU_SETSIZE)
+                return false;
+            p = end;
+        }
+        for(long cpu = first; cpu <= last; ++cpu)
+            CPU_SET(cpu, set);
+        if(*p == ',')
+            ++p;
+        else if(*p != '\0')
+            return false;
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+int nth_cpu(const cpu_set_t* set, int index)
+{
+    int count = CPU_COUNT(set);
+    if(count == 0)
+        return -1;
+    index %= count;
+    for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        if(CPU_ISSET(cpu, set) && index-- == 0)
+            return cpu;
+    return -1;
+}
+
+bool pin_current_thread(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+int cpu_to_node(int cpu)
+{
+    // /sys/devices/system/cpu/cpuN/目录下有一个指向所在结点的nodeM符号链接
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* dir = opendir(path);
+    if(!dir)
+        return 0;
+    int node = 0;
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL)
+    {
+        if(strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+        {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+void* numa_alloc(size_t size, const cpu_set_t* set)
+{
+    void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(addr == MAP_FAILED)
+        return NULL;
+    if(set)
+    {
+        unsigned long nodemask = 0;     // 最多支持64个结点
+        for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if(!CPU_ISSET(cpu, set))
+                continue;
+            int node = cpu_to_node(cpu);
+            if(node < 64)
+                nodemask |= 1UL << node;
+        }
+        int mode = (nodemask & (nodemask - 1)) ? MPOL_INTERLEAVE : MPOL_PREFERRED;
+        // 在第一次访问（缺页）之前设置策略才有效；内核不支持NUMA时失败，忽略即可
+        if(nodemask)
+            syscall(SYS_mbind, addr, size, mode, &nodemask, sizeof(nodemask) * 8, 0);
+    }
+    return addr;
+}
+
+void numa_free(void* addr, size_t size)
+{
+    if(addr)
+        munmap(addr, size);
+}
+
+bool attach_incoming_cpu_steering(int listenfd, int groups)
+{
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, (__u32)(SKF_AD_OFF + SKF_AD_CPU) },  // A = 当前CPU编号
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (__u32)groups },                     // A = A % groups
+        { BPF_RET | BPF_A, 0, 0, 0 },                                           // 返回监听socket的下标
+    };
+    struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+    return setsockopt(listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+}
@@ -0,0 +1,26 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <sched.h>
+#include <stddef.h>
+
+// 解析"0-3,8,10-11"形式的CPU列表，失败返回false
+bool parse_cpu_list(const char* list, cpu_set_t* set);
+// 返回set中的第index个CPU（按编号从小到大，index超出时循环），set为空返回-1
+int nth_cpu(const cpu_set_t* set, int index);
+// 把当前线程绑定到cpu上
+bool pin_current_thread(int cpu);
+// cpu所在的NUMA结点，无法确定时返回0
+int cpu_to_node(int cpu);
+
+/* 按NUMA策略分配内存：set中的CPU都在同一个结点上时绑定到该结点，跨越多个结点时在这些结点间交错分配，
+   set为NULL或系统不支持NUMA策略时退化为普通的匿名映射。返回的内存已清零，用numa_free释放 */
+void* numa_alloc(size_t size, const cpu_set_t* set);
+void numa_free(void* addr, size_t size);
+
+/* 给SO_REUSEPORT监听组挂上CBPF程序：数据包在哪个CPU上被处理，就把连接交给第(cpu % groups)个
+   监听socket（即按创建顺序的第几个），配合把第i个reactor绑定到满足cpu % groups == i的CPU上，
+   连接的所有处理都留在收包的CPU上 */
+bool attach_incoming_cpu_steering(int listenfd, int groups);
+
+#endif // AFFINITY_H
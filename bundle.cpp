@@ -0,0 +1,174 @@
+#include "bundle.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+
+static std::shared_ptr<asset_bundle> g_bundle;  // 当前资源包，只通过std::atomic_load/atomic_store访问
+static char g_bundle_path[PATH_MAX];            // 资源包文件的路径，重新加载时使用
+static const char* g_bundle_name = NULL;        // 资源包的文件名（g_bundle_path中最后一个'/'之后的部分）
+
+asset_bundle::~asset_bundle()
+{
+    if(m_base)
+        munmap(m_base, m_size);
+}
+
+std::shared_ptr<asset_bundle> asset_bundle::open(const char* path)
+{
+    int fd = ::open(path, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(bundle_header))
+    {
+        close(fd);
+        return NULL;
+    }
+    // MAP_POPULATE：启动（或替换）时一次性把资源包读入页缓存，避免请求处理过程中发生缺页
+    char* base = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);      // 映射建立后文件描述符就不再需要了，rename替换文件也不会影响已有的映射
+    if(base == MAP_FAILED)
+        return NULL;
+
+    std::shared_ptr<asset_bundle> bundle(new asset_bundle);
+    bundle->m_base = base;
+    bundle->m_size = st.st_size;
+    const bundle_header* header = (const bundle_header*)base;
+    bundle->m_count = header->count;
+    bundle->m_entries = (const bundle_entry*)(base + header->index_offset);
+    bundle->m_strings = base + header->strings_offset;
+    if(!bundle->validate())
+    {
+        printf("bundle %s is corrupt\n", path);
+        return NULL;
+    }
+    return bundle;
+}
+
+// 检查文件头以及所有索引项中的偏移量都没有越界，之后的查找就不必再做边界检查
+bool asset_bundle::validate() const
+{
+    const bundle_header* header = (const bundle_header*)m_base;
+    if(memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0 || header->version != BUNDLE_VERSION)
+        return false;
+    if(header->index_offset > m_size || (uint64_t)m_count * sizeof(bundle_entry) > m_size - header->index_offset)
+        return false;
+    if(header->strings_offset > m_size || header->strings_size > m_size - header->strings_offset)
+        return false;
+    if(header->strings_size == 0 || m_strings[header->strings_size - 1] != '\0')
+        return false;   // 保证字符串表中的任何字符串都以'\0'结尾
+    for(uint32_t i = 0; i < m_count; ++i)
+    {
+        const bundle_entry& e = m_entries[i];
+        if(e.path_off >= header->strings_size || e.type_off >= header->strings_size || e.etag_off >= header->strings_size)
+            return false;
+        if(e.path_len > header->strings_size - e.path_off || strlen(m_strings + e.path_off) != e.path_len)
+            return false;
+        if(e.data_off > m_size || e.data_len > m_size - e.data_off)
+            return false;
+        if(e.gzip_off > m_size || e.gzip_len > m_size - e.gzip_off)
+            return false;
+        if(i > 0 && strcmp(m_strings + m_entries[i - 1].path_off, m_strings + e.path_off) >= 0)
+            return false;   // 索引必须严格升序，二分查找才正确
+    }
+    return true;
+}
+
+const bundle_entry* asset_bundle::find(const char* url) const
+{
+    size_t len = strcspn(url, "?");
+    uint32_t low = 0, high = m_count;
+    while(low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        const bundle_entry& e = m_entries[mid];
+        // 按strcmp的顺序比较url的前len个字符与索引中的路径
+        int cmp = memcmp(url, m_strings + e.path_off, len < e.path_len ? len : e.path_len);
+        if(cmp == 0)
+            cmp = (len > e.path_len) - (len < e.path_len);
+        if(cmp == 0)
+            return &e;
+        if(cmp < 0)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    return NULL;
+}
+
+std::shared_ptr<asset_bundle> asset_bundle::current()
+{
+    return std::atomic_load(&g_bundle);
+}
+
+bool asset_bundle::load(const char* path)
+{
+    std::shared_ptr<asset_bundle> bundle = open(path);
+    if(!bundle)
+    {
+        printf("failed to load bundle %s\n", path);
+        return false;
+    }
+    std::atomic_store(&g_bundle, bundle);
+    printf("loaded bundle %s: %u files\n", path, bundle->m_count);
+    return true;
+}
+
+int asset_bundle::watch(const char* path)
+{
+    strncpy(g_bundle_path, path, PATH_MAX - 1);
+    char dir[PATH_MAX];
+    strcpy(dir, g_bundle_path);
+    char* slash = strrchr(dir, '/');
+    if(slash)
+    {
+        g_bundle_name = g_bundle_path + (slash - dir) + 1;
+        if(slash == dir)
+            slash[1] = '\0';    // 资源包在根目录下
+        else
+            *slash = '\0';
+    }
+    else
+    {
+        g_bundle_name = g_bundle_path;
+        strcpy(dir, ".");
+    }
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(fd < 0)
+        return -1;
+    // 部署时先写临时文件再rename覆盖，对应IN_MOVED_TO；直接覆盖写入则对应IN_CLOSE_WRITE
+    if(inotify_add_watch(fd, dir, IN_MOVED_TO | IN_CLOSE_WRITE) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void asset_bundle::on_watch_event(int fd)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    while(true)     // inotify文件描述符以边沿触发方式注册，需要一次读完
+    {
+        ssize_t len = ::read(fd, buf, sizeof(buf));
+        if(len <= 0)
+            break;
+        for(char* p = buf; p < buf + len; )
+        {
+            struct inotify_event* event = (struct inotify_event*)p;
+            if(event->len > 0 && strcmp(event->name, g_bundle_name) == 0)
+                changed = true;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    if(changed)
+        load(g_bundle_path);    // 新资源包校验失败时继续使用旧的资源包
+}
@@ -0,0 +1,77 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+
+/*
+    静态资源包的文件格式（由packer/bundle_pack.cpp离线生成，所有整数均为本机字节序）：
+        bundle_header                   文件头
+        bundle_entry[count]             索引，按path升序排列，用于二分查找
+        字符串表                         path、Content-Type、ETag，均以'\0'结尾，可直接当C字符串使用
+        数据区                           文件内容以及可选的gzip预压缩版本
+*/
+#define BUNDLE_MAGIC "WSBUNDLE"
+#define BUNDLE_VERSION 1
+
+struct bundle_header
+{
+    char magic[8];              // 固定为BUNDLE_MAGIC
+    uint32_t version;           // 格式版本号BUNDLE_VERSION
+    uint32_t count;             // 索引项的数量
+    uint64_t index_offset;      // 索引在文件中的偏移
+    uint64_t strings_offset;    // 字符串表在文件中的偏移
+    uint64_t strings_size;      // 字符串表的大小
+};
+
+struct bundle_entry
+{
+    uint32_t path_off;          // URL路径（如"/index.html"）在字符串表中的偏移
+    uint32_t path_len;          // URL路径的长度
+    uint32_t type_off;          // Content-Type在字符串表中的偏移
+    uint32_t etag_off;          // ETag（含双引号）在字符串表中的偏移
+    uint64_t data_off;          // 文件内容在文件中的偏移
+    uint64_t data_len;          // 文件内容的长度
+    uint64_t gzip_off;          // gzip预压缩内容在文件中的偏移
+    uint64_t gzip_len;          // gzip预压缩内容的长度，0表示没有预压缩版本
+};
+
+/* 被mmap到内存中的静态资源包。启动时映射一次，之后的查找全部在内存中完成，不再有stat/open。
+   当前使用的资源包通过shared_ptr原子替换：正在发送旧资源包内容的连接持有旧的shared_ptr，
+   所以部署新内容（rename覆盖资源包文件）时旧的映射会在最后一个使用者结束后才被释放 */
+class asset_bundle
+{
+public:
+    ~asset_bundle();
+
+    // 映射并校验path指向的资源包，失败返回NULL
+    static std::shared_ptr<asset_bundle> open(const char* path);
+
+    // 查找url对应的索引项，url中'?'之后的查询参数不参与匹配，找不到返回NULL
+    const bundle_entry* find(const char* url) const;
+    const char* string_at(uint32_t off) const { return m_strings + off; }
+    const char* data_at(uint64_t off) const { return m_base + off; }
+
+    // 进程当前使用的资源包，没有加载资源包时返回NULL
+    static std::shared_ptr<asset_bundle> current();
+    // 加载path指向的资源包并原子地替换当前资源包
+    static bool load(const char* path);
+    // 用inotify监视资源包所在目录，返回inotify的文件描述符，失败返回-1
+    static int watch(const char* path);
+    // inotify文件描述符可读时调用，如果资源包文件被替换则重新加载
+    static void on_watch_event(int fd);
+
+private:
+    asset_bundle() : m_base(NULL), m_size(0), m_entries(NULL), m_count(0), m_strings(NULL) {}
+    bool validate() const;
+
+private:
+    char* m_base;                       // mmap得到的起始地址
+    size_t m_size;                      // 资源包文件的大小
+    const bundle_entry* m_entries;      // 索引
+    uint32_t m_count;                   // 索引项的数量
+    const char* m_strings;              // 字符串表
+};
+
+#endif // BUNDLE_H
@@ -0,0 +1,132 @@
+#include "capture.h"
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <mutex>
+#include <thread>
+#include <chrono>
+
+bool capture::m_enabled = false;
+std::atomic<long> capture::m_connections(0);
+std::atomic<long> capture::m_bytes(0);
+std::atomic<long> capture::m_truncated(0);
+
+static FILE* capture_file = NULL;
+static std::mutex file_mutex;               // 保护capture_file和下面的计数
+static uint64_t epoch = 0;                  // 开始捕获的时间，记录中的时间戳相对于它
+static uint32_t next_conn = 0;
+static long long max_bytes = 0;             // 捕获文件的大小上限
+static uint32_t conn_max_bytes = 0;         // 每个连接的数据的上限
+static int sample_every = 1;
+static bool full = false;                   // 文件达到了大小上限，之后不再写入任何记录
+static thread_local unsigned sample_counter = 0;
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 写入一条记录，调用者持有file_mutex；超过文件大小上限时返回false
+static bool write_record(uint32_t conn, uint8_t type, uint8_t flags, const char* buf, uint16_t len)
+{
+    long bytes = capture::m_bytes.load(std::memory_order_relaxed);
+    if(full || bytes + (long)sizeof(capture_record) + len > max_bytes)
+    {
+        full = true;
+        capture::m_truncated.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    capture_record r;
+    r.time = now() - epoch;
+    r.conn = conn;
+    r.type = type;
+    r.flags = flags;
+    r.len = len;
+    fwrite(&r, sizeof(r), 1, capture_file);
+    if(len)
+        fwrite(buf, 1, len, capture_file);
+    capture::m_bytes.store(bytes + sizeof(r) + len, std::memory_order_relaxed);
+    return true;
+}
+
+void capture_stream::open(bool tls)
+{
+    id = 0;
+    bytes = 0;
+    if(!capture::enabled() || ++sample_counter % sample_every != 0)
+        return;
+    std::lock_guard<std::mutex> guard(file_mutex);
+    if(!write_record(next_conn + 1, CAPTURE_OPEN, tls ? CAPTURE_TLS : 0, NULL, 0))
+        return;
+    id = ++next_conn;
+    capture::m_connections.fetch_add(1, std::memory_order_relaxed);
+}
+
+void capture_stream::append(const char* buf, int len)
+{
+    if(bytes + len > conn_max_bytes)
+    {
+        // 只记录完整的前缀：之后的数据也不再记录，否则重放的字节流中间会缺一段
+        if(bytes < conn_max_bytes)
+            capture::m_truncated.fetch_add(1, std::memory_order_relaxed);
+        bytes = conn_max_bytes;
+        return;
+    }
+    std::lock_guard<std::mutex> guard(file_mutex);
+    // 一次读到的数据超过记录长度的上限（读缓冲区可以配置得很大）时拆成多条记录，时间戳几乎相同
+    for(int off = 0; off < len; )
+    {
+        int n = len - off > UINT16_MAX ? UINT16_MAX : len - off;
+        if(!write_record(id, CAPTURE_DATA, 0, buf + off, n))
+        {
+            bytes = conn_max_bytes;
+            return;
+        }
+        off += n;
+        bytes += n;
+    }
+}
+
+void capture_stream::close()
+{
+    if(!id)
+        return;
+    std::lock_guard<std::mutex> guard(file_mutex);
+    write_record(id, CAPTURE_CLOSE, 0, NULL, 0);
+    id = 0;
+}
+
+// 后台线程：定期把stdio缓冲区中的记录写入文件，进程被杀死时最多丢失FLUSH_INTERVAL_MS的记录
+static void flush_loop()
+{
+    while(true)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(capture::FLUSH_INTERVAL_MS));
+        std::lock_guard<std::mutex> guard(file_mutex);
+        fflush(capture_file);
+    }
+}
+
+bool capture::init(const char* file, int sample, int max_mb, int conn_kb)
+{
+    capture_file = fopen(file, "w");
+    if(!capture_file)
+        return false;
+    setvbuf(capture_file, NULL, _IOFBF, 1 << 16);
+    capture_file_header header;
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.start_time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    fwrite(&header, sizeof(header), 1, capture_file);
+    m_bytes = sizeof(header);
+    max_bytes = (long long)(max_mb > 0 ? max_mb : 1) << 20;
+    conn_max_bytes = (uint32_t)(conn_kb > 0 ? (conn_kb < (1 << 21) ? conn_kb : (1 << 21)) : 1) << 10;
+    sample_every = sample > 0 ? sample : 1;
+    epoch = now();
+    m_enabled = true;
+    std::thread(flush_loop).detach();
+    return true;
+}
@@ -0,0 +1,71 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <atomic>
+
+/*
+    捕获文件的格式（小端）：文件头之后是一串记录，每条记录是一个capture_record加上len字节的数据。
+    记录按时间顺序排列，不同连接的记录交错出现；同一个连接依次是一条OPEN、若干条DATA和一条CLOSE
+    （达到大小上限或进程退出时可能没有CLOSE）。DATA的数据是一次recv读到的原始请求字节，
+    HTTPS连接为解密后的明文，所以重放时总是使用明文HTTP
+*/
+struct capture_file_header
+{
+    char magic[8];          // "HTCAP01\0"
+    uint64_t start_time;    // 开始捕获的时刻（CLOCK_REALTIME，纳秒），仅供参考
+};
+
+enum capture_type { CAPTURE_OPEN = 0, CAPTURE_DATA, CAPTURE_CLOSE };
+
+struct capture_record
+{
+    uint64_t time;          // 相对于开始捕获的时间（纳秒）
+    uint32_t conn;          // 连接的编号，从1开始
+    uint8_t type;           // capture_type
+    uint8_t flags;          // OPEN：CAPTURE_TLS表示来自HTTPS端口
+    uint16_t len;           // 之后的数据的字节数
+};
+
+static const char CAPTURE_MAGIC[8] = "HTCAP01";
+static const uint8_t CAPTURE_TLS = 1;
+
+// 一个连接的捕获状态，由连接对象持有；同一时刻只有一个线程在处理连接，不需要同步
+struct capture_stream
+{
+    uint32_t id;            // 连接的编号，0表示这个连接没有被采样
+    uint32_t bytes;         // 已经捕获的字节数，超过每个连接的上限后不再记录数据
+
+    void open(bool tls);    // 接受连接时调用，按采样率决定是否捕获这个连接
+    void data(const char* buf, int len) { if(id) append(buf, len); }
+    void close();
+private:
+    void append(const char* buf, int len);
+};
+
+/*
+    流量捕获：按连接采样，把客户端发来的原始字节和到达时间写入紧凑的二进制文件（格式见上），
+    由replay工具（replay/replay.cpp）按原来的时间间隔重新发送给测试服务器，重现生产环境中的
+    请求头大小、keep-alive的复用、请求之间的间隔和流水线的突发。被采样的连接每次recv都要追加记录，
+    写入由一把锁保护（在锁内取时间戳，文件中的记录自然按时间排序），未被采样的连接没有额外开销。
+    文件达到大小上限后停止捕获
+*/
+class capture
+{
+public:
+    static constexpr int FLUSH_INTERVAL_MS = 100;   // 后台线程刷新文件缓冲区的间隔
+
+    // 打开捕获文件并启动后台线程；每sample_every个连接采样一个，文件最多max_mb MB，每个连接最多conn_kb KB
+    static bool init(const char* capture_file, int sample_every, int max_mb, int conn_kb);
+    static bool enabled() { return m_enabled; }
+
+    static std::atomic<long> m_connections;     // 捕获的连接数
+    static std::atomic<long> m_bytes;           // 写入捕获文件的字节数
+    static std::atomic<long> m_truncated;       // 因达到大小上限而没有记录的数据的次数
+
+private:
+    friend struct capture_stream;
+    static bool m_enabled;
+};
+
+#endif // CAPTURE_H
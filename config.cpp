@@ -0,0 +1,295 @@
+#include "config.h"
+#include <sched.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+// 配置项的表，用成员指针访问，load_file、set和print共用
+static const struct { const char* name; int server_config::* field; bool sizable; } int_keys[] = {
+    { "port",             &server_config::port,             false },
+    { "https_port",       &server_config::https_port,       false },
+    { "reactors",         &server_config::reactors,         true },
+    { "workers",          &server_config::workers,          true },
+    { "max_workers",      &server_config::max_workers,      true },
+    { "io_workers",       &server_config::io_workers,       true },
+    { "max_io_workers",   &server_config::max_io_workers,   true },
+    { "small_lane_weight",  &server_config::small_lane_weight,  false },
+    { "small_lane_workers", &server_config::small_lane_workers, false },
+    { "large_lane_weight",  &server_config::large_lane_weight,  false },
+    { "large_lane_workers", &server_config::large_lane_workers, false },
+    { "admin_lane_weight",  &server_config::admin_lane_weight,  false },
+    { "admin_lane_workers", &server_config::admin_lane_workers, false },
+    { "queue_limit",      &server_config::queue_limit,      true },
+    { "max_fd",           &server_config::max_fd,           true },
+    { "max_events",       &server_config::max_events,       true },
+    { "read_buffer_size", &server_config::read_buffer_size, true },
+    { "listen_backlog",   &server_config::listen_backlog,   true },
+    { "trace_slow_ms",    &server_config::trace_slow_ms,    false },
+    { "trace_sample",     &server_config::trace_sample,     false },
+    { "capture_sample",   &server_config::capture_sample,   false },
+    { "capture_max_mb",   &server_config::capture_max_mb,   false },
+    { "capture_conn_kb",  &server_config::capture_conn_kb,  false },
+    { "ip_max_conns",        &server_config::ip_max_conns,        false },
+    { "ip_requests_per_sec", &server_config::ip_requests_per_sec, false },
+    { "ip_request_burst",    &server_config::ip_request_burst,    false },
+    { "ip_kbytes_per_sec",   &server_config::ip_kbytes_per_sec,   false },
+    { "ip_kbytes_burst",     &server_config::ip_kbytes_burst,     false },
+    { "notsent_lowat_kb", &server_config::notsent_lowat_kb, false },
+    { "write_quantum_kb", &server_config::write_quantum_kb, false },
+    { "sse_backlog",      &server_config::sse_backlog,      false },
+    { "spin_us",          &server_config::spin_us,          false },
+    { "busy_poll_us",     &server_config::busy_poll_us,     false },
+    { "drain_timeout",    &server_config::drain_timeout,    false },
+};
+
+static const struct { const char* name; std::string server_config::* field; } string_keys[] = {
+    { "cert_file",    &server_config::cert_file },
+    { "key_file",     &server_config::key_file },
+    { "doc_root",     &server_config::doc_root },
+    { "bundle_file",  &server_config::bundle_file },
+    { "reactor_cpus", &server_config::reactor_cpus },
+    { "worker_cpus",  &server_config::worker_cpus },
+    { "trace_file",   &server_config::trace_file },
+    { "capture_file", &server_config::capture_file },
+    { "upgrade_socket", &server_config::upgrade_socket },
+};
+
+static const struct { const char* name; bool server_config::* field; } bool_keys[] = {
+    { "steering",          &server_config::steering },
+    { "run_to_completion", &server_config::run_to_completion },
+    { "low_latency",       &server_config::low_latency },
+};
+
+static bool parse_bool(const char* value, bool* out)
+{
+    if(!strcasecmp(value, "on") || !strcasecmp(value, "true") || !strcasecmp(value, "yes") || !strcmp(value, "1"))
+        *out = true;
+    else if(!strcasecmp(value, "off") || !strcasecmp(value, "false") || !strcasecmp(value, "no") || !strcmp(value, "0"))
+        *out = false;
+    else
+        return false;
+    return true;
+}
+
+bool config::set(server_config& cfg, const char* key, const char* value)
+{
+    for(auto& k : int_keys)
+    {
+        if(strcmp(key, k.name) != 0)
+            continue;
+        if(k.sizable && strcasecmp(value, "auto") == 0)
+        {
+            cfg.*k.field = server_config::AUTO;
+            return true;
+        }
+        char* end;
+        long v = strtol(value, &end, 10);
+        if(end == value || *end != '\0' || v < (k.sizable ? 0 : -1) || v > 100000000)
+            return false;
+        cfg.*k.field = (int)v;
+        return true;
+    }
+    for(auto& k : string_keys)
+    {
+        if(strcmp(key, k.name) == 0)
+        {
+            cfg.*k.field = value;
+            return true;
+        }
+    }
+    for(auto& k : bool_keys)
+        if(strcmp(key, k.name) == 0)
+            return parse_bool(value, &(cfg.*k.field));
+    if(strcmp(key, "proxy") == 0)
+    {
+        cfg.proxy_routes.push_back(value);
+        return true;
+    }
+    if(strcmp(key, "limit_rate") == 0)
+    {
+        cfg.limit_rates.push_back(value);
+        return true;
+    }
+    if(strcmp(key, "unix_socket") == 0)
+    {
+        if(*value == '\0' || strlen(value) >= 108)     // sockaddr_un::sun_path的大小
+            return false;
+        cfg.unix_sockets.push_back(value);
+        return true;
+    }
+    if(strcmp(key, "auto") == 0)
+    {
+        bool on;
+        if(!parse_bool(value, &on))
+            return false;
+        if(on)
+            set_all_auto(cfg);
+        return true;
+    }
+    return false;
+}
+
+bool config::load_file(const char* path, server_config& cfg)
+{
+    FILE* fp = fopen(path, "r");
+    if(!fp)
+    {
+        printf("failed to open config file %s\n", path);
+        return false;
+    }
+    char line[1024];
+    int lineno = 0;
+    bool ok = true;
+    while(ok && fgets(line, sizeof(line), fp))
+    {
+        ++lineno;
+        char* p = strchr(line, '#');
+        if(p)
+            *p = '\0';
+        // 去掉首尾的空白
+        char* key = line + strspn(line, " \t\r\n");
+        char* end = key + strlen(key);
+        while(end > key && isspace((unsigned char)end[-1]))
+            *--end = '\0';
+        if(*key == '\0')
+            continue;
+        char* eq = strchr(key, '=');
+        if(!eq)
+        {
+            printf("%s:%d: expected key = value\n", path, lineno);
+            ok = false;
+            break;
+        }
+        char* value = eq + 1;
+        value += strspn(value, " \t");
+        do { *eq-- = '\0'; } while(eq >= key && isspace((unsigned char)*eq));
+        if(!set(cfg, key, value))
+        {
+            printf("%s:%d: bad setting %s = %s\n", path, lineno, key, value);
+            ok = false;
+        }
+    }
+    fclose(fp);
+    return ok;
+}
+
+void config::set_all_auto(server_config& cfg)
+{
+    for(auto& k : int_keys)
+        if(k.sizable)
+            cfg.*k.field = server_config::AUTO;
+}
+
+// /proc/meminfo中的MemAvailable（字节），读不到时返回0
+static long long available_memory()
+{
+    FILE* fp = fopen("/proc/meminfo", "r");
+    if(!fp)
+        return 0;
+    char line[256];
+    long long kb = 0;
+    while(fgets(line, sizeof(line), fp))
+        if(sscanf(line, "MemAvailable: %lld kB", &kb) == 1)
+            break;
+    fclose(fp);
+    return kb * 1024;
+}
+
+static int read_int_file(const char* path, int fallback)
+{
+    FILE* fp = fopen(path, "r");
+    if(!fp)
+        return fallback;
+    int v;
+    if(fscanf(fp, "%d", &v) != 1)
+        v = fallback;
+    fclose(fp);
+    return v;
+}
+
+/*
+    自动计算的规则：
+    reactors          每4个CPU一个reactor，至少一个
+    workers           CPU数的2倍（解析路径时仍可能阻塞在文件系统的元数据上），至少4个
+    max_workers       CPU数的8倍，在workers到256之间；线程池在阻塞或排队时才会增加线程，空闲后自动回收
+    io_workers        CPU数的4倍，在4到64之间；这些线程大部分时间在等待磁盘，线程数决定了同时进行的读取数
+    max_io_workers    CPU数的16倍，在io_workers到256之间
+    max_fd            把RLIMIT_NOFILE的软限制提高到硬限制，再受可用内存的限制：连接对象和读缓冲区最多使用可用内存的1/4
+    read_buffer_size  平均每个连接可用的内存充足（>=64KB）时为4096，否则为2048
+    queue_limit       与max_fd相同，每个连接至多有一个任务在队列中
+    max_events        max_fd平均分给各reactor，在64到4096之间
+    listen_backlog    net.core.somaxconn
+*/
+void config::auto_size(server_config& cfg, size_t conn_size)
+{
+    cpu_set_t set;
+    int cpus = 1;
+    if(sched_getaffinity(0, sizeof(set), &set) == 0)
+        cpus = CPU_COUNT(&set);
+
+    if(cfg.reactors == server_config::AUTO)
+        cfg.reactors = cpus / 4 > 1 ? cpus / 4 : 1;
+    if(cfg.workers == server_config::AUTO)
+        cfg.workers = cpus * 2 > 4 ? cpus * 2 : 4;
+    if(cfg.io_workers == server_config::AUTO)
+        cfg.io_workers = cpus * 4 < 4 ? 4 : (cpus * 4 > 64 ? 64 : cpus * 4);
+    if(cfg.max_workers == server_config::AUTO)
+        cfg.max_workers = cpus * 8 > 256 ? 256 : (cpus * 8 < cfg.workers ? cfg.workers : cpus * 8);
+    if(cfg.max_io_workers == server_config::AUTO)
+        cfg.max_io_workers = cpus * 16 > 256 ? 256 : (cpus * 16 < cfg.io_workers ? cfg.io_workers : cpus * 16);
+
+    long long mem = available_memory();
+    if(cfg.max_fd == server_config::AUTO)
+    {
+        struct rlimit rl;
+        long long fds = 65536;
+        if(getrlimit(RLIMIT_NOFILE, &rl) == 0)
+        {
+            if(rl.rlim_cur < rl.rlim_max)
+            {
+                rl.rlim_cur = rl.rlim_max;
+                setrlimit(RLIMIT_NOFILE, &rl);
+                getrlimit(RLIMIT_NOFILE, &rl);
+            }
+            if(rl.rlim_cur != RLIM_INFINITY)
+                fds = rl.rlim_cur;
+        }
+        long long per_conn = conn_size + (cfg.read_buffer_size == server_config::AUTO ? 4096 : cfg.read_buffer_size);
+        if(mem > 0 && mem / 4 / per_conn < fds)
+            fds = mem / 4 / per_conn;
+        if(fds > 1 << 20)
+            fds = 1 << 20;
+        cfg.max_fd = fds > 1024 ? (int)fds : 1024;
+    }
+    if(cfg.read_buffer_size == server_config::AUTO)
+        cfg.read_buffer_size = (mem > 0 && mem / cfg.max_fd >= 65536) ? 4096 : 2048;
+    if(cfg.queue_limit == server_config::AUTO)
+        cfg.queue_limit = cfg.max_fd;
+    if(cfg.max_events == server_config::AUTO)
+    {
+        int n = cfg.max_fd / cfg.reactors;
+        cfg.max_events = n < 64 ? 64 : (n > 4096 ? 4096 : n);
+    }
+    if(cfg.listen_backlog == server_config::AUTO)
+        cfg.listen_backlog = read_int_file("/proc/sys/net/core/somaxconn", 4096);
+}
+
+void config::print(const server_config& cfg)
+{
+    printf("effective configuration:\n");
+    for(auto& k : int_keys)
+        printf("  %-18s = %d\n", k.name, cfg.*k.field);
+    for(auto& k : string_keys)
+        printf("  %-18s = %s\n", k.name, (cfg.*k.field).c_str());
+    for(auto& k : bool_keys)
+        printf("  %-18s = %s\n", k.name, cfg.*k.field ? "on" : "off");
+    for(auto& route : cfg.proxy_routes)
+        printf("  %-18s = %s\n", "proxy", route.c_str());
+    for(auto& rule : cfg.limit_rates)
+        printf("  %-18s = %s\n", "limit_rate", rule.c_str());
+    for(auto& path : cfg.unix_sockets)
+        printf("  %-18s = %s\n", "unix_socket", path.c_str());
+}
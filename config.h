@@ -0,0 +1,101 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+
+/*
+    服务器的运行时配置。默认值就是原来写死在代码中的常量；启动时先读配置文件（-f），再应用命令行上的选项，
+    后者覆盖前者。可以按硬件自动计算的项（sizable）取值为auto（或0）时，由config::auto_size根据CPU数、
+    RLIMIT_NOFILE和可用内存计算，所以同一个配置文件可以用于不同规格的主机
+*/
+struct server_config
+{
+    static const int AUTO = 0;
+
+    int port = -1;
+    int https_port = -1;
+    std::string cert_file;
+    std::string key_file;
+    std::string doc_root = "/home/mirai/Project/web/resources";
+    std::string bundle_file;
+
+    int reactors = 1;               // reactor线程数（sizable）
+    int workers = 8;                // 线程池的线程数，也是伸缩的下限（sizable）
+    int max_workers = 32;           // 线程池伸缩的上限，不大于workers时线程数固定（sizable）
+    int io_workers = 4;             // 读入冷文件的I/O线程池的线程数，也是伸缩的下限（sizable）
+    int max_io_workers = 64;        // I/O线程池伸缩的上限（sizable）
+    // 线程池中各通道的权重和预留的线程数（见threadpool.h），预留的线程总数必须小于workers
+    int small_lane_weight = 4;
+    int small_lane_workers = 2;
+    int large_lane_weight = 1;
+    int large_lane_workers = 0;
+    int admin_lane_weight = 4;
+    int admin_lane_workers = 1;
+    int queue_limit = 10000;        // 任务队列的最大长度（sizable）
+    int max_fd = 65536;             // 最多同时处理的连接数，即连接表的大小（sizable）
+    int max_events = 10000;         // 每次epoll_wait最多返回的事件数（sizable）
+    int read_buffer_size = 2048;    // 每个连接的读缓冲区大小，决定了请求头部的最大长度（sizable）
+    int listen_backlog = 5;         // 监听队列的长度（sizable）
+
+    std::string reactor_cpus;
+    std::string worker_cpus;
+    bool steering = false;
+    bool run_to_completion = false;
+
+    // 低延迟模式（见latency.h）
+    bool low_latency = false;
+    int spin_us = 50;               // reactor阻塞之前轮询的预算（微秒）
+    int busy_poll_us = 50;          // SO_BUSY_POLL和epoll忙轮询的时间（微秒），0表示不设置
+
+    std::string trace_file;
+    int trace_slow_ms = 100;
+    int trace_sample = 1;
+
+    std::string capture_file;
+    int capture_sample = 1;         // 每多少个连接捕获一个
+    int capture_max_mb = 1024;      // 捕获文件的大小上限
+    int capture_conn_kb = 256;      // 每个连接捕获的数据的上限
+
+    // 按客户端IP限流（见ratelimit.h），0表示不限制
+    int ip_max_conns = 0;           // 每个IP的并发连接数
+    int ip_requests_per_sec = 0;    // 每个IP每秒的请求数
+    int ip_request_burst = 0;       // 允许突发的请求数，0为一秒的量
+    int ip_kbytes_per_sec = 0;      // 每个IP每秒的响应字节数（KB）
+    int ip_kbytes_burst = 0;        // 允许突发的响应字节数（KB），0为一秒的量
+
+    // 发送的背压（见http_conn.h），0表示不限制
+    int notsent_lowat_kb = 128;     // TCP_NOTSENT_LOWAT：每个连接在内核中未发出的数据的上限（KB）
+    int write_quantum_kb = 512;     // 一次write()最多发送的字节数（KB），之后让出线程
+
+    int sse_backlog = 64;           // 每个SSE连接最多积压的事件数，超过时断开这个慢连接（见sse.h）
+
+    // 热升级（见upgrade.h）：在这个Unix域socket上把监听socket交给下一个版本，空表示不支持
+    std::string upgrade_socket;
+    int drain_timeout = 30;         // 交出监听socket后等待已有连接关闭的最长时间（秒）
+
+    std::vector<std::string> proxy_routes;
+    // 按连接的限速规则"prefix=rate_kb[,burst_kb]"（见shaper.h），可以有多个
+    std::vector<std::string> limit_rates;
+    // 额外监听的Unix域socket，文件系统路径或以'@'开头的抽象名字空间的名字，可以有多个
+    std::vector<std::string> unix_sockets;
+};
+
+class config
+{
+public:
+    /* 读取配置文件，每行一个"key = value"，'#'之后为注释。出错时打印行号并返回false。
+       除server_config中的各项外，"auto = on"把所有sizable的项设为auto，"proxy"和"unix_socket"可以出现多次 */
+    static bool load_file(const char* path, server_config& cfg);
+    // 设置一项配置，未知的键或非法的值返回false
+    static bool set(server_config& cfg, const char* key, const char* value);
+    // 把所有sizable的项设为auto
+    static void set_all_auto(server_config& cfg);
+    // 计算取值为auto的项，conn_size为每个连接对象（不含读缓冲区）的大小
+    static void auto_size(server_config& cfg, size_t conn_size);
+    // 打印生效的配置
+    static void print(const server_config& cfg);
+};
+
+#endif // CONFIG_H
@@ -0,0 +1,71 @@
+#include "conn_table.h"
+#include "affinity.h"
+#include "http_conn.h"
+#include <new>
+
+static_assert(sizeof(conn_slot) == 32, "conn_slot should stay at half a cache line");
+
+conn_slot* conn_table::m_slots = NULL;
+int conn_table::m_capacity = 0;
+std::mutex conn_table::m_mutex;
+uint32_t* conn_table::m_free = NULL;
+int conn_table::m_free_count = 0;
+std::atomic<long> conn_table::m_stale(0);
+
+bool conn_table::init(int capacity, http_conn* conns, const cpu_set_t* node_cpus)
+{
+    m_slots = (conn_slot*)numa_alloc(sizeof(conn_slot) * capacity, node_cpus);
+    if(!m_slots)
+        return false;
+    m_free = new uint32_t[capacity];
+    m_capacity = capacity;
+    // 下标小的项在栈顶，连接少时只用到表开头的一小段
+    for(int i = 0; i < capacity; ++i)
+    {
+        conn_slot* slot = new (m_slots + i) conn_slot;
+        slot->conn = conns + i;
+        slot->coro = nullptr;
+        slot->fd = -1;
+        slot->generation.store(1, std::memory_order_relaxed);
+        slot->wait_sources = 0;
+        m_free[i] = capacity - 1 - i;
+    }
+    m_free_count = capacity;
+    return true;
+}
+
+void conn_table::destroy()
+{
+    for(int i = 0; i < m_capacity; ++i)
+        m_slots[i].~conn_slot();
+    numa_free(m_slots, sizeof(conn_slot) * m_capacity);
+    delete[] m_free;
+    m_slots = NULL;
+    m_free = NULL;
+    m_capacity = m_free_count = 0;
+}
+
+conn_slot* conn_table::acquire(int fd)
+{
+    conn_slot* slot;
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        if(m_free_count == 0)
+            return NULL;
+        slot = m_slots + m_free[--m_free_count];
+    }
+    slot->fd = fd;
+    slot->coro = nullptr;
+    slot->wait_sources = 0;
+    return slot;
+}
+
+void conn_table::release(conn_slot* slot)
+{
+    // 先改代数再放回空闲栈：项被重新分配之前，旧ID的事件就已经对不上了
+    uint32_t generation = (slot->generation.load(std::memory_order_relaxed) + 1) & GENERATION_MASK;
+    slot->generation.store(generation ? generation : 1, std::memory_order_relaxed);
+    slot->fd = -1;
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_free[m_free_count++] = (uint32_t)(slot - m_slots);
+}
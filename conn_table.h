@@ -0,0 +1,84 @@
+#ifndef CONN_TABLE_H
+#define CONN_TABLE_H
+
+#include <stdint.h>
+#include <sched.h>
+#include <atomic>
+#include <mutex>
+#include <coroutine>
+
+class http_conn;
+
+/* 连接表的一项，只包含reactor分发事件时要访问的字段（32字节，两项共用一个缓存行）。
+   解析状态和缓冲区等冷的状态在conn指向的http_conn中，只有事件真正要恢复协程时才会访问 */
+struct conn_slot
+{
+    http_conn* conn;                    // 这一项对应的连接对象，与项一一对应，不会改变
+    std::coroutine_handle<> coro;       // 连接协程挂起时的句柄，由reactor或工作线程恢复
+    int fd;                             // 连接的socket，空闲时为-1
+    std::atomic<uint32_t> generation;   // 每次释放加1，epoll中登记的ID带着它，用来识别过期的事件
+    uint32_t events;                    // 恢复协程时socket上就绪的事件
+    uint8_t wait_sources;               // 挂起的协程等待的事件来源（http_conn::EVENT_SOURCE的位掩码）
+    uint8_t event_source;               // 恢复协程的事件来源
+};
+
+/*
+    连接表：连接不再以文件描述符为下标，而是在接受时从表中分配一项，用项的下标加上代数作为连接的ID，
+    和事件来源一起编码在epoll_event.data.u64中：低32位为下标，32~59位为代数，60~63位为事件来源。
+    连接关闭时代数加1，同一批事件中属于已关闭连接的事件（以及下标被新连接复用之后才到达的事件）代数不符，被丢弃。
+    代数从1开始、跳过0，代数为0的data.u64表示监听socket等服务器自己的文件描述符，低32位就是文件描述符。
+    表的大小为最大连接数（配置项max_fd），与文件描述符的数值无关；空闲的项后进先出，刚释放的项还在缓存中
+*/
+class conn_table
+{
+public:
+    static const int GENERATION_BITS = 28;
+    static const uint32_t GENERATION_MASK = (1u << GENERATION_BITS) - 1;
+
+    // conns为预先分配的capacity个连接对象，第i项对应conns[i]；表分配在node_cpus所在的NUMA结点上（可以为NULL）
+    static bool init(int capacity, http_conn* conns, const cpu_set_t* node_cpus);
+    static void destroy();
+
+    // 为新接受的连接fd分配一项，表满时返回NULL；可以在任意线程中调用
+    static conn_slot* acquire(int fd);
+    // 连接关闭后释放它的项，此后epoll中带旧代数的事件都被丢弃
+    static void release(conn_slot* slot);
+
+    // 连接的事件来源source在epoll中登记的data.u64
+    static uint64_t tag(const conn_slot* slot, int source)
+    {
+        return (uint64_t)source << 60 | (uint64_t)slot->generation.load(std::memory_order_relaxed) << 32 | (uint32_t)(slot - m_slots);
+    }
+    // data.u64是否属于某个连接（否则是服务器自己的文件描述符）
+    static bool is_connection(uint64_t data) { return (data >> 32 & GENERATION_MASK) != 0; }
+    static int source(uint64_t data) { return (int)(data >> 60); }
+    // 找到data.u64对应的项，连接已经关闭（代数不符）时返回NULL
+    static conn_slot* lookup(uint64_t data)
+    {
+        uint32_t index = (uint32_t)data;
+        if(index >= (uint32_t)m_capacity)
+            return NULL;
+        conn_slot* slot = m_slots + index;
+        if(slot->generation.load(std::memory_order_relaxed) != (data >> 32 & GENERATION_MASK))
+        {
+            m_stale.fetch_add(1, std::memory_order_relaxed);
+            return NULL;
+        }
+        return slot;
+    }
+
+    // 遍历整个表用（热升级时关闭空闲的连接）：表的大小和第index项
+    static int capacity() { return m_capacity; }
+    static conn_slot* at(int index) { return m_slots + index; }
+
+    static std::atomic<long> m_stale;       // 因代数不符而丢弃的事件数
+
+private:
+    static conn_slot* m_slots;
+    static int m_capacity;
+    static std::mutex m_mutex;      // 保护空闲栈：连接在reactor线程中接受，可能在工作线程中关闭
+    static uint32_t* m_free;        // 空闲项的下标（栈）
+    static int m_free_count;
+};
+
+#endif // CONN_TABLE_H
@@ -0,0 +1,57 @@
+#include "coroutine.h"
+#include <new>
+
+std::mutex frame_pool::m_mutex;
+frame_pool::free_block* frame_pool::m_free_list = NULL;
+size_t frame_pool::m_free_count = 0;
+size_t frame_pool::m_used_count = 0;
+std::atomic<long> frame_pool::m_oversize(0);
+
+void* frame_pool::allocate(size_t size)
+{
+    if(size > BLOCK_SIZE)
+    {
+        m_oversize.fetch_add(1, std::memory_order_relaxed);
+        return ::operator new(size);
+    }
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        ++m_used_count;
+        if(m_free_list)
+        {
+            free_block* block = m_free_list;
+            m_free_list = block->next;
+            --m_free_count;
+            return block;
+        }
+    }
+    return ::operator new(BLOCK_SIZE);
+}
+
+void frame_pool::deallocate(void* ptr, size_t size)
+{
+    if(size > BLOCK_SIZE)
+    {
+        ::operator delete(ptr);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        --m_used_count;
+        if(m_free_count < MAX_FREE_BLOCKS)
+        {
+            free_block* block = (free_block*)ptr;
+            block->next = m_free_list;
+            m_free_list = block;
+            ++m_free_count;
+            return;
+        }
+    }
+    ::operator delete(ptr);
+}
+
+size_t frame_pool::allocated_blocks()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_used_count;
+}
@@ -0,0 +1,99 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <utility>
+#include <stddef.h>
+
+/* 协程帧的内存池。每个连接对应一个协程，协程帧在接受连接时分配、连接关闭时释放，
+   释放的帧放入空闲链表供下一个连接复用，避免频繁地向系统申请内存。
+   所有连接的协程都是同一个函数，帧的大小相同，超过BLOCK_SIZE的帧直接使用operator new，并计入oversize_frames()，
+   在/status中可以看到协程增加了局部变量后是否已经放不进内存块 */
+class frame_pool
+{
+public:
+    // 内存块的大小，需大于各协程的帧：目前serve为256字节，proxy_request为360字节，stream_events为128字节（g++ -O2）
+    static const size_t BLOCK_SIZE = 512;
+    static const size_t MAX_FREE_BLOCKS = 65536;    // 空闲链表的最大长度，多余的块归还给系统
+
+    static void* allocate(size_t size);
+    static void deallocate(void* ptr, size_t size);
+    static size_t allocated_blocks();   // 正在使用中的内存块数量
+    static long oversize_frames() { return m_oversize.load(std::memory_order_relaxed); }   // 超过BLOCK_SIZE的帧的累计分配次数
+
+private:
+    struct free_block { free_block* next; };
+    static std::mutex m_mutex;      // 帧在reactor线程中分配，可能在工作线程中释放
+    static free_block* m_free_list;
+    static size_t m_free_count;
+    static size_t m_used_count;
+    static std::atomic<long> m_oversize;
+};
+
+/* 连接协程的返回类型。协程创建后立即运行到第一个挂起点，运行结束后帧自动销毁，
+   所以调用者不需要保存返回值；恢复协程的句柄由各个awaiter保存在连接对象中 */
+struct conn_task
+{
+    struct promise_type
+    {
+        conn_task get_return_object() { return conn_task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        static void* operator new(size_t size) { return frame_pool::allocate(size); }
+        static void operator delete(void* ptr, size_t size) { frame_pool::deallocate(ptr, size); }
+    };
+};
+
+/* 可以被连接协程co_await的子协程：创建后先挂起，被co_await时才开始运行，结束时直接切换回（对称转移）
+   等待它的协程，co_await的结果是子协程co_return的值。子协程中的各个awaiter保存的是子协程自己的句柄，
+   reactor和工作线程恢复的就是子协程，不需要知道它被谁调用 */
+template <typename T>
+class sub_task
+{
+public:
+    struct promise_type
+    {
+        T value;
+        std::coroutine_handle<> continuation;   // 等待这个子协程的协程
+
+        struct final_awaiter
+        {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept { return h.promise().continuation; }
+            void await_resume() noexcept {}
+        };
+
+        sub_task get_return_object() { return sub_task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        final_awaiter final_suspend() noexcept { return {}; }
+        void return_value(T v) { value = v; }
+        void unhandled_exception() { std::terminate(); }
+
+        static void* operator new(size_t size) { return frame_pool::allocate(size); }
+        static void operator delete(void* ptr, size_t size) { frame_pool::deallocate(ptr, size); }
+    };
+
+    explicit sub_task(std::coroutine_handle<promise_type> h) : m_handle(h) {}
+    sub_task(sub_task&& other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+    sub_task(const sub_task&) = delete;
+    ~sub_task() { if(m_handle) m_handle.destroy(); }   // 子协程在final_suspend处挂起，帧由这里释放
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept
+    {
+        m_handle.promise().continuation = h;
+        return m_handle;
+    }
+    T await_resume() { return m_handle.promise().value; }
+
+private:
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+#endif // COROUTINE_H
@@ -1,17 +1,61 @@
 #include "http_conn.h"
+#include "router.h"
+#include "path_cache.h"
+#include <sys/timerfd.h>
 
-// 定义HTTP响应的一些状态信息
-const char* ok_200_title = "OK";
-const char* error_400_title = "Bad Request";
-const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
-const char* error_403_title = "Forbidden";
-const char* error_403_form = "You do not have permission to get file from this server.\n";
-const char* error_404_title = "Not Found";
-const char* error_404_form = "The requested file was not found on this server.\n";
-const char* error_500_title = "Internal Error";
-const char* error_500_form = "There was an unusual problem serving the requested file.\n";
-
-// 网站的根目录
+/* 预先拼好的错误响应，保持连接和关闭连接各一个版本，process_write直接让m_iv指向它们，不经过写缓冲区。
+   和下面的503、429响应一样不带Date头部 */
+struct prebuilt_response
+{
+    const char* keep_alive;
+    int keep_alive_len;
+    const char* close;
+    int close_len;
+};
+
+#define PREBUILT_ERROR(name, status_line, form_len, form) \
+    static_assert(sizeof(form) - 1 == form_len, "Content-Length of the " #name " response is wrong"); \
+    static const char name##_keep_alive[] = status_line "Content-Length: " #form_len "\r\nContent-Type:text/html\r\n" \
+        "Connection: keep-alive\r\n\r\n" form; \
+    static const char name##_close[] = status_line "Content-Length: " #form_len "\r\nContent-Type:text/html\r\n" \
+        "Connection: close\r\n\r\n" form; \
+    static const prebuilt_response name = { name##_keep_alive, sizeof(name##_keep_alive) - 1, name##_close, sizeof(name##_close) - 1 };
+
+PREBUILT_ERROR(error_400, "HTTP/1.1 400 Bad Request\r\n", 68, "Your request has bad syntax or is inherently impossible to satisfy.\n")
+PREBUILT_ERROR(error_403, "HTTP/1.1 403 Forbidden\r\n", 57, "You do not have permission to get file from this server.\n")
+PREBUILT_ERROR(error_404, "HTTP/1.1 404 Not Found\r\n", 49, "The requested file was not found on this server.\n")
+PREBUILT_ERROR(error_500, "HTTP/1.1 500 Internal Error\r\n", 57, "There was an unusual problem serving the requested file.\n")
+PREBUILT_ERROR(error_502, "HTTP/1.1 502 Bad Gateway\r\n", 64, "The upstream server is unavailable or sent an invalid response.\n")
+PREBUILT_ERROR(error_504, "HTTP/1.1 504 Gateway Timeout\r\n", 45, "The upstream server did not respond in time.\n")
+
+// 429响应带有每次不同的Retry-After，只有消息体是固定的
+#define ERROR_429_FORM "You are sending requests too fast, please slow down.\n"
+
+// 过载时的503响应，预先拼好，主线程直接发送
+#define ERROR_503_FORM "The server is overloaded, please retry later.\n"
+static const char overload_503_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Length: 46\r\n"
+    "Content-Type:text/html\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    ERROR_503_FORM;
+static_assert(sizeof(ERROR_503_FORM) - 1 == 46, "Content-Length of the 503 response is wrong");
+
+// 同一个IP的连接数超过上限时的429响应，预先拼好，reactor在接受连接时直接发送
+#define ERROR_429_CONN_FORM "Too many connections from your address.\n"
+static const char conn_limit_429_response[] =
+    "HTTP/1.1 429 Too Many Requests\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Length: 40\r\n"
+    "Content-Type:text/html\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    ERROR_429_CONN_FORM;
+static_assert(sizeof(ERROR_429_CONN_FORM) - 1 == 40, "Content-Length of the 429 response is wrong");
+
+// 网站的根目录，由path_resolver::init打开，请求的URL相对于它解析
 const char* doc_root = "/home/mirai/Project/web/resources";
 
 // 设置文件描述符非阻塞
@@ -27,7 +71,7 @@ int setnonblocking(int fd)
 void addfd(int epollfd, int fd, bool one_shot) 
 {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = fd;    // 服务器自己的文件描述符，代数为0（见conn_table.h）
     event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;    // 数据可读，边沿触发模式，TCP连接被对方关闭或者对方关闭了写操作
     if(one_shot)     
         event.events |= EPOLLONESHOT;   // 防止同一个通信被不同的线程处理
@@ -42,38 +86,116 @@ void removefd(int epollfd, int fd)
     close(fd);
 }
 
-// 修改文件描述符，重置socket上的EPOLLONESHOT事件，以确保下一次可读时，EPOLLIN事件能被触发
-void modfd(int epollfd, int fd, int ev) 
+// 为连接表中的连接slot注册（op为EPOLL_CTL_ADD）或重新注册（EPOLL_CTL_MOD）来源为source的文件描述符fd
+static void watch_source(int epollfd, int op, int fd, const conn_slot* slot, int source, uint32_t events)
 {
     epoll_event event;
-    event.data.fd = fd;
-    event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;    // 参数ev为EPOLLIN或EPOLLOUT
-    epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
+    event.data.u64 = conn_table::tag(slot, source);
+    event.events = events;
+    epoll_ctl(epollfd, op, fd, &event);
+}
+
+// 修改连接的socket，重置socket上的EPOLLONESHOT事件，以确保下一次可读时，EPOLLIN事件能被触发
+static void modfd(int epollfd, int fd, const conn_slot* slot, int ev) 
+{
+    watch_source(epollfd, EPOLL_CTL_MOD, fd, slot, http_conn::SOURCE_CLIENT,
+                 ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP);    // 参数ev为EPOLLIN或EPOLLOUT
 }
 
 // 非const的静态成员不能在类内初始化
-int http_conn::m_user_count = 0;    // 所有的客户数
-// 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
-int http_conn::m_epollfd = -1;
+int http_conn::m_read_buffer_size = 2048;
+std::atomic<int> http_conn::m_user_count(0);    // 所有的客户数
+std::atomic<long> http_conn::m_shed_queue_full(0);
+std::atomic<long> http_conn::m_shed_queue_delay(0);
+threadPool<http_conn>* http_conn::m_pool = NULL;
+threadPool<http_conn>* http_conn::m_io_pool = NULL;
+bool http_conn::m_run_to_completion = false;
+std::atomic<long> http_conn::m_inline_requests(0);
+std::atomic<long> http_conn::m_offloaded_requests(0);
+std::atomic<long> http_conn::m_cold_requests(0);
+std::atomic<long> http_conn::m_tls_handshakes(0);
+std::atomic<long> http_conn::m_tls_resumed(0);
+std::atomic<long> http_conn::m_ktls_connections(0);
+std::atomic<bool> http_conn::m_draining(false);
+int http_conn::m_notsent_lowat = 0;
+int http_conn::m_write_quantum = 0;
+std::atomic<long> http_conn::m_write_waits(0);
+std::atomic<long> http_conn::m_quantum_yields(0);
 
 // 初始化连接,外部调用初始化套接字地址
-void http_conn::init(int sockfd, const sockaddr_in& addr)
+void http_conn::init(conn_slot* slot, const sockaddr_in& addr, int epollfd, bool tls)
 {
+    int sockfd = slot->fd;
+    m_slot = slot;
     m_sockfd = sockfd;      // accept函数返回的connfd文件描述符
+    m_epollfd = epollfd;
     m_address = addr;       // 客户端socket地址
     
     // 设置端口复用；如下两行是为了避免TIME_WAIT状态，仅用于调试，实际使用时应该去掉
     int reuse = 1;
     setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    addfd(m_epollfd, sockfd, true);
+    // 关闭Nagle算法，响应的最后一个不满MSS的报文段立即发出；报文段的合并由MSG_MORE和TCP_CORK控制
+    m_unix = addr.sin_family == AF_UNIX;
+    int nodelay = 1;
+    if(!m_unix)
+        setsockopt(m_sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    /* 内核中未发出的数据超过m_notsent_lowat时socket不可写：sendmsg返回EAGAIN，EPOLLOUT要等它降下来才触发。
+       发送缓冲区中只留着已发出待确认的数据和这么多的余量，慢客户端不再各自占满几MB的内核内存 */
+    if(!m_unix && m_notsent_lowat > 0)
+        setsockopt(m_sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &m_notsent_lowat, sizeof(m_notsent_lowat));
+    m_corked = false;
+    m_ktls_send = false;
+    m_upstream_fd = -1;
+    m_timerfd = -1;
+    m_accept_time = tracer::enabled() ? tracer::now() : 0;
+    m_ssl = NULL;
+    m_sse_channel = NULL;
+    m_sse_slot = -1;
+    m_sse_queue = NULL;
+    m_idle_epollfd.store(-1, std::memory_order_relaxed);
+    // 同一个IP的连接数超过上限：明文连接回复429后关闭，HTTPS连接还没有握手，直接关闭
+    bool rejected;
+    m_client = rate_limiter::connect(addr.sin_addr.s_addr, &rejected);
+    if(rejected)
+    {
+        if(!tls)
+            send(sockfd, conn_limit_429_response, sizeof(conn_limit_429_response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(sockfd);
+        m_sockfd = -1;
+        conn_table::release(slot);
+        return;
+    }
+    if(tls && !(m_ssl = tls_context::new_session(sockfd)))
+    {
+        if(m_client)
+            rate_limiter::disconnect(m_client);
+        m_client = NULL;
+        close(sockfd);
+        m_sockfd = -1;
+        conn_table::release(slot);
+        return;
+    }
+    m_capture.open(tls);
+    setnonblocking(sockfd);
+    watch_source(m_epollfd, EPOLL_CTL_ADD, sockfd, slot, SOURCE_CLIENT, EPOLLIN | EPOLLET | EPOLLRDHUP | EPOLLONESHOT);
     m_user_count++;     // 所有的客户数加1
     init();
+    serve();            // 启动连接协程，它运行到等待EPOLLIN处挂起
 }
 
-void http_conn::init()
+/* keep_bytes为读缓冲区开头需要保留的字节数（流水线中已经读入的下一个请求），其余状态全部重置 */
+void http_conn::init(int keep_bytes)
 {
     m_check_state = CHECK_STATE_REQUESTLINE;    // 初始状态为检查请求行
+    m_lane = LANE_SMALL;
     m_linger = false;       // 默认不保持链接  Connection : keep-alive保持连接
+    m_accept_gzip = false;
+    m_if_none_match = 0;
+    m_file_address = 0;
+    m_content_type = "text/html";
+    m_etag = 0;
+    m_content_gzip = false;
+    m_vary_encoding = false;
 
     m_method = GET;         // 默认请求方式为GET（目前仅支持GET）
     m_url = 0;              
@@ -82,11 +204,12 @@ void http_conn::init()
     m_host = 0;
     m_start_line = 0;
     m_checked_idx = 0;
-    m_read_idx = 0;
+    m_read_idx = keep_bytes;
+    m_request_end = 0;
+    m_more_pending = false;
     m_write_idx = 0;
-    bzero(m_read_buf, READ_BUFFER_SIZE);
-    bzero(m_write_buf, READ_BUFFER_SIZE);
-    bzero(m_real_file, FILENAME_LEN);
+    // 读缓冲区不必清零：解析只访问m_read_idx之前的数据，每一行都由parse_line以'\0'结尾；
+    // 写缓冲区也不必清零，只发送m_write_idx之前的数据
 
     m_bytes_have_send = 0;
     m_bytes_to_send = 0; 
@@ -97,22 +220,71 @@ void http_conn::close_conn()
 {
     if(m_sockfd != -1) 
     {
-        removefd(m_epollfd, m_sockfd);
+        /* 先清除m_sockfd再关闭socket并释放连接表的项：释放之后这一项可能立即被reactor分配给新连接并调用init，
+           此后不能再修改这个对象 */
+        int sockfd = m_sockfd;
+        if(m_timerfd != -1)
+        {
+            removefd(m_epollfd, m_timerfd);
+            m_timerfd = -1;
+        }
+        if(m_ssl)
+        {
+            SSL_shutdown(m_ssl);    // 尽力发送close_notify，不等待对方的回应
+            SSL_free(m_ssl);
+            m_ssl = NULL;
+        }
+        m_capture.close();
+        if(m_sse_channel)
+        {
+            if(m_sse_slot >= 0)
+                sse_hub::unsubscribe(m_sse_channel, this, m_epollfd);
+            delete[] m_sse_queue;
+            m_sse_queue = NULL;
+            m_sse_channel = NULL;
+            m_sse_slot = -1;
+        }
+        if(m_client)
+        {
+            rate_limiter::disconnect(m_client);
+            m_client = NULL;
+        }
         m_sockfd = -1;
         m_user_count--; // 关闭一个连接，将客户总数量-1
+        removefd(m_epollfd, sockfd);
+        conn_table::release(m_slot);
     }
 }
 
+/* 过载时在主线程中直接发送预先生成的503响应并关闭连接，这样请求不会进入线程池排队，
+   也不会因为EPOLLONESHOT已被触发而没有重新注册，导致连接一直挂起 */
+void http_conn::reject_overload(bool queue_full)
+{
+    if(queue_full)
+        m_shed_queue_full.fetch_add(1, std::memory_order_relaxed);
+    else
+        m_shed_queue_delay.fetch_add(1, std::memory_order_relaxed);
+    // 新连接的发送缓冲区是空的，这么短的响应一次就能写完，写不完也只能放弃
+    if(m_ssl && !m_ktls_send)
+        SSL_write(m_ssl, overload_503_response, sizeof(overload_503_response) - 1);
+    else
+        send(m_sockfd, overload_503_response, sizeof(overload_503_response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close_conn();
+}
+
 // 循环读取客户数据保存到m_read_buf上，直到无数据可读或者对方关闭连接
 bool http_conn::read() 
 {
-    if(m_read_idx >= READ_BUFFER_SIZE) 
+    if(m_read_idx >= m_read_buffer_size) 
         return false;
     int bytes_read = 0;
     while(true) 
     {
-        // 从m_read_buf + m_read_idx索引出开始保存数据，大小是READ_BUFFER_SIZE - m_read_idx
-        bytes_read = recv(m_sockfd, m_read_buf+m_read_idx, READ_BUFFER_SIZE-m_read_idx, 0);
+        // 从m_read_buf + m_read_idx索引出开始保存数据，大小是m_read_buffer_size - m_read_idx
+        if(m_ssl)
+            bytes_read = tls_recv(m_read_buf+m_read_idx, m_read_buffer_size-m_read_idx);
+        else
+            bytes_read = recv(m_sockfd, m_read_buf+m_read_idx, m_read_buffer_size-m_read_idx, 0);
         if(bytes_read == -1) 
         {                                        // addfd设置了socketfd为非阻塞
             if(errno == EAGAIN || errno == EWOULDBLOCK)  // 没有数据。对于非阻塞IO，下面的条件成立表示数据已经全部读取完毕
@@ -121,8 +293,11 @@ bool http_conn::read()
         } 
         else if(bytes_read == 0)    // 对方关闭连接
             return false;
+        m_capture.data(m_read_buf + m_read_idx, bytes_read);
         m_read_idx += bytes_read;
     }
+    if(low_latency::enabled() && !m_unix)
+        low_latency::quickack(m_sockfd);
     return true;
 }
 
@@ -197,6 +372,7 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text)
     if(!m_url || m_url[0] != '/') 
         return BAD_REQUEST;
     printf("url is %s\n", m_url);
+    m_lane = classify_lane();
     m_check_state = CHECK_STATE_HEADER; // HTTP请求行处理完毕，状态转移到头部字段的分析
     return NO_REQUEST;
 }
@@ -237,20 +413,35 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text)
         text += strspn(text, " \t");
         m_host = text;
     } 
+    else if(strncasecmp(text, "Accept-Encoding:", 16) == 0) 
+    {
+        // 处理Accept-Encoding头部字段，只关心是否接受gzip
+        text += 16;
+        if(strcasestr(text, "gzip"))
+            m_accept_gzip = true;
+    } 
+    else if(strncasecmp(text, "If-None-Match:", 14) == 0) 
+    {
+        // 处理If-None-Match头部字段，与资源包中预先计算的ETag比较
+        text += 14;
+        text += strspn(text, " \t");
+        m_if_none_match = text;
+    } 
     else 
         printf("oop! unknow header %s\n", text);
     return NO_REQUEST;
 }
 
 // 我们没有真正解析HTTP请求的消息体，只是判断它是否被完整地读入了
-http_conn::HTTP_CODE http_conn::parse_content(char* text) 
+http_conn::HTTP_CODE http_conn::parse_content()
 {
     /* 解析HTTP请求行和头部字段时，都是先调用parse_line()使得m_checked_idx移动到
        当前正要解析的这一行的末尾，再调用parse_request_line或parse_headers，而
        对于HTTP请求体，并没有调用parse_line()，所以m_checked_idx仍在这一行开头 */
     if(m_read_idx >= (m_content_length + m_checked_idx))
     {
-        text[m_content_length] = '\0';  // m_content_length是解析HTTP请求头部字段得到的
+        // 消息体之后可能紧跟着流水线中的下一个请求，所以不能在消息体末尾写入'\0'
+        m_request_end = m_checked_idx + m_content_length;   // m_content_length是解析HTTP请求头部字段得到的
         return GET_REQUEST;
     }
     return NO_REQUEST;
@@ -284,14 +475,17 @@ http_conn::HTTP_CODE http_conn::process_read()
                 if (ret == BAD_REQUEST) 
                     return BAD_REQUEST;
                 else if (ret == GET_REQUEST) 
-                    return do_request();    // 如果没有请求体，则解析完头部就查找客户端请求的目标文件
+                {
+                    m_request_end = m_checked_idx;
+                    return GET_REQUEST;     // 如果没有请求体，则解析完头部就得到了完整的请求
+                }
                 break;                         
             }
             case CHECK_STATE_CONTENT:       // 第三个状态，解析请求体
             {
-                ret = parse_content(text);
-                if (ret == GET_REQUEST)     // 有请求体的情况下，解析完请求体再查找客户端请求的目标文件
-                    return do_request();
+                ret = parse_content();
+                if (ret == GET_REQUEST)     // 有请求体的情况下，解析完请求体才得到完整的请求
+                    return GET_REQUEST;
                 line_status = LINE_OPEN;    // 如果ret== NO_REQUEST，则说明要继续读取后面的行
                 break;
             }
@@ -302,18 +496,100 @@ http_conn::HTTP_CODE http_conn::process_read()
     return NO_REQUEST;  // 如果所有数据解析完毕但没有返回结果，说明请求不完整
 }
 
+/* 请求行解析完后确定请求进入线程池的哪个通道（见threadpool.h）：路由处理器（健康检查、状态等）为管理通道；
+   资源包中的内容和路径缓存中不超过SMALL_FILE_SIZE的文件（包括缓存的不存在）为小请求；
+   其余需要访问文件系统或发送大文件的为大请求。这里只查内存中的索引和缓存，不会阻塞 */
+int http_conn::classify_lane() const
+{
+    if(find_route(m_url))
+        return LANE_ADMIN;
+    std::shared_ptr<asset_bundle> bundle = asset_bundle::current();
+    if(bundle)
+    {
+        const bundle_entry* entry = bundle->find(m_url);
+        if(entry)
+            return entry->data_len <= SMALL_FILE_SIZE ? LANE_SMALL : LANE_LARGE;
+    }
+    std::shared_ptr<resolved_file> file = path_resolver::resolve(m_url, true);
+    if(file && (file->err != 0 || file->st.st_size <= SMALL_FILE_SIZE))
+        return LANE_SMALL;
+    return LANE_LARGE;
+}
+
+// 映射的文件内容是否全部在页缓存中（mincore），是则发送时不会因缺页而阻塞在磁盘上
+static bool page_cache_resident(const char* addr, size_t len)
+{
+    static const long page = sysconf(_SC_PAGESIZE);
+    const size_t PAGES_PER_CALL = 256;
+    unsigned char vec[PAGES_PER_CALL];
+    for(size_t off = 0; off < len; off += PAGES_PER_CALL * page)
+    {
+        size_t n = len - off < PAGES_PER_CALL * page ? len - off : PAGES_PER_CALL * page;
+        if(mincore((void*)(addr + off), n, vec) != 0)
+            return false;
+        for(size_t i = 0; i < (n + page - 1) / page; ++i)
+            if(!(vec[i] & 1))
+                return false;
+    }
+    return true;
+}
+
+/* 在I/O线程中把映射的文件内容读入页缓存并建立页表：先用MADV_WILLNEED对整个范围发起预读，
+   再用MADV_POPULATE_READ（或逐页访问）等待读入完成，之后发送时不再缺页 */
+static void prefetch_mapping(char* addr, size_t len)
+{
+    madvise(addr, len, MADV_WILLNEED);
+#ifdef MADV_POPULATE_READ
+    if(madvise(addr, len, MADV_POPULATE_READ) == 0)
+        return;
+#endif
+    static const long page = sysconf(_SC_PAGESIZE);
+    volatile char sink;
+    for(size_t off = 0; off < len; off += page)
+        sink = addr[off];
+    (void)sink;
+}
+
 /* 当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性。如果目标文件存在、
    对所有用户可读，且不是目录，则使用mmap将其映射到内存地址m_file_address处，
-   并告诉调用者获取文件成功 */
-http_conn::HTTP_CODE http_conn::do_request()
-{
-    // "/home/mirai/Project/web/resources"与"/index.html"拼接到一起
-    strcpy(m_real_file, doc_root);  // 将网站的根目录赋值给m_real_file
-    int len = strlen(doc_root);
-    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);  // 将m_url赋值给m_real_file
-    // 获取m_real_file文件的相关的状态信息，-1失败，0成功
-    if(stat(m_real_file, &m_file_stat) < 0)     // m_file_stat为传出参数，用于保存获取到的文件的信息
+   并告诉调用者获取文件成功；文件内容不全在页缓存中时返回COLD_FILE，由调用者交给I/O线程池读入后再发送。
+   nonblocking为true时只处理不会阻塞的请求（路由、资源包、路径缓存中已有的结果），
+   需要访问文件系统时返回NO_REQUEST，由调用者交给线程池重新处理 */
+http_conn::HTTP_CODE http_conn::do_request(bool nonblocking)
+{
+    // 先查找路由表，命中动态处理器的请求不会访问文件系统
+    const route* r = find_route(m_url);
+    if(r)
+    {
+        HTTP_CODE ret = r->handler(*this);
+        if(ret != DYNAMIC_REQUEST && ret != EVENT_STREAM)
+            m_write_idx = 0;    // 丢弃处理器写了一半的响应，由process_write输出错误页面
+        return ret;
+    }
+
+    // 加载了静态资源包时，直接在内存中的索引里查找，不访问文件系统
+    std::shared_ptr<asset_bundle> bundle = asset_bundle::current();
+    if(bundle)
+    {
+        const bundle_entry* entry = bundle->find(m_url);
+        if(entry)
+        {
+            m_bundle = bundle;
+            return do_bundle_request(entry);
+        }
+    }
+
+    // 相对于网站根目录解析路径，结果（包括不存在）会被缓存，".."和逃逸出根目录的符号链接被拒绝
+    std::shared_ptr<resolved_file> file = path_resolver::resolve(m_url, nonblocking);
+    if(!file)
+        return NO_REQUEST;
+    if(file->err != 0)
+    {
+        if(file->err == EXDEV || file->err == ELOOP || file->err == EACCES || file->err == EPERM)
+            return FORBIDDEN_REQUEST;
         return NO_RESOURCE;
+    }
+    m_file_stat = file->st;
 
     // 判断访问权限
     if(!(m_file_stat.st_mode & S_IROTH))    // S_IROTH为is read others，即其他用户是否有读权限
@@ -323,51 +599,122 @@ http_conn::HTTP_CODE http_conn::do_request()
     if(S_ISDIR(m_file_stat.st_mode)) 
         return BAD_REQUEST;     // 用户请求语法错误（请求访问的文件不能是目录）
 
-    // 以只读方式打开文件
-    int fd = open(m_real_file, O_RDONLY);
+    if(m_file_stat.st_size == 0)    // 空文件不需要（也不能）映射
+        return FILE_REQUEST;
+
     /* 创建内存映射 NULL表示地址由内核指定 st_size为文件字节数（文件大小） PROT_READ内存段可读权限   
        MAP_PRIVATE内存段为调用内存私有，对该内存段的修改不会反映到被映射的文件中（会重新创建一个新文件）
        offset为0，从文件起始地址开始映射 返回值是一个内存地址（网站数据映射到了地址处） */
-    // 当频繁对一个文件进行读取操作时，mmap会比read高效些
-    m_file_address = (char*)mmap(NULL, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
+    // 当频繁对一个文件进行读取操作时，mmap会比read高效些；文件描述符由路径缓存持有，不需要再open
+    m_file_address = (char*)mmap(NULL, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+    if(m_file_address == MAP_FAILED)
+    {
+        m_file_address = NULL;
+        return INTERNAL_ERROR;
+    }
+    // mmap本身不读取文件内容；内容不在页缓存中时，发送（writev访问映射）会阻塞在磁盘上
+    if(!page_cache_resident(m_file_address, m_file_stat.st_size))
+        return COLD_FILE;
     return FILE_REQUEST;        // 文件请求，获取文件成功
 }
 
+// If-None-Match是否与发送的版本的ETag相同：gzip版本的ETag是原始ETag在结尾的引号前加上-gz
+static bool etag_matches(const char* if_none_match, const char* etag, bool gzip)
+{
+    if(!gzip)
+        return strcmp(if_none_match, etag) == 0;
+    size_t len = strlen(etag);
+    return len > 0 && strlen(if_none_match) == len + 3 && strncmp(if_none_match, etag, len - 1) == 0
+        && strcmp(if_none_match + len - 1, "-gz\"") == 0;
+}
+
+/* 用资源包中的索引项准备响应，资源包已经映射在内存中，所以无需stat/open/mmap。
+   m_etag和m_content_type指向资源包内部，304响应同样持有资源包直到头部生成并发送完毕，由unmap释放 */
+http_conn::HTTP_CODE http_conn::do_bundle_request(const bundle_entry* entry)
+{
+    m_etag = m_bundle->string_at(entry->etag_off);
+    m_content_type = m_bundle->string_at(entry->type_off);
+    m_vary_encoding = entry->gzip_len > 0;
+    m_content_gzip = m_accept_gzip && entry->gzip_len > 0;     // 客户端接受gzip时发送预压缩的版本
+    if(m_if_none_match && etag_matches(m_if_none_match, m_etag, m_content_gzip))
+        return NOT_MODIFIED;
+    if(m_content_gzip)
+    {
+        m_file_address = (char*)m_bundle->data_at(entry->gzip_off);
+        m_file_stat.st_size = entry->gzip_len;
+    }
+    else
+    {
+        m_file_address = (char*)m_bundle->data_at(entry->data_off);
+        m_file_stat.st_size = entry->data_len;
+    }
+    return FILE_REQUEST;
+}
+
 // 对内存映射区执行munmap操作
 void http_conn::unmap() 
 {
-    if(m_file_address)
+    if(m_bundle)    // 内容在资源包中，只需释放对资源包的引用
+    {
+        m_bundle.reset();
+        m_file_address = NULL;
+    }
+    else if(m_file_address)
     {
         munmap(m_file_address, m_file_stat.st_size);    // 释放由mmap创建的内存空间
         m_file_address = NULL;
     }
 }
 
-// 写HTTP响应  返回值代表是否要继续保持连接
-bool http_conn::write()
+/* 写HTTP响应，返回false表示出错需要关闭连接。返回true时，若m_bytes_to_send为0表示响应已经全部发送，
+   否则表示TCP写缓冲没有空间了，或者这一次已经发送了一个写量子，需要等待下一轮EPOLLOUT事件再继续发送，
+   或者已经发送了limit字节（限速发送的令牌用完了），由调用者决定何时继续 */
+bool http_conn::write(long limit)
 {
     int temp = 0;
+    long sent = 0;      // 这一次调用已经发送的字节数
     
-    if(m_bytes_to_send == 0) 
-    {
-        // 将要发送的字节为0，这一次响应结束。
-        modfd(m_epollfd, m_sockfd, EPOLLIN);    // 监听事件修改为EPOLLIN
-        init();         // 对象数据清零
+    if(m_bytes_to_send == 0)    // 将要发送的字节为0，这一次响应结束
         return true;
-    }
 
     while(1) 
     {
-        // 集中写（将多块分散的内存数据一并写入文件描述符中）
-        temp = writev(m_sockfd, m_iv, m_iv_count);  // 函数成功时返回写入fd的字节数
+        /* 集中写（将多块分散的内存数据一并写入文件描述符中）。流水线中还有下一个请求时带上MSG_MORE，
+           让内核把这个响应的尾部与下一个响应合并成满MSS的报文段 */
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = m_iv;
+        msg.msg_iovlen = m_iv_count;
+        // 限速发送时只发送令牌允许的部分：把内存块截短到剩下的limit - sent字节
+        struct iovec clipped[2];
+        if(limit > 0)
+        {
+            long left = limit - sent;
+            int count = 0;
+            for(int i = 0; i < m_iv_count && left > 0; ++i)
+            {
+                clipped[count] = m_iv[i];
+                if((long)clipped[count].iov_len > left)
+                    clipped[count].iov_len = left;
+                left -= clipped[count].iov_len;
+                ++count;
+            }
+            msg.msg_iov = clipped;
+            msg.msg_iovlen = count;
+        }
+        if(m_ssl && !m_ktls_send)   // 用户态TLS，由OpenSSL加密后写出
+            temp = tls_send(msg.msg_iov, msg.msg_iovlen);
+        else    // 明文连接，或者kTLS连接（内核负责加密，照常写socket）
+            temp = sendmsg(m_sockfd, &msg, MSG_NOSIGNAL | (m_more_pending ? MSG_MORE : 0));  // 函数成功时返回写入fd的字节数
         if (temp < 0) 
         {
             /* 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
-               服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。 */
-            if(errno == EAGAIN | errno == EWOULDBLOCK) 
+               服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
+               一次写不完的响应打开TCP_CORK，避免每次EPOLLOUT后补发的零碎数据变成小报文段 */
+            if(errno == EAGAIN || errno == EWOULDBLOCK) 
             {
-                modfd(m_epollfd, m_sockfd, EPOLLOUT);
+                if(!m_corked)
+                    set_cork(true);
                 return true;
             }
             unmap();    // 释放内存映射
@@ -378,40 +725,95 @@ bool http_conn::write()
 
         if(m_bytes_to_send <= 0) 
         {
-            // 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接
+            // 发送HTTP响应成功，是否保持连接由调用者根据HTTP请求中的Connection字段决定
             unmap();
-            modfd(m_epollfd, m_sockfd, EPOLLIN);
-            if(m_linger) 
-            {
-                init();
-                return true;
-            } 
-            else 
-            {
-                return false;
-            } 
+            m_bytes_to_send = 0;
+            if(m_corked && !m_more_pending)     // 最后一个响应发送完毕，取消TCP_CORK把剩余的数据立即发出
+                set_cork(false);
+            return true;
         }
         else
         {          
-            // 如果没有发送完毕，还要修改下次写数据的位置
-            if (m_iv_count == 2 && (m_bytes_have_send >= m_iv[0].iov_len))
+            // 如果没有发送完毕，还要修改下次写数据的位置：跳过已经写完的内存块，推进写了一部分的内存块
+            sent += temp;
+            for(int i = 0; i < m_iv_count && temp > 0; ++i)
             {
-                m_iv[0].iov_len = 0;
-                m_iv[1].iov_base = m_file_address + (m_bytes_have_send - m_write_idx);
-                m_iv[1].iov_len = m_bytes_to_send;
+                size_t n = (size_t)temp < m_iv[i].iov_len ? (size_t)temp : m_iv[i].iov_len;
+                m_iv[i].iov_base = (char*)m_iv[i].iov_base + n;
+                m_iv[i].iov_len -= n;
+                temp -= n;
             }
-            else if(m_iv_count == 2 || m_iv_count == 1)
+            if(limit > 0 && sent >= limit)
+                return true;
+            /* 用完了写量子：客户端读得很快（比如在同一个机房）时发送缓冲区一直有空间，不让一个大响应占住线程。
+               socket仍然可写，重新注册的EPOLLOUT立即就绪，reactor先处理完这一轮的其他事件再回来接着发送 */
+            if(m_write_quantum > 0 && sent >= m_write_quantum)
             {
-                m_iv[0].iov_base = m_write_buf + m_bytes_have_send;
-                m_iv[0].iov_len = m_iv[0].iov_len - temp;
+                m_quantum_yields.fetch_add(1, std::memory_order_relaxed);
+                if(!m_corked)
+                    set_cork(true);
+                return true;
             }
-            else 
-                return false;
         }
     }
 }
 
-// 往写缓冲区中写入待发送的数据
+// 用户态TLS的读，返回值的含义与recv相同：没有数据时返回-1并把errno设为EAGAIN
+int http_conn::tls_recv(char* buf, int len)
+{
+    int ret = SSL_read(m_ssl, buf, len);
+    if(ret > 0)
+        return ret;
+    switch(SSL_get_error(m_ssl, ret))
+    {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:     // 对方发送了close_notify
+            return 0;
+        default:
+            errno = EIO;
+            return -1;
+    }
+}
+
+/* 用户态TLS的写，一次只写第一个非空的内存块，返回值的含义与writev相同。
+   OpenSSL为每次SSL_write生成单独的TLS记录，响应头和文件内容由调用者用TCP_CORK合并到同一批报文段中 */
+int http_conn::tls_send(const struct iovec* iv, int iv_count)
+{
+    int i = 0;
+    while(i < iv_count && iv[i].iov_len == 0)
+        ++i;
+    if(i == iv_count)
+        return 0;
+    int ret = SSL_write(m_ssl, iv[i].iov_base, iv[i].iov_len);
+    if(ret > 0)
+        return ret;
+    int err = SSL_get_error(m_ssl, ret);
+    errno = (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) ? EAGAIN : EIO;
+    return -1;
+}
+
+void http_conn::set_cork(bool on)
+{
+    if(m_unix)      // Unix域socket没有报文段，写入的数据直接进入对方的接收队列
+        return;
+    int val = on ? 1 : 0;
+    setsockopt(m_sockfd, IPPROTO_TCP, TCP_CORK, &val, sizeof(val));
+    m_corked = on;
+}
+
+// 读缓冲区中当前请求之后是否已经有一个完整的请求头部（客户端使用了流水线）
+bool http_conn::has_pipelined_request() const
+{
+    if(m_request_end <= 0 || m_request_end >= m_read_idx)
+        return false;
+    return memmem(m_read_buf + m_request_end, m_read_idx - m_request_end, "\r\n\r\n", 4) != NULL;
+}
+
+/* 往写缓冲区中写入格式化的数据，用于路由处理器中不常用的头部；
+   常用的头部由下面的函数用memcpy拼接，不经过vsnprintf */
 bool http_conn::add_response(const char* format, ...) 
 {
     if(m_write_idx >= WRITE_BUFFER_SIZE)    // 若写缓冲区已满，则不再写入
@@ -422,49 +824,132 @@ bool http_conn::add_response(const char* format, ...)
        int _vsnprintf(char* str, size_t size, const char* format, va_list ap);
        执行成功，返回最终生成字符串的长度 */
     int len = vsnprintf(m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list);
+    va_end(arg_list);       // 最后用VA_END宏结束可变参数的获取
     if(len >= (WRITE_BUFFER_SIZE - 1 - m_write_idx)) 
         return false;
     m_write_idx += len;
-    va_end(arg_list);       // 最后用VA_END宏结束可变参数的获取
     return true;
 }
 
+// 往写缓冲区中追加len字节，放不下时返回false
+bool http_conn::add_bytes(const char* data, int len)
+{
+    if(len > WRITE_BUFFER_SIZE - m_write_idx)
+        return false;
+    memcpy(m_write_buf + m_write_idx, data, len);
+    m_write_idx += len;
+    return true;
+}
+
+// 0~99的两位十进制数字，整数转换时每次取出两位
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// 以十进制追加一个非负整数，代替"%d"
+bool http_conn::add_number(long value)
+{
+    char buf[20];
+    char* p = buf + sizeof(buf);
+    unsigned long v = value < 0 ? 0 : (unsigned long)value;
+    while(v >= 100)
+    {
+        p -= 2;
+        memcpy(p, digit_pairs + v % 100 * 2, 2);
+        v /= 100;
+    }
+    if(v >= 10)
+    {
+        p -= 2;
+        memcpy(p, digit_pairs + v * 2, 2);
+    }
+    else
+        *--p = (char)('0' + v);
+    return add_bytes(p, (int)(buf + sizeof(buf) - p));
+}
+
+/* Date头部（"Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"），每个线程缓存一份，每秒最多格式化一次；
+   CLOCK_REALTIME_COARSE由vDSO读取，不进入内核 */
+static const int DATE_HEADER_LEN = 37;
+bool http_conn::add_date()
+{
+    static thread_local time_t cached_sec = 0;
+    static thread_local char cached[DATE_HEADER_LEN + 1];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if(ts.tv_sec != cached_sec)
+    {
+        struct tm tm;
+        gmtime_r(&ts.tv_sec, &tm);
+        strftime(cached, sizeof(cached), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        cached_sec = ts.tv_sec;
+    }
+    return add_bytes(cached, DATE_HEADER_LEN);
+}
+
 bool http_conn::add_status_line( int status, const char* title )    // status为HTTP状态码  title为状态信息
 {
-    return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
+    return add_literal("HTTP/1.1 ") && add_number(status) && add_literal(" ")
+        && add_bytes(title, strlen(title)) && add_literal("\r\n") && add_date();
 }
 
-bool http_conn::add_headers(int content_len) 
+bool http_conn::add_headers(int content_len, const char* content_type) 
 {
-    add_content_length(content_len);    // 输出响应内容的长度
-    add_content_type();     // 输出响应内容的类型（这里仅为文本类型）
-    add_linger();           // 输出是否为连接状态
-    add_blank_line();       // HTTP应答必须包含一个空行以标识头部字段的结束
+    return add_content_length(content_len)  // 输出响应内容的长度
+        && add_content_type(content_type)   // 输出响应内容的类型
+        && add_linger();                    // 输出是否为连接状态，以及结束头部的空行
 }
 
 bool http_conn::add_content_length(int content_len) 
 {
-    return add_response("Content-Length: %d\r\n", content_len);
+    return add_literal("Content-Length: ") && add_number(content_len) && add_literal("\r\n");
 }
 
+// HTTP应答必须包含一个空行以标识头部字段的结束，和Connection头部一起写入
 bool http_conn::add_linger()
 {
-    return add_response("Connection: %s\r\n", (m_linger == true) ? "keep-alive" : "close");
+    return m_linger ? add_literal("Connection: keep-alive\r\n\r\n") : add_literal("Connection: close\r\n\r\n");
 }
 
 bool http_conn::add_blank_line()
 {
-    return add_response("%s", "\r\n");
+    return add_literal("\r\n");
+}
+
+// 资源包中的内容带有预先计算好的ETag；gzip预压缩的版本是另一个表示，ETag在结尾的引号前加上-gz
+bool http_conn::add_cache_headers()
+{
+    if(m_etag)
+    {
+        size_t len = strlen(m_etag);
+        if(!add_literal("ETag: ") || !(m_content_gzip ? add_bytes(m_etag, len - 1) && add_literal("-gz\"") : add_bytes(m_etag, len))
+            || !add_literal("\r\n"))
+            return false;
+    }
+    if(m_vary_encoding && !add_literal("Vary: Accept-Encoding\r\n"))
+        return false;
+    return true;
 }
 
 bool http_conn::add_content(const char* content)
 {
-    return add_response("%s", content);
+    return add_bytes(content, strlen(content));
+}
+
+bool http_conn::add_content_type(const char* content_type) 
+{
+    return add_literal("Content-Type:") && add_bytes(content_type, strlen(content_type)) && add_literal("\r\n");
 }
 
-bool http_conn::add_content_type() 
+// 发送预先拼好的错误响应，写缓冲区中已有的内容被丢弃
+void http_conn::use_prebuilt(const prebuilt_response& response)
 {
-    return add_response("Content-Type:%s\r\n", "text/html");
+    m_write_idx = 0;
+    m_iv[0].iov_base = (void*)(m_linger ? response.keep_alive : response.close);
+    m_iv[0].iov_len = m_linger ? response.keep_alive_len : response.close_len;
+    m_bytes_to_send = m_iv[0].iov_len;
+    m_iv_count = 1;
 }
 
 // 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
@@ -473,32 +958,22 @@ bool http_conn::process_write(HTTP_CODE ret)
     switch(ret)
     {
         case INTERNAL_ERROR:      
-            add_status_line(500, error_500_title);
-            add_headers(strlen(error_500_form));    // 输出HTTP响应头部字段
-            if (!add_content(error_500_form))       // 输出HTTP响应内容
-                return false;                       // 如果写缓冲区已满则返回false
-            break;
+            use_prebuilt(error_500);
+            return true;
         case BAD_REQUEST:
-            add_status_line(400, error_400_title);
-            add_headers(strlen(error_400_form));
-            if (!add_content(error_400_form)) 
-                return false;
-            break;
+            use_prebuilt(error_400);
+            return true;
         case NO_RESOURCE:
-            add_status_line(404, error_404_title);
-            add_headers(strlen(error_404_form));
-            if (!add_content(error_404_form)) 
-                return false;
-            break;
+            use_prebuilt(error_404);
+            return true;
         case FORBIDDEN_REQUEST:
-            add_status_line(403, error_403_title);
-            add_headers(strlen(error_403_form));
-            if (!add_content(error_403_form)) 
-                return false;
-            break;
+            use_prebuilt(error_403);
+            return true;
         case FILE_REQUEST:         // 客户端请求为文件请求，且获取文件成功（文件已通过内存映射读取到）
-            add_status_line(200, ok_200_title);
-            add_headers(m_file_stat.st_size);   // 对于200状态的响应，响应头部写入了m_write_buf中
+            if(!add_literal("HTTP/1.1 200 OK\r\n") || !add_date() || !add_cache_headers()
+                || (m_content_gzip && !add_literal("Content-Encoding: gzip\r\n"))
+                || !add_headers(m_file_stat.st_size, m_content_type))   // 对于200状态的响应，响应头部写入了m_write_buf中
+                return false;
             m_iv[0].iov_base = m_write_buf; 
             m_iv[0].iov_len = m_write_idx;
             m_iv[1].iov_base = m_file_address;  // 对于200状态的响应，响应内容在m_file_address中
@@ -506,6 +981,30 @@ bool http_conn::process_write(HTTP_CODE ret)
             m_bytes_to_send = m_write_idx + m_file_stat.st_size;
             m_iv_count = 2;
             return true;
+        case DYNAMIC_REQUEST:     // 路由处理器已经把响应写入了m_write_buf
+        case EVENT_STREAM:        // SSE的响应头，没有Content-Length，之后的事件由stream_events发送
+            break;
+        case NOT_MODIFIED:        // 304响应没有消息体，也不带Content-Length和Content-Type，只有验证器和Vary
+            if (!add_literal("HTTP/1.1 304 Not Modified\r\n") || !add_date() || !add_cache_headers()
+                || !add_linger())
+                return false;
+            break;
+        case BAD_GATEWAY:
+            use_prebuilt(error_502);
+            return true;
+        case TOO_MANY_REQUESTS:
+            if (!add_literal("HTTP/1.1 429 Too Many Requests\r\n") || !add_date()
+                || !add_literal("Retry-After: ") || !add_number(m_retry_after) || !add_literal("\r\n")
+                || !add_headers(sizeof(ERROR_429_FORM) - 1) || !add_literal(ERROR_429_FORM))
+                return false;
+            break;
+        case GATEWAY_TIMEOUT:
+            use_prebuilt(error_504);
+            return true;
+        case PROXIED_REQUEST:     // 响应已经由proxy_request发送完毕
+            m_iv_count = 0;
+            m_bytes_to_send = 0;
+            return true;
         default:
             return false;
     }
@@ -517,20 +1016,761 @@ bool http_conn::process_write(HTTP_CODE ret)
     return true;
 }
 
-// 由线程池中的工作线程调用，这是处理HTTP请求的入口函数
+// 由线程池中的工作线程调用：恢复在pool_awaiter处挂起的连接协程，在工作线程中生成响应
 void http_conn::process() 
 {
-    // 解析HTTP请求
-    HTTP_CODE read_ret = process_read();
-    if(read_ret == NO_REQUEST)      // 如果解析到的请求不完整，则监听EPOLLIN事件，等待下一次读取客户端输入
-    {
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
+    std::coroutine_handle<> h = m_slot->coro;
+    m_slot->coro = nullptr;
+    h.resume();
+}
+
+// 由reactor在连接的socket（或上游连接、定时器）上有事件时调用：恢复在event_awaiter或upstream_awaiter处挂起的连接协程
+void http_conn::on_event(conn_slot* slot, uint32_t events, int source)
+{
+    /* 协程没有挂起在reactor上，或者没有在等待这个来源的事件（例如同一批事件中，上游连接的事件已经恢复了协程，
+       定时器的事件就过期了），忽略；已经关闭的连接的事件在conn_table::lookup中就因为代数不符被丢弃了 */
+    if(!slot->coro || !(slot->wait_sources & (1 << source)))
+        return;
+    slot->wait_sources = 0;
+    slot->event_source = source;
+    slot->events = events;
+    std::coroutine_handle<> h = slot->coro;
+    slot->coro = nullptr;
+    h.resume();
+}
+
+void http_conn::event_awaiter::await_suspend(std::coroutine_handle<> h)
+{
+    conn->m_slot->coro = h;
+    conn->m_slot->wait_sources = 1 << SOURCE_CLIENT;
+    /* 必须先保存句柄再注册事件：事件可能立即在reactor线程中触发并恢复协程，
+       所以注册之后不能再访问协程帧（包括这个awaiter本身） */
+    if(rearm)
+        modfd(conn->m_epollfd, conn->m_sockfd, conn->m_slot, ev);
+}
+
+void http_conn::upstream_awaiter::await_suspend(std::coroutine_handle<> h)
+{
+    int epollfd = conn->m_epollfd, upstream_fd = conn->m_upstream_fd;
+    conn_slot* slot = conn->m_slot;
+    slot->coro = h;
+    slot->wait_sources = (1 << SOURCE_UPSTREAM) | (1 << SOURCE_TIMER);
+    // 定时器以边沿触发的方式一直注册着，重新设置超时时间即可；最后注册上游连接的事件，此后不能再访问协程帧
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = timeout_ms / 1000;
+    its.it_value.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+    timerfd_settime(conn->m_timerfd, 0, &its, NULL);
+    watch_source(epollfd, EPOLL_CTL_MOD, upstream_fd, slot, SOURCE_UPSTREAM, ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP);
+}
+
+bool http_conn::upstream_awaiter::await_resume() const
+{
+    if(conn->m_slot->event_source != SOURCE_TIMER)
+        return true;
+    // 定时器的事件可能是上一次等待留下的（重新设置时间会清除到期计数），读不到到期计数说明没有超时
+    uint64_t expirations;
+    return ::read(conn->m_timerfd, &expirations, sizeof(expirations)) != sizeof(expirations);
+}
+
+void http_conn::timer_awaiter::await_suspend(std::coroutine_handle<> h)
+{
+    conn_slot* slot = conn->m_slot;
+    int timerfd = conn->m_timerfd;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = wait_ns / 1000000000;
+    its.it_value.tv_nsec = wait_ns % 1000000000;
+    slot->coro = h;
+    slot->wait_sources = 1 << SOURCE_TIMER;
+    timerfd_settime(timerfd, 0, &its, NULL);    // 此后不能再访问协程帧
+}
+
+void http_conn::timer_awaiter::await_resume() const
+{
+    // 读掉到期计数；也可能是上一次等待上游时留下的事件，调用者会重新计算还要等多久
+    uint64_t expirations;
+    if(::read(conn->m_timerfd, &expirations, sizeof(expirations)) < 0)
         return;
+}
+
+// 创建连接的定时器并以边沿触发的方式一直注册在epoll中，只在第一次使用时创建
+bool http_conn::open_timer()
+{
+    if(m_timerfd != -1)
+        return true;
+    m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(m_timerfd == -1)
+        return false;
+    watch_source(m_epollfd, EPOLL_CTL_ADD, m_timerfd, m_slot, SOURCE_TIMER, EPOLLIN | EPOLLET);
+    return true;
+}
+
+void http_conn::stream_awaiter::await_suspend(std::coroutine_handle<> h)
+{
+    conn->m_slot->coro = h;
+    conn->m_slot->wait_sources = (1 << SOURCE_CLIENT) | (1 << SOURCE_SSE);
+    if(rearm)
+        modfd(conn->m_epollfd, conn->m_sockfd, conn->m_slot, ev);
+}
+
+bool http_conn::pool_awaiter::await_suspend(std::coroutine_handle<> h)
+{
+    conn->m_slot->coro = h;
+    if(pool->addTask(conn, lane))
+        return true;    // 已经交给工作线程，同样不能再访问协程帧
+    queued = false;
+    return false;       // 任务队列已满，不挂起，由协程自己处理
+}
+
+/* 连接协程：一个连接从接受到关闭的全部处理过程。请求不完整时挂起等待下一次可读，
+   由reactor直接恢复继续解析，不需要每读一段数据就经过一次线程池；
+   请求完整后切换到工作线程生成响应（run-to-completion模式下不会阻塞的请求留在reactor线程中），
+   文件内容不在页缓存中时再切换到I/O线程读入；
+   发送不完时挂起等待EPOLLOUT，由reactor恢复继续发送 */
+conn_task http_conn::serve()
+{
+    bool rearm = false;     // 接受连接时addfd已经注册了EPOLLIN，第一次等待不必重新注册
+    bool buffered = false;  // 读缓冲区中是否有上一个请求之后已经读入的数据（流水线）
+
+    // HTTPS连接先完成TLS握手，握手过程中需要的读写事件同样挂起等待
+    if(m_ssl)
+    {
+        while(true)
+        {
+            int ret = SSL_do_handshake(m_ssl);
+            if(ret == 1)
+                break;
+            int err = SSL_get_error(m_ssl, ret);
+            if(err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+            {
+                close_conn();
+                co_return;
+            }
+            uint32_t events = co_await event_awaiter{this, err == SSL_ERROR_WANT_READ ? (int)EPOLLIN : (int)EPOLLOUT, rearm};
+            rearm = true;
+            if(events & (EPOLLHUP | EPOLLERR))
+            {
+                close_conn();
+                co_return;
+            }
+        }
+        m_tls_handshakes.fetch_add(1, std::memory_order_relaxed);
+        if(SSL_session_reused(m_ssl))
+            m_tls_resumed.fetch_add(1, std::memory_order_relaxed);
+        m_ktls_send = tls_context::ktls_send(m_ssl);
+        if(m_ktls_send)
+            m_ktls_connections.fetch_add(1, std::memory_order_relaxed);
     }
-    
-    // 生成响应
-    bool write_ret = process_write(read_ret);   // 如果写缓冲区满或写入错误，返回false
-    if(!write_ret)          // 如果写入错误，就关闭连接，相当于把这次请求丢弃
-        close_conn();       // m_sockfd会被置为-1表示已关闭
-    modfd(m_epollfd, m_sockfd, EPOLLOUT);
-}
\ No newline at end of file
+
+    while(true)
+    {
+        m_trace.begin(m_accept_time);
+        m_accept_time = 0;
+
+        // 读取并解析请求（reactor线程），读缓冲区中已有流水线请求时先解析它，不必等待可读
+        HTTP_CODE ret = NO_REQUEST;
+        while(ret == NO_REQUEST)
+        {
+            if(!buffered)
+            {
+                // OpenSSL内部可能还缓存着已经从socket读出的记录，这时不会再有可读事件，直接读取
+                if(!(m_ssl && SSL_has_pending(m_ssl)))
+                {
+                    /* 还没有读到下一个请求的任何数据，连接是空闲的：进程正在退出（热升级）时直接关闭，
+                       否则标记为空闲，开始退出时由reactor关闭（见close_idle） */
+                    bool idle = m_read_idx == 0;
+                    if(idle)
+                    {
+                        int expected = m_epollfd;
+                        m_idle_epollfd.store(m_epollfd);
+                        if(m_draining.load() && m_idle_epollfd.compare_exchange_strong(expected, -1))
+                        {
+                            close_conn();
+                            co_return;
+                        }
+                    }
+                    uint32_t events = co_await event_awaiter{this, EPOLLIN, rearm};
+                    rearm = true;
+                    if(idle)
+                        m_idle_epollfd.store(-1);
+                    if(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))     // TCP连接被对方关闭或对方关闭了写操作，挂起，错误
+                    {
+                        close_conn();
+                        co_return;
+                    }
+                }
+                if(!read())
+                {
+                    close_conn();
+                    co_return;
+                }
+            }
+            buffered = false;
+            m_trace.mark_once(TRACE_READ);
+            ret = process_read();
+        }
+        m_trace.mark(TRACE_PARSED);
+
+        // 进程正在退出（热升级）：这是连接上的最后一个请求，响应带Connection: close
+        if(m_draining.load(std::memory_order_relaxed))
+            m_linger = false;
+
+        // 超过了客户端IP的请求速率（或之前的响应透支了字节速率）：直接在当前线程回复429，不转发、不进入线程池
+        if(ret == GET_REQUEST && m_client && !rate_limiter::allow_request(m_client, &m_retry_after))
+            ret = TOO_MANY_REQUESTS;
+
+        // 代理路由的请求在当前线程中转发给上游服务器，等待上游时挂起，不占用工作线程
+        const proxy_route* route = ret == GET_REQUEST ? proxy::match(m_url) : NULL;
+        if(route)
+        {
+            ret = co_await proxy_request(route);
+            if(ret == CLOSED_CONNECTION)    // 已经开始发送响应后出错，只能关闭连接
+            {
+                close_conn();
+                co_return;
+            }
+        }
+
+        // run-to-completion模式下，不会阻塞的请求直接在reactor线程中生成响应并发送，省去线程切换
+        if(m_run_to_completion && ret == GET_REQUEST)
+            ret = do_request(true);
+        if(ret == NO_REQUEST || (!m_run_to_completion && ret == GET_REQUEST))
+        {
+            // 过载或任务队列已满时直接回复503，不让连接在队列里等待
+            if(m_pool->overloaded(m_lane))
+            {
+                reject_overload(m_pool->queueFull(m_lane));
+                co_return;
+            }
+            m_trace.mark(TRACE_QUEUED);
+            if(!co_await pool_awaiter{this, m_pool, m_lane})
+            {
+                reject_overload(true);
+                co_return;
+            }
+            m_trace.mark(TRACE_DEQUEUED);
+            m_offloaded_requests.fetch_add(1, std::memory_order_relaxed);
+            // 生成响应（工作线程）
+            ret = do_request();
+        }
+        else if(!route && ret != COLD_FILE)
+            m_inline_requests.fetch_add(1, std::memory_order_relaxed);
+
+        /* 冷文件交给专门的I/O线程池读入页缓存后，在I/O线程中继续发送。工作线程和reactor都不会阻塞在磁盘上，
+           热文件和动态请求不会排在磁盘读取的后面 */
+        if(ret == COLD_FILE)
+        {
+            if(m_io_pool->overloaded())
+            {
+                unmap();
+                reject_overload(m_io_pool->queueFull());
+                co_return;
+            }
+            if(!co_await pool_awaiter{this, m_io_pool, 0})
+            {
+                unmap();
+                reject_overload(true);
+                co_return;
+            }
+            m_cold_requests.fetch_add(1, std::memory_order_relaxed);
+            prefetch_mapping(m_file_address, m_file_stat.st_size);
+            ret = FILE_REQUEST;
+        }
+        if(!process_write(ret))     // 如果写缓冲区满或写入错误，就关闭连接，相当于把这次请求丢弃
+        {
+            close_conn();
+            co_return;
+        }
+        m_trace.mark(TRACE_HANDLED);
+        if(m_client)
+            rate_limiter::charge_bytes(m_client, m_bytes_to_send);
+
+        // 发送响应，TCP写缓冲满时挂起，由reactor在EPOLLOUT时恢复
+        m_more_pending = m_linger && has_pipelined_request();
+        if(m_ssl && !m_ktls_send && m_iv_count == 2 && !m_corked)    // 用户态TLS不能带MSG_MORE，用TCP_CORK合并头部和内容的记录
+            set_cork(true);
+        /* 匹配限速规则的响应按令牌发送：令牌不够一个发送块时不等待EPOLLOUT（socket上的事件此时也没有注册），
+           而是在连接的定时器上挂起，到时由reactor恢复；每次发送的字节数不超过令牌数 */
+        m_shape.start(bandwidth_shaper::enabled() && ret != EVENT_STREAM && m_url ? bandwidth_shaper::match(m_url) : NULL);
+        if(m_shape.rule && open_timer())
+            bandwidth_shaper::m_shaped.fetch_add(1, std::memory_order_relaxed);
+        else
+            m_shape.rule = NULL;
+        while(true)
+        {
+            long limit = 0;
+            if(m_shape.rule)
+            {
+                limit = m_shape.budget();
+                uint64_t wait_ns = m_shape.wait_ns(m_bytes_to_send);
+                if(wait_ns > 0)
+                {
+                    bandwidth_shaper::m_paused.fetch_add(1, std::memory_order_relaxed);
+                    co_await timer_awaiter{this, wait_ns};
+                    continue;
+                }
+            }
+            int before = m_bytes_to_send;
+            if(!write(limit))
+            {
+                close_conn();
+                co_return;
+            }
+            if(m_shape.rule)
+            {
+                m_shape.consume(before - m_bytes_to_send);
+                bandwidth_shaper::m_bytes.fetch_add(before - m_bytes_to_send, std::memory_order_relaxed);
+            }
+            if(m_bytes_to_send == 0)
+                break;
+            if(m_shape.rule && m_shape.tokens < 1)     // 令牌用完了，回到开头等待定时器
+                continue;
+            if(m_trace.sampled)
+                ++m_trace.out_waits;
+            m_write_waits.fetch_add(1, std::memory_order_relaxed);
+            uint32_t events = co_await event_awaiter{this, EPOLLOUT, true};
+            if(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            {
+                unmap();
+                close_conn();
+                co_return;
+            }
+        }
+
+        m_trace.mark(TRACE_DONE);
+        tracer::finish(m_trace, m_url, ret);
+
+        // SSE连接不再处理后续的请求，一直推送事件到连接关闭
+        if(ret == EVENT_STREAM)
+        {
+            co_await stream_events();
+            close_conn();
+            co_return;
+        }
+
+        // 根据HTTP请求中的Connection字段决定是否保持连接
+        if(!m_linger)
+        {
+            close_conn();
+            co_return;
+        }
+        // 把流水线中已经读入的后续数据移到读缓冲区开头，作为下一个请求的开始
+        int left = m_request_end > 0 ? m_read_idx - m_request_end : 0;
+        if(left > 0)
+            memmove(m_read_buf, m_read_buf + m_request_end, left);
+        init(left);
+        buffered = left > 0;
+    }
+}
+
+/* SSE连接的事件流：响应头已经发送，之后只把订阅的频道上发布的事件发送给客户端。
+   订阅者列表只能在连接所属的reactor线程中访问，所以先等待一次EPOLLOUT（发送缓冲区是空的，立即就绪）回到reactor线程再订阅。
+   之后协程由两种来源恢复：sse_hub把新事件放进待发送队列，或者socket可写（之前没写完）、可读、被关闭。
+   客户端发来的数据被丢弃；队列满（客户端读得太慢）时断开连接，不让它拖住发布者或占用无限的内存 */
+sub_task<http_conn::HTTP_CODE> http_conn::stream_events()
+{
+    if(m_corked)
+        set_cork(false);
+    m_sse_queue = new sse_event[sse_hub::backlog()];
+    m_sse_head = 0;
+    m_sse_count = 0;
+    m_sse_offset = 0;
+    m_sse_overflow = false;
+    uint32_t events = co_await stream_awaiter{this, EPOLLIN | EPOLLOUT, true};
+    sse_hub::subscribe(m_sse_channel, this, m_epollfd);
+    int armed = 0;      // socket上已经注册、还没有触发的事件，0表示需要重新注册
+    while(true)
+    {
+        if(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            break;
+        if(m_draining.load(std::memory_order_relaxed))     // 进程正在退出（热升级），结束事件流
+            break;
+        if(events & EPOLLIN)
+        {
+            int n;
+            while((n = m_ssl ? tls_recv(m_read_buf, m_read_buffer_size) : recv(m_sockfd, m_read_buf, m_read_buffer_size, 0)) > 0)
+                ;
+            if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                break;
+        }
+        if(m_sse_overflow)
+        {
+            sse_hub::m_dropped.fetch_add(1, std::memory_order_relaxed);
+            break;
+        }
+        if(!sse_flush())
+            break;
+        if(events)      // 由socket的事件恢复，EPOLLONESHOT的注册已经用掉了
+            armed = 0;
+        int ev = m_sse_count ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        bool rearm = ev != armed;
+        armed = ev;
+        events = co_await stream_awaiter{this, ev, rearm};
+    }
+    co_return CLOSED_CONNECTION;
+}
+
+// 把待发送队列中的事件尽量写出（一次最多16个事件），发送缓冲区满时保留剩余的部分返回true，写出错返回false
+bool http_conn::sse_flush()
+{
+    int capacity = sse_hub::backlog();
+    while(m_sse_count > 0)
+    {
+        struct iovec iv[16];
+        int count = m_sse_count < 16 ? m_sse_count : 16;
+        for(int i = 0; i < count; ++i)
+        {
+            const std::string& ev = *m_sse_queue[(m_sse_head + i) % capacity];
+            int skip = i == 0 ? m_sse_offset : 0;
+            iv[i].iov_base = (void*)(ev.data() + skip);
+            iv[i].iov_len = ev.size() - skip;
+        }
+        int sent;
+        if(m_ssl && !m_ktls_send)
+            sent = tls_send(iv, count);
+        else
+        {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iv;
+            msg.msg_iovlen = count;
+            sent = sendmsg(m_sockfd, &msg, MSG_NOSIGNAL);
+        }
+        if(sent < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        // 释放已经发送完的事件，最后一个事件可能只发送了一部分
+        while(sent > 0)
+        {
+            int left = (int)m_sse_queue[m_sse_head]->size() - m_sse_offset;
+            if(sent < left)
+            {
+                m_sse_offset += sent;
+                break;
+            }
+            sent -= left;
+            m_sse_queue[m_sse_head].reset();
+            m_sse_head = (m_sse_head + 1) % capacity;
+            --m_sse_count;
+            m_sse_offset = 0;
+        }
+    }
+    return true;
+}
+
+/* 由sse_hub在reactor线程中调用：把事件放进待发送队列。队列原本为空时恢复协程立即发送；
+   不为空说明协程正在等待EPOLLOUT，可写时会一并发送，不必恢复。队列满时标记为溢出，恢复协程断开连接 */
+void http_conn::sse_deliver(const sse_event& ev)
+{
+    int capacity = sse_hub::backlog();
+    if(m_sse_count == capacity)
+    {
+        if(m_sse_overflow)
+            return;
+        m_sse_overflow = true;
+    }
+    else
+    {
+        m_sse_queue[(m_sse_head + m_sse_count) % capacity] = ev;
+        if(++m_sse_count > 1)
+            return;
+    }
+    on_event(m_slot, 0, SOURCE_SSE);
+}
+
+// 由sse_hub在reactor线程中调用：恢复协程，它发现进程正在退出后结束事件流
+void http_conn::sse_end()
+{
+    on_event(m_slot, 0, SOURCE_SSE);
+}
+
+/* 热升级：遍历连接表，认领本reactor上空闲的连接，关闭它们的读方向。连接协程挂起在EPOLLIN上（或者正要挂起，
+   这时由注册的事件补上），reactor收到EPOLLRDHUP后由协程照常关闭连接。不直接恢复协程，因为标记为空闲时
+   协程可能还没有在工作线程中挂起完；认领之后只有本reactor线程能恢复它，所以socket在shutdown之前不会被关闭 */
+void http_conn::close_idle(int epollfd)
+{
+    int capacity = conn_table::capacity();
+    for(int i = 0; i < capacity; ++i)
+    {
+        http_conn* conn = conn_table::at(i)->conn;
+        int expected = epollfd;
+        if(conn->m_idle_epollfd.compare_exchange_strong(expected, -1))
+            shutdown(conn->m_sockfd, SHUT_RD);
+    }
+}
+
+/* 生成转发给上游的请求：请求行、客户端的头部字段（去掉逐跳头部）、X-Forwarded-For和Connection: keep-alive，
+   以及消息体。解析请求时行尾的"\r\n"被改成了"\0\0"，这里逐行恢复。请求过大返回-1 */
+int http_conn::build_proxy_request(char* buf, int size)
+{
+    char client_ip[INET_ADDRSTRLEN];
+    if(m_unix)
+        strcpy(client_ip, "unix:");     // 与nginx的$remote_addr相同
+    else
+        inet_ntop(AF_INET, &m_address.sin_addr, client_ip, sizeof(client_ip));
+    int n = snprintf(buf, size, "GET %s HTTP/1.1\r\n", m_url);
+    if(n < 0 || n >= size)
+        return -1;
+    // 头部字段从请求行之后开始（请求行以版本号结束），到空行为止
+    for(char* line = m_version + strlen(m_version) + 2; *line; line += strlen(line) + 2)
+    {
+        if(proxy::hop_by_hop(line))
+            continue;
+        int len = snprintf(buf + n, size - n, "%s\r\n", line);
+        if(len < 0 || len >= size - n)
+            return -1;
+        n += len;
+    }
+    int len = snprintf(buf + n, size - n, "X-Forwarded-For: %s\r\nConnection: keep-alive\r\n\r\n", client_ip);
+    if(len < 0 || len >= size - n || m_content_length > size - n - len)
+        return -1;
+    n += len;
+    memcpy(buf + n, m_read_buf + m_request_end - m_content_length, m_content_length);
+    return n + m_content_length;
+}
+
+// 结束对上游连接的使用：可以复用时放回当前线程的空闲连接池，否则关闭
+void http_conn::release_upstream(upstream* up, bool reuse)
+{
+    epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_upstream_fd, NULL);
+    if(reuse)
+        proxy::put_idle(up, m_upstream_fd);
+    else
+        close(m_upstream_fd);
+    m_upstream_fd = -1;
+    up->active.fetch_sub(1, std::memory_order_relaxed);
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    timerfd_settime(m_timerfd, 0, &its, NULL);     // 停止定时器
+}
+
+/* 转发请求：选择上游并取得连接（优先复用空闲连接）、发送请求、读取并改写响应头部，然后一边读取消息体
+   一边发送给客户端，每次只缓存一个缓冲区的数据。复用的空闲连接可能恰好被上游关闭，这时换一个新连接重试一次。
+   返回PROXIED_REQUEST表示响应已经发送；在发送响应之前失败时返回BAD_GATEWAY或GATEWAY_TIMEOUT，
+   由process_write输出错误页面；开始发送之后失败返回CLOSED_CONNECTION */
+sub_task<http_conn::HTTP_CODE> http_conn::proxy_request(const proxy_route* route)
+{
+    std::unique_ptr<char[]> buffer(new char[proxy::BUFFER_SIZE * 2]);
+    char* in = buffer.get();                    // 从上游读到的数据
+    char* out = in + proxy::BUFFER_SIZE;        // 发给上游的请求，之后用来存放改写后的响应头部
+    int request_len = build_proxy_request(out, proxy::BUFFER_SIZE);
+    if(request_len < 0)
+        co_return BAD_REQUEST;
+    if(!open_timer())
+        co_return INTERNAL_ERROR;
+    proxy::m_requests.fetch_add(1, std::memory_order_relaxed);
+
+    HTTP_CODE failure = BAD_GATEWAY;
+    for(int attempt = 0; attempt < 2; ++attempt)
+    {
+        upstream* up = proxy::pick(route);
+        bool reused = true;
+        m_upstream_fd = proxy::take_idle(up);
+        if(m_upstream_fd == -1)
+        {
+            reused = false;
+            m_upstream_fd = proxy::connect_to(up);
+            if(m_upstream_fd == -1)
+            {
+                proxy::report(up, false);
+                continue;
+            }
+        }
+        up->active.fetch_add(1, std::memory_order_relaxed);
+        watch_source(m_epollfd, EPOLL_CTL_ADD, m_upstream_fd, m_slot, SOURCE_UPSTREAM, EPOLLONESHOT);
+
+        // 新连接先等待连接完成
+        if(!reused)
+        {
+            bool ready = co_await upstream_awaiter{this, EPOLLOUT, proxy::CONNECT_TIMEOUT_MS};
+            int err = 0;
+            socklen_t err_len = sizeof(err);
+            if(!ready || getsockopt(m_upstream_fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0)
+            {
+                failure = ready ? BAD_GATEWAY : GATEWAY_TIMEOUT;
+                release_upstream(up, false);
+                proxy::report(up, false);
+                continue;
+            }
+        }
+
+        // 发送请求
+        bool ok = true;
+        for(int sent = 0; ok && sent < request_len; )
+        {
+            int n = send(m_upstream_fd, out + sent, request_len - sent, MSG_NOSIGNAL);
+            if(n > 0)
+                sent += n;
+            else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                if(!co_await upstream_awaiter{this, EPOLLOUT, proxy::READ_TIMEOUT_MS})
+                {
+                    failure = GATEWAY_TIMEOUT;
+                    ok = false;
+                }
+            }
+            else
+                ok = false;
+        }
+
+        // 读取响应头部
+        upstream_response resp;
+        int header_out_len = 0;
+        int got = 0;
+        int parsed = 0;
+        while(ok && parsed == 0)
+        {
+            int n = recv(m_upstream_fd, in + got, proxy::BUFFER_SIZE - got, 0);
+            if(n > 0)
+            {
+                got += n;
+                parsed = proxy::parse_response(in, got, &resp, out, proxy::BUFFER_SIZE - 64, &header_out_len);
+                if(parsed < 0)
+                {
+                    failure = BAD_GATEWAY;
+                    ok = false;
+                }
+            }
+            else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                if(!co_await upstream_awaiter{this, EPOLLIN, proxy::READ_TIMEOUT_MS})
+                {
+                    failure = GATEWAY_TIMEOUT;
+                    ok = false;
+                }
+            }
+            else
+            {
+                failure = BAD_GATEWAY;
+                ok = false;
+            }
+        }
+        if(!ok)
+        {
+            release_upstream(up, false);
+            // 复用的连接在收到任何响应之前出错，多半是上游恰好关闭了空闲连接，不算上游失败，换新连接重试
+            if(reused && got == 0 && failure == BAD_GATEWAY)
+                continue;
+            proxy::report(up, false);
+            co_return failure;
+        }
+
+        /* 根据响应的长度确定消息体的结尾：Content-Length、chunked，或者直到上游关闭连接（此时客户连接也要关闭）。
+           204和304响应一定没有消息体，304的Content-Length是200响应的长度，不能按它等待 */
+        bool no_body = resp.status == 204 || resp.status == 304;
+        long long remaining = no_body ? 0 : resp.content_length;
+        bool until_close = !no_body && !resp.chunked && resp.content_length < 0;
+        bool reuse = !resp.close && !until_close;
+        if(until_close)
+            m_linger = false;
+        chunk_scanner chunks;
+        header_out_len += snprintf(out + header_out_len, 64, "Connection: %s\r\n\r\n", m_linger ? "keep-alive" : "close");
+
+        // 第一批发送改写后的头部和已经读到的消息体，之后每读到一批消息体就发送一批
+        char* body = in + resp.header_len;
+        int body_len = got - resp.header_len;
+        m_iv[0].iov_base = out;
+        m_iv[0].iov_len = header_out_len;
+        m_iv_count = 1;
+        bool done = false;
+        while(true)
+        {
+            // 消息体中属于这个响应的部分；多出来的数据说明上游的行为不正常，不再复用这个连接
+            int own = body_len;
+            if(no_body)
+            {
+                own = 0;
+                done = true;
+            }
+            else if(resp.chunked)
+            {
+                own = chunks.feed(body, body_len);
+                if(own < 0)
+                    break;
+                done = chunks.state == chunk_scanner::DONE;
+            }
+            else if(!until_close)
+            {
+                if(own > remaining)
+                    own = remaining;
+                remaining -= own;
+                done = remaining == 0;
+            }
+            if(own < body_len)
+                reuse = false;
+            m_iv[m_iv_count].iov_base = body;
+            m_iv[m_iv_count].iov_len = own;
+            m_iv_count++;
+
+            m_bytes_to_send = 0;
+            for(int i = 0; i < m_iv_count; ++i)
+                m_bytes_to_send += m_iv[i].iov_len;
+            m_bytes_have_send = 0;
+            ok = true;
+            while(ok && m_bytes_to_send > 0)
+            {
+                if(!write())
+                    ok = false;
+                else if(m_bytes_to_send > 0)
+                {
+                    m_write_waits.fetch_add(1, std::memory_order_relaxed);
+                    uint32_t events = co_await event_awaiter{this, EPOLLOUT, true};
+                    if(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                        ok = false;
+                }
+            }
+            if(!ok)     // 客户端出错，上游的连接上还有没读完的响应，不能复用
+            {
+                release_upstream(up, false);
+                proxy::report(up, true);
+                co_return CLOSED_CONNECTION;
+            }
+            if(done)
+                break;
+
+            // 读取下一批消息体
+            m_iv_count = 0;
+            body = in;
+            body_len = 0;
+            while(body_len == 0)
+            {
+                int want = proxy::BUFFER_SIZE;
+                if(remaining > 0 && remaining < want)
+                    want = remaining;
+                int n = recv(m_upstream_fd, in, want, 0);
+                if(n > 0)
+                    body_len = n;
+                else if(n == 0 && until_close)
+                {
+                    done = true;
+                    break;
+                }
+                else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    if(!co_await upstream_awaiter{this, EPOLLIN, proxy::READ_TIMEOUT_MS})
+                        break;
+                }
+                else
+                    break;
+            }
+            if(done && body_len == 0)
+                break;
+            if(body_len == 0)       // 上游超时或在响应中途关闭了连接，响应已经发送了一部分，只能关闭客户连接
+            {
+                release_upstream(up, false);
+                proxy::report(up, false);
+                co_return CLOSED_CONNECTION;
+            }
+        }
+        if(!done)       // chunked编码错误
+        {
+            release_upstream(up, false);
+            proxy::report(up, false);
+            co_return CLOSED_CONNECTION;
+        }
+        release_upstream(up, reuse);
+        proxy::report(up, true);
+        co_return PROXIED_REQUEST;
+    }
+    co_return failure;
+}
@@ -19,13 +19,28 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <memory>
+#include <atomic>
+#include "bundle.h"
+#include "coroutine.h"
+#include "threadpool.h"
+#include "tls.h"
+#include "trace.h"
+#include "proxy.h"
+#include "capture.h"
+#include "ratelimit.h"
+#include "sse.h"
+#include "shaper.h"
+#include "latency.h"
+#include "conn_table.h"
+
+struct prebuilt_response;
 
 class http_conn
 {
 public:
-    static const int FILENAME_LEN = 200;        // 文件名的最大长度
-    static const int READ_BUFFER_SIZE = 2048;   // 读缓冲区的大小
-    static const int WRITE_BUFFER_SIZE = 1024;  // 写缓冲区的大小
+    static const int WRITE_BUFFER_SIZE = 2048;  // 写缓冲区的大小，需放得下最坏情况下的/status响应（router.cpp中有静态检查）
     
     // HTTP请求方法，这里只支持GET
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
@@ -48,79 +63,238 @@ public:
         FILE_REQUEST        :   文件请求,获取文件成功
         INTERNAL_ERROR      :   表示服务器内部错误
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
+        DYNAMIC_REQUEST     :   路由处理器已将完整的响应写入写缓冲区
+        NOT_MODIFIED        :   客户端缓存的资源仍然有效（If-None-Match与ETag一致）
+        PROXIED_REQUEST     :   请求已转发给上游服务器，响应已经发送给客户端
+        BAD_GATEWAY         :   上游服务器无法连接或返回了错误的响应
+        GATEWAY_TIMEOUT     :   上游服务器超时
+        COLD_FILE           :   文件已映射，但内容不全在页缓存中，发送前需要先在I/O线程中读入
+        TOO_MANY_REQUESTS   :   客户端IP超过了请求速率或字节速率的限制
+        EVENT_STREAM        :   路由处理器已将SSE的响应头写入写缓冲区，发送后连接转为订阅频道的事件流
     */
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION, DYNAMIC_REQUEST, NOT_MODIFIED,
+                     PROXIED_REQUEST, BAD_GATEWAY, GATEWAY_TIMEOUT, COLD_FILE, TOO_MANY_REQUESTS, EVENT_STREAM };
+
+    /* 唤醒连接协程的事件来源，和连接的ID一起编码在epoll_event.data.u64中（见conn_table.h），
+       reactor据此找到连接；协程只在等待的来源上有事件时才被恢复，同一批中过期的事件被忽略。
+       SOURCE_SSE不对应文件描述符，是sse_hub在reactor线程中把事件交给订阅的连接时恢复协程用的 */
+    enum EVENT_SOURCE { SOURCE_CLIENT = 0, SOURCE_UPSTREAM, SOURCE_TIMER, SOURCE_SSE };
     
+    // 请求在线程池中排队的通道：小请求（小文件、缓存中的结果），大请求（大文件、需要访问文件系统），管理请求（路由处理器）
+    enum LANE { LANE_SMALL = 0, LANE_LARGE, LANE_ADMIN, LANES };
+    static const int SMALL_FILE_SIZE = 65536;   // 不超过这个大小的文件算作小请求
+
     // 从状态机的三种可能状态，即行的读取状态，分别表示
     // 1.读取到一个完整的行 2.行出错 3.行数据尚且不完整
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+    friend class sse_hub;   // 分发事件时访问订阅状态
 public:
     http_conn() {}
     ~http_conn() {}
 public:
-    void init(int sockfd, const sockaddr_in& addr); // 初始化新接受的连接
+    /* 初始化新接受的连接，slot为conn_table为它分配的项（slot->conn就是这个对象，slot->fd为连接的socket），
+       epollfd为负责该连接的reactor的epoll，tls表示来自HTTPS端口。
+       来自Unix域socket的连接的addr只有sin_family为AF_UNIX，地址为0（不按IP限流） */
+    void init(conn_slot* slot, const sockaddr_in& addr, int epollfd, bool tls = false);
     void close_conn();  // 关闭连接
-    void process();     // 处理客户端请求
+    void process();     // 在工作线程中继续处理客户端请求
+    // reactor通知连接的socket（或上游连接、定时器）上有事件；只访问连接表的项，协程要被恢复时才访问连接对象
+    static void on_event(conn_slot* slot, uint32_t events, int source);
     bool read();        // 非阻塞读
-    bool write();       // 非阻塞写
+    bool write(long limit = 0);     // 非阻塞写，最多发送一个写量子，limit大于0时最多发送limit字节
+    void set_read_buffer(char* buf) { m_read_buf = buf; }  // 读缓冲区由外部统一分配，大小为m_read_buffer_size
+    void reject_overload(bool queue_full);  // 过载时由主线程直接回复503并关闭连接，不经过线程池
 private:
-    void init();        // 初始化连接
+    void init(int keep_bytes = 0);  // 初始化连接（为下一个请求重置状态）
+    conn_task serve();  // 连接协程
+    sub_task<HTTP_CODE> proxy_request(const proxy_route* route);    // 把请求转发给上游服务器并把响应发送给客户端
+    int build_proxy_request(char* buf, int size);
+    bool open_timer();      // 创建连接的定时器m_timerfd（已经有了时直接返回true）
+    void release_upstream(upstream* up, bool reuse);
     HTTP_CODE process_read();    // 解析HTTP请求
     bool process_write(HTTP_CODE ret);    // 填充HTTP应答
 
     // 下面这一组函数被process_read调用以分析HTTP请求
     HTTP_CODE parse_request_line(char* text);
     HTTP_CODE parse_headers(char* text);
-    HTTP_CODE parse_content(char* text);
-    HTTP_CODE do_request();
+    HTTP_CODE parse_content();
+    HTTP_CODE do_request(bool nonblocking = false);
+    HTTP_CODE do_bundle_request(const bundle_entry* entry);
+    int classify_lane() const;
     char* get_line() { return m_read_buf + m_start_line; }  // 获取读缓冲区的HTTP请求信息中，当前正在解析的行的起始位置
     LINE_STATUS parse_line();       // 从状态机，用于解析一行内容
 
-    // 这一组函数被process_write调用以填充HTTP应答。
     void unmap();
-    bool add_response(const char* format, ...);
-    bool add_content(const char* content);
-    bool add_content_type();
-    bool add_status_line(int status, const char* title);
-    bool add_headers(int content_length);
     bool add_content_length(int content_length);
     bool add_linger();
     bool add_blank_line();
+    bool add_cache_headers();
+    bool add_number(long value);
+    bool add_date();
+    void use_prebuilt(const prebuilt_response& response);
+    void set_cork(bool on);
+    int tls_recv(char* buf, int len);
+    int tls_send(const struct iovec* iv, int iv_count);
+    bool has_pipelined_request() const;
+    sub_task<HTTP_CODE> stream_events();    // SSE连接：订阅频道，把发布的事件发送给客户端，直到连接关闭
+    bool sse_flush();
+    void sse_deliver(const sse_event& ev);
+    void sse_end();
 
 public:
-    static int m_epollfd;       // 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
-    static int m_user_count;    // 统计连接的用户的数量
+    // 这一组函数被process_write和路由处理器（见router.h）调用以填充HTTP应答。
+    bool add_response(const char* format, ...);
+    bool add_bytes(const char* data, int len);
+    // 追加字符串常量，长度在编译时确定，拼接就是一次定长的memcpy
+    template <size_t N>
+    bool add_literal(const char (&text)[N]) { return add_bytes(text, (int)N - 1); }
+    bool add_content(const char* content);
+    bool add_content_type(const char* content_type = "text/html");
+    bool add_status_line(int status, const char* title);
+    bool add_headers(int content_length, const char* content_type = "text/html");
+    void set_event_stream(sse_channel* channel) { m_sse_channel = channel; }  // 处理器返回EVENT_STREAM前设置要订阅的频道
+    const char* url() const { return m_url; }
+    const sockaddr_in& client_address() const { return m_address; }
+
+public:
+    static int m_read_buffer_size;          // 每个连接的读缓冲区的大小（配置项read_buffer_size）
+    static std::atomic<int> m_user_count;   // 统计连接的用户的数量，多个reactor同时修改
+    static std::atomic<long> m_shed_queue_full;     // 因任务队列已满而拒绝的请求数
+    static std::atomic<long> m_shed_queue_delay;    // 因排队时间过长（过载）而拒绝的请求数
+    static threadPool<http_conn>* m_pool;           // 生成响应的线程池
+    static threadPool<http_conn>* m_io_pool;        // 把不在页缓存中的文件读入内存的线程池，只有它会阻塞在磁盘上
+    static bool m_run_to_completion;                // 不会阻塞的请求是否直接在reactor线程中处理
+    static std::atomic<long> m_inline_requests;     // 在reactor线程中直接处理的请求数
+    static std::atomic<long> m_offloaded_requests;  // 交给线程池处理的请求数
+    static std::atomic<long> m_cold_requests;       // 文件内容不在页缓存中、交给I/O线程池读入的请求数
+    static std::atomic<long> m_tls_handshakes;      // 完成的TLS握手数
+    static std::atomic<long> m_tls_resumed;         // 其中恢复了会话的握手数
+    static std::atomic<long> m_ktls_connections;    // 其中发送方向交给了内核（kTLS）的连接数
+    static std::atomic<bool> m_draining;            // 监听socket已经交给了新进程，连接处理完当前请求就关闭
+    // 热升级：在第epollfd个reactor线程中调用，关闭这个reactor上空闲（在等待下一个请求）的连接
+    static void close_idle(int epollfd);
+    /* 发送的背压：TCP_NOTSENT_LOWAT限制每个连接在内核中还没发出的数据量，发送缓冲区不再被慢客户端填满；
+       写量子限制一次write()发送的字节数，超过后让出线程，由reactor在其他连接之后接着发送 */
+    static int m_notsent_lowat;                     // 字节，0表示使用内核的默认值（不限制）
+    static int m_write_quantum;                     // 字节，0表示不限制
+    static std::atomic<long> m_write_waits;         // 响应没有一次写完、等待EPOLLOUT的次数
+    static std::atomic<long> m_quantum_yields;      // 其中因为用完写量子而让出的次数
+
+private:
+    // 等待socket上的事件：保存协程句柄后重新注册EPOLLONESHOT事件，事件到来时由reactor恢复协程
+    struct event_awaiter
+    {
+        http_conn* conn;
+        int ev;         // EPOLLIN或EPOLLOUT
+        bool rearm;     // 是否需要重新注册事件
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h);
+        uint32_t await_resume() const noexcept { return conn->m_slot->events; }
+    };
+    // 切换到线程池（m_pool或m_io_pool）：把连接加入任务队列，由工作线程恢复协程；队列已满时不挂起，co_await的结果为false
+    struct pool_awaiter
+    {
+        http_conn* conn;
+        threadPool<http_conn>* pool;
+        int lane;
+        bool queued = true;
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> h);
+        bool await_resume() const noexcept { return queued; }
+    };
+    // 等待上游连接上的事件，最多等待timeout_ms毫秒，co_await的结果为false表示超时
+    struct upstream_awaiter
+    {
+        http_conn* conn;
+        int ev;
+        int timeout_ms;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h);
+        bool await_resume() const;
+    };
+    // 等待连接的定时器（m_timerfd）到期，期间不关心socket上的事件；限速发送时用来等待令牌
+    struct timer_awaiter
+    {
+        http_conn* conn;
+        uint64_t wait_ns;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h);
+        void await_resume() const;
+    };
+    // SSE连接等待socket上的事件或者有新的事件要发送；被事件分发恢复时co_await的结果为0
+    struct stream_awaiter
+    {
+        http_conn* conn;
+        int ev;
+        bool rearm;     // socket上的EPOLLONESHOT事件还没有触发时，不必重新注册
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h);
+        uint32_t await_resume() const noexcept { return conn->m_slot->event_source == SOURCE_SSE ? 0 : conn->m_slot->events; }
+    };
 
 private:
     int m_sockfd;               // 该HTTP连接的socket
+    int m_epollfd;              // 该连接的socket注册在哪个reactor的epoll中（每个reactor有自己的epoll）
+    conn_slot* m_slot;                  // 连接在conn_table中的项：挂起的协程、等待的事件来源和恢复时的事件都在那里
+    int m_upstream_fd;                  // 正在转发请求的上游连接，没有为-1
+    int m_timerfd;                      // 等待上游时的超时定时器和限速发送的定时器，第一次使用时创建，没有为-1
+    shape_state m_shape;                // 当前响应的限速状态（见shaper.h）
     sockaddr_in m_address;      // 该HTTP连接的客户端socket地址
+    bool m_unix;                // 连接来自Unix域socket，没有TCP的选项（TCP_NODELAY、TCP_CORK）
+    SSL* m_ssl;                 // HTTPS连接的TLS会话，HTTP连接为NULL
+    bool m_ktls_send;           // 握手后发送方向由内核加密，响应可以直接写socket
+    uint64_t m_accept_time;     // 接受连接的时间，开启追踪时由第一个请求使用
+    request_trace m_trace;      // 当前请求的各阶段时间戳（见trace.h）
+    capture_stream m_capture;   // 流量捕获的状态（见capture.h）
+    client_slot* m_client;      // 客户端IP的限流状态（见ratelimit.h），不限流时为NULL
+    int m_retry_after;          // 回复429时建议的重试间隔（秒）
+    sse_channel* m_sse_channel; // SSE连接订阅的频道，普通连接为NULL
+    int m_sse_slot;             // 在频道的订阅者列表中的下标，还没有订阅时为-1
+    /* 连接空闲（在等待下一个请求的第一个字节）时为所属reactor的epoll，否则为-1。
+       热升级时reactor用CAS把它改回-1来认领空闲的连接，连接自己发现正在退出时也这样认领，只有一方会关闭它 */
+    std::atomic<int> m_idle_epollfd{-1};
+    sse_event* m_sse_queue;     // 待发送的事件（环形队列，容量为sse_hub::backlog()），进入事件流时分配
+    int m_sse_head;             // 队首的下标
+    int m_sse_count;            // 队列中的事件数
+    int m_sse_offset;           // 队首的事件已经发送的字节数
+    bool m_sse_overflow;        // 队列满时又有新事件，连接将被断开
     
-    char m_read_buf[READ_BUFFER_SIZE];    // 读缓冲区
+    char* m_read_buf;                     // 读缓冲区
     int m_read_idx;                       // 标识读缓冲区中已经读入的客户端数据的最后一个字节的下一个位置（读缓冲区的末尾）；该值被read()函数中的recv()函数改变
     int m_checked_idx;                    // 当前正在分析的字符在读缓冲区中的位置；该值被parse_line()函数改变
     int m_start_line;                     // 当前正在解析的行的起始位置
+    int m_request_end;                    // 完整的请求（包括消息体）在读缓冲区中的结束位置，之后是流水线中的下一个请求
 
     CHECK_STATE m_check_state;            // 主状态机当前所处的状态
+    int m_lane;                           // 请求在线程池中排队的通道（LANE）
 
     // 解析HTTP请求得到的信息
     METHOD m_method;                      // 请求方法
-    char m_real_file[FILENAME_LEN];       // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录
     char* m_url;                          // 客户请求的目标文件的文件名
     char* m_version;                      // HTTP协议版本号，我们仅支持HTTP1.1
     char* m_host;                         // 主机名
     int m_content_length;                 // HTTP请求的消息总长度
     bool m_linger;                        // HTTP请求是否要求保持连接
+    bool m_accept_gzip;                   // 客户端是否接受gzip编码（Accept-Encoding）
+    char* m_if_none_match;                // 客户端缓存的ETag（If-None-Match）
 
     char m_write_buf[WRITE_BUFFER_SIZE];  // 写缓冲区
     int m_write_idx;                      // 写缓冲区中待发送的字节数
     char* m_file_address;                 // 客户请求的目标文件被mmap到内存中的起始位置
     struct stat m_file_stat;              // 客户请求的目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
+    std::shared_ptr<asset_bundle> m_bundle;   // 响应内容来自静态资源包时，持有资源包直到发送完毕，此时m_file_address指向资源包内部，不需要munmap
+    const char* m_content_type;           // 响应内容的类型
+    const char* m_etag;                   // 响应内容的ETag（资源包中原始内容的），NULL表示没有
+    bool m_content_gzip;                  // 响应内容是否是gzip预压缩的版本，此时ETag带上-gz后缀
+    bool m_vary_encoding;                 // 内容有gzip预压缩的版本，两种版本的响应都要带Vary: Accept-Encoding
     // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
     struct iovec m_iv[2];            
     int m_iv_count;
 
     int m_bytes_have_send;                 // write()函数中已经发送给客户端的字节数
     int m_bytes_to_send;                   // write()函数中待发送给客户端的字节数    
+    bool m_more_pending;                   // 这个响应之后还有流水线中的响应要发送，发送时带MSG_MORE
+    bool m_corked;                         // socket是否处于TCP_CORK状态
 };
 
 #endif // HTTPCONNECTION_H
@@ -0,0 +1,91 @@
+#include "latency.h"
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sched.h>
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+// 旧的头文件中没有的定义，值与内核的ABI一致；内核不支持时setsockopt/ioctl返回错误
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef EPIOCSPARAMS
+struct epoll_params
+{
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+bool low_latency::m_enabled = false;
+uint64_t low_latency::m_spin_ns = 0;
+int low_latency::m_busy_poll_us = 0;
+std::atomic<long> low_latency::m_polls(0);
+std::atomic<long> low_latency::m_spin_hits(0);
+std::atomic<long> low_latency::m_sleeps(0);
+std::atomic<long> low_latency::m_spin_us(0);
+
+static bool listener_warned = false;
+static bool epoll_warned = false;
+
+void low_latency::init(int spin_us, int busy_poll_us, int reactors)
+{
+    m_enabled = true;
+    m_spin_ns = spin_us > 0 ? (uint64_t)spin_us * 1000 : 0;
+    m_busy_poll_us = busy_poll_us > 0 ? busy_poll_us : 0;
+    cpu_set_t set;
+    if(m_spin_ns && sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) <= reactors)
+        printf("low latency: %d cpus for %d spinning reactors, workers will compete with them\n", CPU_COUNT(&set), reactors);
+}
+
+uint64_t low_latency::now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void low_latency::tune_listener(int listenfd)
+{
+    if(!m_enabled || !m_busy_poll_us)
+        return;
+    int usec = m_busy_poll_us, on = 1;
+    if((setsockopt(listenfd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0
+        || setsockopt(listenfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) < 0) && !listener_warned)
+    {
+        listener_warned = true;
+        printf("SO_BUSY_POLL/SO_PREFER_BUSY_POLL not applied: %s\n", strerror(errno));
+    }
+}
+
+void low_latency::tune_epoll(int epollfd)
+{
+    if(!m_enabled || !m_busy_poll_us)
+        return;
+    struct epoll_params params;
+    memset(&params, 0, sizeof(params));
+    params.busy_poll_usecs = m_busy_poll_us;
+    params.busy_poll_budget = 64;   // NAPI_POLL_WEIGHT，不需要CAP_NET_ADMIN的最大值
+    params.prefer_busy_poll = 1;
+    if(ioctl(epollfd, EPIOCSPARAMS, &params) < 0 && !epoll_warned)
+    {
+        epoll_warned = true;
+        printf("epoll busy poll not applied: %s\n", strerror(errno));
+    }
+}
+
+void low_latency::quickack(int sockfd)
+{
+    int on = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+}
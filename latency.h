@@ -0,0 +1,44 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <atomic>
+
+/*
+    低延迟模式：用CPU换取微秒级的延迟，默认关闭。
+    reactor在处理完一批事件后先用超时为0的epoll_wait轮询spin_us微秒，期间有新事件就直接处理，
+    省去线程睡眠和被唤醒的开销（几微秒到几十微秒），超过预算仍然没有事件才阻塞在epoll_wait中。
+    监听socket设置SO_BUSY_POLL和SO_PREFER_BUSY_POLL（接受的连接继承这些选项），内核支持时（Linux 6.9+）
+    epoll也设置忙轮询的参数，让网卡驱动在轮询时直接收包而不等待中断；这些选项需要CAP_NET_ADMIN
+    或者不超过net.core.busy_read，设置失败时只打印一次提示。连接每次读到数据后重新设置TCP_QUICKACK
+    （它不是持久的选项），立即确认而不是延迟确认
+*/
+class low_latency
+{
+public:
+    static const int FLUSH_POLLS = 1024;    // reactor每轮询这么多次把本地的统计加到全局计数上
+
+    // spin_us为reactor轮询的预算（微秒），busy_poll_us为socket和epoll的忙轮询时间（微秒）；
+    // 轮询的reactor会占住CPU，可用的CPU不比reactor多时打印提示
+    static void init(int spin_us, int busy_poll_us, int reactors);
+    static bool enabled() { return m_enabled; }
+    static uint64_t spin_ns() { return m_spin_ns; }
+    static uint64_t now_ns();
+
+    static void tune_listener(int listenfd);   // 设置监听socket的忙轮询选项，接受的连接继承它们
+    static void tune_epoll(int epollfd);       // 设置epoll的忙轮询参数（EPIOCSPARAMS），内核不支持时忽略
+    static void quickack(int sockfd);          // 读到数据后调用
+
+    // reactor的轮询统计，由各reactor批量累加
+    static std::atomic<long> m_polls;           // 非阻塞的epoll_wait次数
+    static std::atomic<long> m_spin_hits;       // 其中取到了事件的次数（省掉了一次睡眠和唤醒）
+    static std::atomic<long> m_sleeps;          // 轮询超过预算后阻塞的次数
+    static std::atomic<long> m_spin_us;         // 轮询花掉的时间（微秒）
+
+private:
+    static bool m_enabled;
+    static uint64_t m_spin_ns;
+    static int m_busy_poll_us;
+};
+
+#endif // LATENCY_H
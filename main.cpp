@@ -8,14 +8,34 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <new>
 #include "threadpool.h"
 #include "http_conn.h"
-
-#define MAX_FD 65536   // 最大的文件描述符个数
-#define MAX_EVENT_NUMBER 10000  // 监听的最大的事件数量
+#include "bundle.h"
+#include "path_cache.h"
+#include "affinity.h"
+#include "tls.h"
+#include "trace.h"
+#include "proxy.h"
+#include "config.h"
+#include "capture.h"
+#include "ratelimit.h"
+#include "sse.h"
+#include "latency.h"
+#include "shaper.h"
+#include "conn_table.h"
+#include "upgrade.h"
 
 extern void addfd(int epollfd, int fd, bool one_shot);  // 向epoll中添加需要监听的文件描述符
 extern void removefd(int epollfd, int fd);      // 从epoll中移除监听的文件描述符
+extern const char* doc_root;                    // 网站的根目录
 
 // 设置信号的处理函数
 void addsig(int sig, void(handler)(int))
@@ -27,30 +47,40 @@ void addsig(int sig, void(handler)(int))
     assert(sigaction(sig, &sa, NULL) != -1);    // sig为要捕获的信号类型
 }
 
-int main(int argc, char* argv[]) 
+// 一个reactor：一个线程、一个epoll和一个监听socket，负责接受连接并处理这些连接上的读写事件
+struct reactor
 {
-    if(argc <= 1)     // 提示需要输入端口号参数
-    {
-        printf("usage: %s port_number\n", basename(argv[0]));  // 第一个数组元素argv[0]是程序名称，并且包含程序所在的完整路径
-        return 1;
-    }
-
-    int port = atoi(argv[1]);   // 将输入的端口号字符串转换成整数
-    addsig(SIGPIPE, SIG_IGN);   // 忽略SIGPIPE信号（SIGPIPE：往读端被关闭的管道或者socket连接中写数据）
+    int index;      // reactor的序号
+    int epollfd;
+    int listenfd;
+    int tls_listenfd;   // HTTPS监听socket，没有HTTPS端口时为-1
+    int sse_fd;     // 有SSE事件要分发时被唤醒的eventfd（见sse.h）
+    int drain_fd;   // 热升级时通知reactor关闭自己的空闲连接和事件流的eventfd，没有配置upgrade_socket时为-1
+    int cpu;        // 绑定的CPU，-1表示不绑定
+};
 
-    // 创建线程池
-    threadPool<http_conn>* pool = NULL;
-    try 
-    {
-        pool = new threadPool<http_conn>;
-    } 
-    catch( ... ) 
-    {
-        return 1;
-    }
+static threadPool<http_conn>* pool = NULL;  // 所有reactor共用一个线程池
+static threadPool<http_conn>* io_pool = NULL;   // 读入冷文件的线程池，所有reactor共用
+static http_conn* users = NULL;             // 所有reactor共用，第i个对应conn_table的第i项
+static int bundle_watch_fd = -1;            // 由第0个reactor监听
+static int path_watch_fd = -1;              // 由第0个reactor监听
+static int max_fd = 0;                      // 最大的连接数（配置项max_fd），users和conn_table的大小
+static int max_events = 0;                  // 每次epoll_wait最多返回的事件数（配置项max_events）
+static std::vector<int> unix_listenfds;     // Unix域socket的监听socket，注册在所有reactor的epoll中
 
-    http_conn* users = new http_conn[MAX_FD];   // 预先为每个可能的客户连接分配一个http_conn对象
+// 热升级（见upgrade.h）
+static std::vector<reactor>* all_reactors = NULL;
+static std::vector<int> inherited_fds;      // 从旧进程收到、还没有用上的监听socket
+static std::vector<std::pair<int, bool>> adopted_listenfds;    // 旧进程比我们多出来的TCP监听socket，second表示HTTPS
+static int upgrade_fd = -1;                 // 等待下一个版本连接的升级socket，由第0个reactor监听
+static int upgrade_control_fd = -1;         // 与下一个版本的控制连接，等待它的就绪通知
+static bool handed_over = false;            // 监听socket已经交给了新进程，正在等待已有连接关闭
+static uint64_t drain_deadline_ms = 0;
+static int drain_timeout = 30;
 
+// 创建监听socket；有多个reactor时每个reactor一个监听socket，用SO_REUSEPORT绑定到同一个端口
+static int create_listenfd(int port, bool reuseport, int backlog)
+{
     int listenfd = socket(PF_INET, SOCK_STREAM, 0); // 创建socket，TCP/IP协议族，流服务（TCP），默认协议
 
     struct sockaddr_in address;     // TCP/IP协议族 IPv4 socket地址结构体
@@ -61,21 +91,195 @@ int main(int argc, char* argv[])
     // 端口复用
     int reuse = 1;
     setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));  // 设置socket文件描述符属性（这里是设置端口复用）
+    if(reuseport)
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
 
-    int ret = 0;
-    ret = bind(listenfd, (struct sockaddr*)&address, sizeof(address));  // 命名socket(将一个socket与socket地址绑定)
-    ret = listen(listenfd, 5);  // 监听socket，内核监听队列的最大长度（典型值为5）
+    if(bind(listenfd, (struct sockaddr*)&address, sizeof(address)) < 0   // 命名socket(将一个socket与socket地址绑定)
+        || listen(listenfd, backlog) < 0)    // 监听socket，内核监听队列的最大长度（配置项listen_backlog）
+    {
+        printf("failed to listen on port %d: %s\n", port, strerror(errno));
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
 
-    // 创建epoll对象，和事件数组，添加
-    epoll_event events[MAX_EVENT_NUMBER];
-    int epollfd = epoll_create(5);
-    // 将listenfd上的注册事件添加到epoll对象中（epoll事件表中）
-    addfd(epollfd, listenfd, false);
-    http_conn::m_epollfd = epollfd;
+/* 创建Unix域的监听socket。以'@'开头的是抽象名字空间的名字（不在文件系统中创建文件，进程退出时自动消失），
+   否则是文件系统路径，上次运行留下的同名socket文件先被删除 */
+static int create_unix_listenfd(const char* path, int backlog)
+{
+    int listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    size_t len = strlen(path);
+    memcpy(address.sun_path, path, len);
+    if(path[0] == '@')
+        address.sun_path[0] = '\0';
+    else
+    {
+        struct stat st;
+        if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(path);
+    }
+    socklen_t addrlen = offsetof(struct sockaddr_un, sun_path) + len + (path[0] == '@' ? 0 : 1);
+    if(bind(listenfd, (struct sockaddr*)&address, addrlen) < 0 || listen(listenfd, backlog) < 0)
+    {
+        printf("failed to listen on unix socket %s: %s\n", path, strerror(errno));
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+static uint64_t monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// 从旧进程交来的监听socket中取出绑定在TCP端口port上的一个，没有时返回-1
+static int take_inherited_tcp(int port)
+{
+    for(auto it = inherited_fds.begin(); it != inherited_fds.end(); ++it)
+    {
+        struct sockaddr_in address;
+        socklen_t len = sizeof(address);
+        if(getsockname(*it, (struct sockaddr*)&address, &len) == 0 && address.sin_family == AF_INET
+            && ntohs(address.sin_port) == port)
+        {
+            int fd = *it;
+            inherited_fds.erase(it);
+            return fd;
+        }
+    }
+    return -1;
+}
+
+// 从旧进程交来的监听socket中取出绑定在Unix域路径path（'@'开头为抽象名字空间）上的，没有时返回-1
+static int take_inherited_unix(const char* path)
+{
+    for(auto it = inherited_fds.begin(); it != inherited_fds.end(); ++it)
+    {
+        struct sockaddr_un address;
+        socklen_t len = sizeof(address);
+        memset(&address, 0, sizeof(address));
+        if(getsockname(*it, (struct sockaddr*)&address, &len) != 0 || address.sun_family != AF_UNIX)
+            continue;
+        bool same = path[0] == '@'
+            ? address.sun_path[0] == '\0' && len - offsetof(struct sockaddr_un, sun_path) == strlen(path)
+              && memcmp(address.sun_path + 1, path + 1, strlen(path) - 1) == 0
+            : strcmp(address.sun_path, path) == 0;
+        if(same)
+        {
+            int fd = *it;
+            inherited_fds.erase(it);
+            return fd;
+        }
+    }
+    return -1;
+}
+
+// 本进程所有的监听socket，热升级时交给新进程
+static std::vector<int> listener_fds()
+{
+    std::vector<int> fds;
+    for(auto& r : *all_reactors)
+    {
+        fds.push_back(r.listenfd);
+        if(r.tls_listenfd >= 0)
+            fds.push_back(r.tls_listenfd);
+    }
+    fds.insert(fds.end(), unix_listenfds.begin(), unix_listenfds.end());
+    for(auto& adopted : adopted_listenfds)
+        fds.push_back(adopted.first);
+    return fds;
+}
+
+/* 新进程已经就绪：不再接受新连接（监听socket只从epoll中移除，不关闭，它们已经由新进程接受连接），
+   已有的连接处理完当前请求后关闭，第0个reactor在所有连接关闭或者超过期限后退出 */
+static void start_draining(int epollfd)
+{
+    std::vector<int> fds = listener_fds();
+    for(auto& r : *all_reactors)
+        for(int fd : fds)
+            epoll_ctl(r.epollfd, EPOLL_CTL_DEL, fd, NULL);
+    removefd(epollfd, upgrade_fd);
+    upgrade_fd = -1;
+    handed_over = true;
+    http_conn::m_draining.store(true);
+    drain_deadline_ms = monotonic_ms() + (uint64_t)drain_timeout * 1000;
+    printf("upgrade: the new process took over, draining %d connections\n", http_conn::m_user_count.load());
+    // 空闲的连接和SSE连接只有所属的reactor能安全地关闭，通知每个reactor在自己的线程中处理
+    for(auto& r : *all_reactors)
+    {
+        uint64_t one = 1;
+        ssize_t ret = write(r.drain_fd, &one, sizeof(one));
+        (void)ret;
+    }
+}
+
+// reactor的事件循环
+static void run_reactor(reactor* r)
+{
+    if(r->cpu >= 0 && !pin_current_thread(r->cpu))
+        printf("failed to pin reactor %d to cpu %d\n", r->index, r->cpu);
+
+    int epollfd = r->epollfd;
+    int listenfd = r->listenfd;
+    int tls_listenfd = r->tls_listenfd;
+    int sse_fd = r->sse_fd;
+    int drain_fd = r->drain_fd;
+    epoll_event* events = new epoll_event[max_events];
+    // 低延迟模式下没有事件时先轮询spin_ns纳秒再阻塞；统计先记在本地，定期和阻塞之前加到全局计数上
+    uint64_t spin_ns = low_latency::enabled() ? low_latency::spin_ns() : 0;
+    uint64_t spin_start = 0;        // 本轮轮询开始的时间，0表示不在轮询
+    long polls = 0, hits = 0, spun_ns = 0;
+    auto flush_stats = [&]() {
+        low_latency::m_polls.fetch_add(polls, std::memory_order_relaxed);
+        low_latency::m_spin_hits.fetch_add(hits, std::memory_order_relaxed);
+        low_latency::m_spin_us.fetch_add(spun_ns / 1000, std::memory_order_relaxed);
+        polls = hits = 0;
+        spun_ns %= 1000;
+    };
 
     while(true) 
     {
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);     // 成功时返回就绪的文件描述符的个数
+        // 热升级后第0个reactor定期检查已有的连接是否都已关闭
+        int timeout = handed_over && r->index == 0 ? 100 : -1;
+        int number;
+        if(spin_ns)
+        {
+            number = epoll_wait(epollfd, events, max_events, 0);
+            ++polls;
+            uint64_t now = low_latency::now_ns();
+            if(number == 0)
+            {
+                if(!spin_start)
+                    spin_start = now;
+                else if(now - spin_start >= spin_ns)
+                {
+                    // 超过了轮询的预算仍然没有事件，阻塞等待
+                    spun_ns += now - spin_start;
+                    spin_start = 0;
+                    low_latency::m_sleeps.fetch_add(1, std::memory_order_relaxed);
+                    flush_stats();
+                    number = epoll_wait(epollfd, events, max_events, timeout);
+                }
+            }
+            else if(spin_start)
+            {
+                // 轮询期间来了事件，省掉了一次睡眠和唤醒
+                ++hits;
+                spun_ns += now - spin_start;
+                spin_start = 0;
+            }
+            if(polls >= low_latency::FLUSH_POLLS)
+                flush_stats();
+        }
+        else
+            number = epoll_wait(epollfd, events, max_events, timeout);     // 成功时返回就绪的文件描述符的个数
         
         if((number < 0) && (errno != EINTR))    // EINTR为被中断，这种情况不是epoll调用失败
         {
@@ -85,50 +289,517 @@ int main(int argc, char* argv[])
         // 循环遍历事件数组
         for(int i = 0; i < number; i++) 
         {
-            int sockfd = events[i].data.fd;     
-            if(sockfd == listenfd)      // 有客户端连接进来
+            uint64_t data = events[i].data.u64;
+            if(conn_table::is_connection(data))     // 连接上的事件交给连接协程处理，连接已经关闭的事件被丢弃
+            {
+                conn_slot* slot = conn_table::lookup(data);
+                if(slot)
+                    http_conn::on_event(slot, events[i].events, conn_table::source(data));
+                continue;
+            }
+            int sockfd = (int)(uint32_t)data;       // 服务器自己的文件描述符
+            bool local = !unix_listenfds.empty()
+                && std::find(unix_listenfds.begin(), unix_listenfds.end(), sockfd) != unix_listenfds.end();
+            bool tls = sockfd == tls_listenfd, adopted = false;
+            for(auto& a : adopted_listenfds)
+                if(a.first == sockfd)
+                {
+                    adopted = true;
+                    tls = a.second;
+                }
+            if(sockfd == listenfd || sockfd == tls_listenfd || local || adopted)      // 有客户端连接进来
             {
-                struct sockaddr_in client_address;  // 用于获取被接受连接的远端socket地址
-                socklen_t client_addrlength = sizeof(client_address);   // 客户端socket地址的长度
+                struct sockaddr_storage peer;       // 用于获取被接受连接的远端socket地址，也放得下Unix域的sockaddr_un
+                struct sockaddr_in client_address;  // 交给连接的客户端地址
                 while(1) 
                 {    
-                    int connfd = accept(listenfd, (struct sockaddr*)&client_address, &client_addrlength);   // 从listen监听队列中接受一个连接;成功时返回一个新的连接socket
+                    // accept会把地址的实际长度写回client_addrlength，每次都要重新设置，否则下一次可能写出缓冲区
+                    socklen_t client_addrlength = sizeof(peer);
+                    int connfd = accept(sockfd, (struct sockaddr*)&peer, &client_addrlength);   // 从listen监听队列中接受一个连接;成功时返回一个新的连接socket
                     if (connfd < 0)     
                     {
                         if(!(errno == EAGAIN || errno == EWOULDBLOCK))  // 没有数据。对于非阻塞IO，下面的条件成立表示数据已经全部读取完毕
                             printf("errno is: %d\n", errno);
                         break;
                     }
-                    if(http_conn::m_user_count >= MAX_FD)   // 目前支持的连接数满了
+                    conn_slot* slot = conn_table::acquire(connfd);
+                    if(!slot)   // 目前支持的连接数满了
                     {
                         close(connfd);
                         break;
                     }
-                    users[connfd].init(connfd, client_address); // 初始化客户连接（包含向epoll添加connfd文件描述符的操作，成员变量的初始化等）
+                    memset(&client_address, 0, sizeof(client_address));
+                    if(local)   // Unix域的连接只保留地址族，地址为0（不按IP限流）
+                        client_address.sin_family = AF_UNIX;
+                    else
+                        memcpy(&client_address, &peer, sizeof(client_address));
+                    slot->conn->init(slot, client_address, epollfd, tls); // 初始化客户连接（包含向epoll添加connfd文件描述符的操作，成员变量的初始化等）
                 }
             } 
-            else if(events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))  // TCP连接被对方关闭或对方关闭了写操作，挂起，错误
+            else if(sockfd == bundle_watch_fd)  // 资源包所在目录发生了变化
             {
-                users[sockfd].close_conn();     // 如果有异常，直接关闭客户连接
+                asset_bundle::on_watch_event(sockfd);
             } 
-            else if(events[i].events & EPOLLIN) 
+            else if(sockfd == path_watch_fd)    // 网站根目录下的文件发生了变化
+            {
+                path_resolver::on_watch_event(sockfd);
+            } 
+            else if(sockfd == sse_fd)   // 有发布到频道的事件，分发给本reactor上的订阅者
+            {
+                sse_hub::on_wakeup(r->index);
+            }
+            else if(sockfd == drain_fd && drain_fd >= 0)    // 开始退出：关闭本reactor上空闲的连接，结束事件流
+            {
+                uint64_t count;
+                ssize_t ret = read(drain_fd, &count, sizeof(count));
+                (void)ret;
+                http_conn::close_idle(epollfd);
+                sse_hub::end_streams(r->index);
+            }
+            else if(sockfd == upgrade_fd)   // 新版本的进程连接进来，把监听socket交给它
             {
-                if(users[sockfd].read())    // 根据读的结果，决定是将任务添加到线程池，还是关闭连接
-                    pool->addTask(users+sockfd);
-                else
-                    users[sockfd].close_conn();
-            }  
-            else if(events[i].events & EPOLLOUT) 
+                int fd = hot_upgrade::hand_over(upgrade_fd, listener_fds());
+                if(fd >= 0)
+                {
+                    if(upgrade_control_fd >= 0)     // 上一个新进程还没有就绪，以后来的为准
+                        removefd(epollfd, upgrade_control_fd);
+                    upgrade_control_fd = fd;
+                    addfd(epollfd, fd, false);
+                }
+            }
+            else if(sockfd == upgrade_control_fd)
             {
-                if(!users[sockfd].write())  // 根据写的结果，决定是否关闭连接
-                    users[sockfd].close_conn();
+                int state = hot_upgrade::on_control(sockfd);
+                if(state != 0)
+                {
+                    removefd(epollfd, sockfd);
+                    upgrade_control_fd = -1;
+                }
+                if(state > 0)
+                    start_draining(epollfd);
             }
         }
+        if(handed_over && r->index == 0
+            && (http_conn::m_user_count.load() == 0 || monotonic_ms() >= drain_deadline_ms))
+            break;
     }
     
-    close(epollfd);
-    close(listenfd);
-    delete[] users;
+    delete[] events;
+}
+
+// 用法提示
+static void usage(const char* prog)
+{
+    printf("usage: %s [-f config_file] [-a] [-o key=value]... [-n reactors] [-r reactor_cpus] [-w worker_cpus] [-s] [-i] [-L]\n"
+           "          [-t https_port -c cert_file -k key_file] [-x trace_file [-l slow_ms] [-p sample_every]]\n"
+           "          [-u prefix=host:port[,host:port...][,leastconn]]... [-d capture_file] [-U unix_socket]...\n"
+           "          [-H upgrade_socket]\n"
+           "          [port_number [bundle_file]]\n"
+           "  -f  read settings from config_file (\"key = value\" per line); options on the command line override it\n"
+           "  -a  size reactors, workers, max_workers, io_workers, max_io_workers, max_fd, queue_limit, max_events,\n"
+           "      read_buffer_size and listen_backlog from the CPU count, RLIMIT_NOFILE and available memory\n"
+           "      (same as \"auto = on\"); the worker pools grow up to max_workers/max_io_workers when requests\n"
+           "      queue or block, and shrink back after idling\n"
+           "  -o  set any config file key, e.g. -o workers=16 -o max_fd=auto -o doc_root=/srv/www\n"
+           "  -n  number of reactor threads, each with its own epoll and SO_REUSEPORT listener (default 1)\n"
+           "  -r  pin reactors to these CPUs, e.g. 0-3 (reactor i gets the i-th CPU)\n"
+           "  -w  pin worker threads to these CPUs (worker i gets the i-th CPU)\n"
+           "  -s  steer each connection to the reactor on the CPU that received it (SO_ATTACH_REUSEPORT_CBPF)\n"
+           "  -i  run-to-completion: answer requests that cannot block (routes, bundle, cached paths whose content\n"
+           "      is in the page cache) on the reactor; cold files are always read by the io_workers pool\n"
+           "  -L  low-latency mode: reactors poll epoll for spin_us (default 50) before sleeping, sockets and\n"
+           "      epoll busy-poll the NIC for busy_poll_us (default 50, 0 = off), TCP_QUICKACK after every read;\n"
+           "      burns CPU while idle. Compare by running two instances and\n"
+           "      webbench -2 -C http://host:<-L port>/ http://host:<normal port>/\n"
+           "  -t  also serve HTTPS on this port, with the PEM certificate chain (-c) and private key (-k);\n"
+           "      the kernel encrypts (kTLS) when the tls module is available\n"
+           "  -x  trace sampled requests; requests slower than slow_ms (default 100) are written to\n"
+           "      trace_file in Chrome trace-event JSON; one in sample_every requests is sampled (default 1)\n"
+           "  -u  reverse-proxy URLs starting with prefix to these HTTP/1.1 upstreams, round-robin by default\n"
+           "      or least-connections with leastconn; may be given several times\n"
+           "  -d  capture the raw request bytes of sampled connections with arrival times into capture_file\n"
+           "      for replay/replay; tune with capture_sample, capture_max_mb and capture_conn_kb (-o)\n"
+           "  -U  also accept HTTP on this AF_UNIX stream socket: a filesystem path, or @name for the abstract\n"
+           "      namespace; may be given several times\n"
+           "  -H  zero-downtime upgrade: a new binary started with the same upgrade_socket takes over the\n"
+           "      listening sockets of the running one (SCM_RIGHTS), warms up its hot files and then tells it to\n"
+           "      stop accepting; the old process exits once its connections close or drain_timeout (default 30s)\n"
+           "      passes. With more reactors than before the new process needs reactors > 1 on both sides\n"
+           "  per-client-IP limits (answered with 429) are set with -o ip_max_conns, ip_requests_per_sec,\n"
+           "  ip_request_burst, ip_kbytes_per_sec and ip_kbytes_burst\n"
+           "  large responses are sent with send-buffer backpressure: -o notsent_lowat_kb (TCP_NOTSENT_LOWAT,\n"
+           "  default 128) and write_quantum_kb (bytes sent before yielding to other connections, default 512)\n"
+           "  -o limit_rate=prefix=rate_kb[,burst_kb] caps each response under prefix at rate_kb KB/s per\n"
+           "  connection after an initial burst_kb; may be given several times, the longest prefix wins\n"
+           "  GET /events/<channel> subscribes to Server-Sent Events; GET /publish/<channel>?data=...[&event=name]\n"
+           "  (from localhost) broadcasts one; a subscriber more than sse_backlog events behind is disconnected\n"
+           "  port_number and bundle_file may also come from the config file (port, bundle_file)\n",
+           prog);
+}
+
+int main(int argc, char* argv[]) 
+{
+    // 命令行上的选项先记下来，读完配置文件后再按顺序应用，使命令行覆盖配置文件
+    server_config cfg;
+    const char* config_file = NULL;
+    std::vector<std::pair<std::string, std::string>> overrides;
+    int opt;
+    while((opt = getopt(argc, argv, "f:ao:n:r:w:siLt:c:k:x:l:p:u:d:U:H:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'f': config_file = optarg; break;
+            case 'a': overrides.emplace_back("auto", "on"); break;
+            case 'o':
+            {
+                const char* eq = strchr(optarg, '=');
+                if(!eq)
+                {
+                    usage(basename(argv[0]));
+                    return 1;
+                }
+                overrides.emplace_back(std::string(optarg, eq - optarg), eq + 1);
+                break;
+            }
+            case 'n': overrides.emplace_back("reactors", optarg); break;
+            case 'r': overrides.emplace_back("reactor_cpus", optarg); break;
+            case 'w': overrides.emplace_back("worker_cpus", optarg); break;
+            case 's': overrides.emplace_back("steering", "on"); break;
+            case 'i': overrides.emplace_back("run_to_completion", "on"); break;
+            case 'L': overrides.emplace_back("low_latency", "on"); break;
+            case 't': overrides.emplace_back("https_port", optarg); break;
+            case 'c': overrides.emplace_back("cert_file", optarg); break;
+            case 'k': overrides.emplace_back("key_file", optarg); break;
+            case 'x': overrides.emplace_back("trace_file", optarg); break;
+            case 'l': overrides.emplace_back("trace_slow_ms", optarg); break;
+            case 'p': overrides.emplace_back("trace_sample", optarg); break;
+            case 'u': overrides.emplace_back("proxy", optarg); break;
+            case 'd': overrides.emplace_back("capture_file", optarg); break;
+            case 'U': overrides.emplace_back("unix_socket", optarg); break;
+            case 'H': overrides.emplace_back("upgrade_socket", optarg); break;
+            default: usage(basename(argv[0])); return 1;
+        }
+    }
+    if(optind < argc)
+        overrides.emplace_back("port", argv[optind]);
+    if(optind + 1 < argc)
+        overrides.emplace_back("bundle_file", argv[optind + 1]);
+
+    if(config_file && !config::load_file(config_file, cfg))
+        return 1;
+    for(auto& o : overrides)
+    {
+        if(!config::set(cfg, o.first.c_str(), o.second.c_str()))
+        {
+            printf("bad setting %s = %s\n", o.first.c_str(), o.second.c_str());
+            return 1;
+        }
+    }
+    if(cfg.port < 0 || (cfg.https_port >= 0 && (cfg.cert_file.empty() || cfg.key_file.empty())))     // 提示需要输入端口号参数
+    {
+        usage(basename(argv[0]));  // 第一个数组元素argv[0]是程序名称，并且包含程序所在的完整路径
+        return 1;
+    }
+    config::auto_size(cfg, sizeof(http_conn) + sizeof(conn_slot));
+    config::print(cfg);
+
+    cpu_set_t reactor_cpus, worker_cpus;
+    CPU_ZERO(&reactor_cpus);
+    CPU_ZERO(&worker_cpus);
+    if((!cfg.reactor_cpus.empty() && !parse_cpu_list(cfg.reactor_cpus.c_str(), &reactor_cpus))
+        || (!cfg.worker_cpus.empty() && !parse_cpu_list(cfg.worker_cpus.c_str(), &worker_cpus)))
+    {
+        printf("bad cpu list\n");
+        return 1;
+    }
+    for(auto& route : cfg.proxy_routes)
+    {
+        if(!proxy::add_route(route.c_str()))
+        {
+            printf("bad proxy route: %s\n", route.c_str());
+            return 1;
+        }
+    }
+    for(auto& rule : cfg.limit_rates)
+    {
+        if(!bandwidth_shaper::add_rule(rule.c_str()))
+        {
+            printf("bad limit_rate rule: %s\n", rule.c_str());
+            return 1;
+        }
+    }
+
+    int reactor_num = cfg.reactors;
+    bool steering = cfg.steering;
+    int port = cfg.port;
+    int tls_port = cfg.https_port;
+    const char* bundle_file = cfg.bundle_file.empty() ? NULL : cfg.bundle_file.c_str();
+    max_fd = cfg.max_fd;
+    max_events = cfg.max_events;
+    doc_root = cfg.doc_root.c_str();
+    http_conn::m_read_buffer_size = cfg.read_buffer_size;
+    http_conn::m_run_to_completion = cfg.run_to_completion;
+    http_conn::m_notsent_lowat = cfg.notsent_lowat_kb > 0 ? cfg.notsent_lowat_kb * 1024 : 0;
+    http_conn::m_write_quantum = cfg.write_quantum_kb > 0 ? cfg.write_quantum_kb * 1024 : 0;
+    if(cfg.low_latency)
+        low_latency::init(cfg.spin_us, cfg.busy_poll_us, reactor_num);
+    addsig(SIGPIPE, SIG_IGN);   // 忽略SIGPIPE信号（SIGPIPE：往读端被关闭的管道或者socket连接中写数据）
+
+    if(tls_port >= 0 && !tls_context::init(cfg.cert_file.c_str(), cfg.key_file.c_str()))
+    {
+        printf("failed to load certificate %s and key %s\n", cfg.cert_file.c_str(), cfg.key_file.c_str());
+        return 1;
+    }
+
+    if(!cfg.trace_file.empty() && !tracer::init(cfg.trace_file.c_str(), cfg.trace_slow_ms, cfg.trace_sample))
+    {
+        printf("failed to open trace file %s: %s\n", cfg.trace_file.c_str(), strerror(errno));
+        return 1;
+    }
+
+    if(!cfg.capture_file.empty() && !capture::init(cfg.capture_file.c_str(), cfg.capture_sample, cfg.capture_max_mb, cfg.capture_conn_kb))
+    {
+        printf("failed to open capture file %s: %s\n", cfg.capture_file.c_str(), strerror(errno));
+        return 1;
+    }
+
+    rate_limiter::init(cfg.ip_max_conns, cfg.ip_requests_per_sec, cfg.ip_request_burst,
+                       (long long)cfg.ip_kbytes_per_sec * 1024, (long long)cfg.ip_kbytes_burst * 1024);
+
+    // 按CPU分流时，连接被交给第(cpu % reactor_num)个reactor，没有指定reactor的CPU时让第i个reactor绑定CPU i
+    if(steering && CPU_COUNT(&reactor_cpus) == 0)
+        for(int i = 0; i < reactor_num && i < CPU_SETSIZE; ++i)
+            CPU_SET(i, &reactor_cpus);
+
+    // 创建线程池，指定了worker的CPU时，第i个工作线程绑定到其中第i个CPU上
+    try 
+    {
+        std::function<void(int)> worker_init = nullptr;
+        if(CPU_COUNT(&worker_cpus) > 0)
+            worker_init = [worker_cpus](int index) {
+                int cpu = nth_cpu(&worker_cpus, index);
+                if(!pin_current_thread(cpu))
+                    printf("failed to pin worker %d to cpu %d\n", index, cpu);
+            };
+        // 请求按通道排队（顺序与http_conn::LANE一致），大文件请求的突发不会让小请求排在它们后面
+        std::vector<threadPool<http_conn>::laneConfig> lanes = {
+            { cfg.small_lane_weight, cfg.small_lane_workers },
+            { cfg.large_lane_weight, cfg.large_lane_workers },
+            { cfg.admin_lane_weight, cfg.admin_lane_workers },
+        };
+        if(cfg.small_lane_workers + cfg.large_lane_workers + cfg.admin_lane_workers >= cfg.workers)
+        {
+            printf("reserved lane workers must be fewer than workers (%d)\n", cfg.workers);
+            return 1;
+        }
+        pool = new threadPool<http_conn>(cfg.workers, cfg.queue_limit, worker_init, lanes);
+        pool->setMaxThreads(cfg.max_workers);
+        http_conn::m_pool = pool;
+        // 冷文件的读取单独使用一个线程池，磁盘慢时只有它的队列变长，它阻塞得越多线程就越多
+        io_pool = new threadPool<http_conn>(cfg.io_workers, cfg.queue_limit);
+        io_pool->setMaxThreads(cfg.max_io_workers);
+        http_conn::m_io_pool = io_pool;
+    } 
+    catch( ... ) 
+    {
+        return 1;
+    }
+
+    /* 预先为每个可能的客户连接分配一个http_conn对象和读缓冲区，以及reactor分发事件时访问的连接表；
+       指定了reactor的CPU时，分配在这些CPU所在的NUMA结点上 */
+    const cpu_set_t* node_cpus = CPU_COUNT(&reactor_cpus) > 0 ? &reactor_cpus : NULL;
+    size_t users_size = sizeof(http_conn) * max_fd;
+    size_t buffers_size = (size_t)cfg.read_buffer_size * max_fd;
+    void* users_mem = numa_alloc(users_size, node_cpus);
+    char* buffers_mem = (char*)numa_alloc(buffers_size, node_cpus);
+    if(!users_mem || !buffers_mem)
+        return 1;
+    users = (http_conn*)users_mem;
+    for(int i = 0; i < max_fd; ++i)
+    {
+        new (users + i) http_conn;
+        users[i].set_read_buffer(buffers_mem + (size_t)i * cfg.read_buffer_size);
+    }
+    if(!conn_table::init(max_fd, users, node_cpus))
+        return 1;
+
+    // 热升级：有旧进程在运行时，从它那里接过监听socket，不再自己创建
+    std::string hot_paths;
+    drain_timeout = cfg.drain_timeout;
+    bool upgrading = !cfg.upgrade_socket.empty()
+        && hot_upgrade::inherit(cfg.upgrade_socket.c_str(), &inherited_fds, &hot_paths);
+    if(upgrading)
+        printf("upgrade: took over %zu listeners from the running process\n", inherited_fds.size());
+
+    // 每个reactor一个epoll和一个监听socket
+    sse_hub::init(reactor_num, cfg.sse_backlog);
+    std::vector<reactor> reactors(reactor_num);
+    all_reactors = &reactors;
+    for(int i = 0; i < reactor_num; ++i)
+    {
+        reactors[i].index = i;
+        reactors[i].listenfd = take_inherited_tcp(port);
+        if(reactors[i].listenfd < 0)
+            reactors[i].listenfd = create_listenfd(port, reactor_num > 1, cfg.listen_backlog);
+        if(reactors[i].listenfd < 0)
+            return 1;
+        low_latency::tune_listener(reactors[i].listenfd);
+        reactors[i].epollfd = epoll_create(5);
+        low_latency::tune_epoll(reactors[i].epollfd);
+        // 将listenfd上的注册事件添加到epoll对象中（epoll事件表中）
+        addfd(reactors[i].epollfd, reactors[i].listenfd, false);
+        reactors[i].sse_fd = sse_hub::register_reactor(i, reactors[i].epollfd);
+        addfd(reactors[i].epollfd, reactors[i].sse_fd, false);
+        reactors[i].drain_fd = -1;
+        if(!cfg.upgrade_socket.empty())
+        {
+            reactors[i].drain_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            addfd(reactors[i].epollfd, reactors[i].drain_fd, false);
+        }
+        reactors[i].tls_listenfd = -1;
+        if(tls_port >= 0)
+        {
+            reactors[i].tls_listenfd = take_inherited_tcp(tls_port);
+            if(reactors[i].tls_listenfd < 0)
+                reactors[i].tls_listenfd = create_listenfd(tls_port, reactor_num > 1, cfg.listen_backlog);
+            if(reactors[i].tls_listenfd < 0)
+                return 1;
+            low_latency::tune_listener(reactors[i].tls_listenfd);
+            addfd(reactors[i].epollfd, reactors[i].tls_listenfd, false);
+        }
+        reactors[i].cpu = -1;
+        if(CPU_COUNT(&reactor_cpus) > 0)
+        {
+            reactors[i].cpu = nth_cpu(&reactor_cpus, i);
+            if(steering)    // 优先选择满足cpu % reactor_num == i的CPU，与CBPF程序的分流结果一致
+                for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                    if(CPU_ISSET(cpu, &reactor_cpus) && cpu % reactor_num == i)
+                    {
+                        reactors[i].cpu = cpu;
+                        break;
+                    }
+        }
+    }
+    /* Unix域socket不支持SO_REUSEPORT，每个路径只有一个监听socket，注册在所有reactor的epoll中；
+       EPOLLEXCLUSIVE让一个新连接只唤醒其中一个reactor，由它接受 */
+    for(auto& path : cfg.unix_sockets)
+    {
+        int fd = take_inherited_unix(path.c_str());
+        if(fd < 0)
+            fd = create_unix_listenfd(path.c_str(), cfg.listen_backlog);
+        if(fd < 0)
+            return 1;
+        unix_listenfds.push_back(fd);
+        for(auto& r : reactors)
+        {
+            epoll_event event;
+            event.data.u64 = fd;
+            event.events = EPOLLIN | EPOLLEXCLUSIVE;
+            epoll_ctl(r.epollfd, EPOLL_CTL_ADD, fd, &event);
+        }
+    }
+
+    /* 旧进程的reactor比我们多时，多出来的监听socket同样在SO_REUSEPORT组中分到连接，轮流交给各reactor接受；
+       端口已经不在配置中的监听socket直接关闭 */
+    for(size_t i = 0; i < inherited_fds.size(); ++i)
+    {
+        int fd = inherited_fds[i];
+        struct sockaddr_in address;
+        socklen_t len = sizeof(address);
+        if(getsockname(fd, (struct sockaddr*)&address, &len) == 0 && address.sin_family == AF_INET
+            && (ntohs(address.sin_port) == port || (tls_port >= 0 && ntohs(address.sin_port) == tls_port)))
+        {
+            adopted_listenfds.emplace_back(fd, ntohs(address.sin_port) == tls_port);
+            addfd(reactors[i % reactor_num].epollfd, fd, false);
+        }
+        else
+        {
+            printf("upgrade: closing inherited listener %d that is no longer configured\n", fd);
+            close(fd);
+        }
+    }
+    inherited_fds.clear();
+
+    if(steering && reactor_num > 1 && (!attach_incoming_cpu_steering(reactors[0].listenfd, reactor_num)
+        || (tls_port >= 0 && !attach_incoming_cpu_steering(reactors[0].tls_listenfd, reactor_num))))
+        printf("failed to attach reuseport steering program: %s\n", strerror(errno));
+
+    // 打开网站根目录，监视其中的变化以使路径缓存失效
+    path_watch_fd = path_resolver::init(doc_root);
+    if(path_watch_fd >= 0)
+        addfd(reactors[0].epollfd, path_watch_fd, false);
+
+    // 指定了静态资源包时，启动时映射一次，并监视资源包文件被替换（rename）以便原子地切换到新内容
+    if(bundle_file)
+    {
+        if(!asset_bundle::load(bundle_file))
+            return 1;
+        bundle_watch_fd = asset_bundle::watch(bundle_file);
+        if(bundle_watch_fd >= 0)
+            addfd(reactors[0].epollfd, bundle_watch_fd, false);
+    }
+
+    /* 热升级：预热旧进程的路径缓存中的热点文件，然后通知它停止接受连接。此前旧进程一直在接受连接，
+       此后监听队列中的连接由我们接受；最后接替它在upgrade_socket上等待下一个版本 */
+    if(upgrading)
+    {
+        int warmed = hot_upgrade::warm_up(hot_paths);
+        printf("upgrade: warmed up %d hot files\n", warmed);
+        hot_upgrade::ready();
+    }
+    if(!cfg.upgrade_socket.empty())
+    {
+        upgrade_fd = hot_upgrade::listen(cfg.upgrade_socket.c_str());
+        if(upgrade_fd >= 0)
+            addfd(reactors[0].epollfd, upgrade_fd, false);
+    }
+
+    // 第0个reactor在主线程中运行，其余的各自一个线程
+    std::vector<std::thread> threads;
+    for(int i = 1; i < reactor_num; ++i)
+        threads.emplace_back(run_reactor, &reactors[i]);
+    run_reactor(&reactors[0]);
+    for(auto& t : threads)
+        t.detach();     // 其他reactor没有退出的途径，主线程退出时进程随之结束
+    if(handed_over)
+    {
+        // 其他reactor和工作线程可能还在处理超过期限的连接，不做清理直接退出；监听socket和socket文件属于新进程了
+        printf("upgrade: drained, %d connections left, exiting\n", http_conn::m_user_count.load());
+        fflush(stdout);
+        _exit(0);
+    }
+    
+    for(auto& r : reactors)
+    {
+        close(r.epollfd);
+        close(r.listenfd);
+        close(r.sse_fd);
+        if(r.drain_fd >= 0)
+            close(r.drain_fd);
+        if(r.tls_listenfd >= 0)
+            close(r.tls_listenfd);
+    }
+    for(size_t i = 0; i < unix_listenfds.size(); ++i)
+    {
+        close(unix_listenfds[i]);
+        if(cfg.unix_sockets[i][0] != '@')
+            unlink(cfg.unix_sockets[i].c_str());
+    }
+    if(bundle_watch_fd >= 0)
+        close(bundle_watch_fd);
+    if(path_watch_fd >= 0)
+        close(path_watch_fd);
+    if(upgrade_fd >= 0)
+    {
+        close(upgrade_fd);
+        unlink(cfg.upgrade_socket.c_str());
+    }
     delete pool;
+    delete io_pool;
+    conn_table::destroy();
+    for(int i = 0; i < max_fd; ++i)
+        users[i].~http_conn();
+    numa_free(users_mem, users_size);
+    numa_free(buffers_mem, buffers_size);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,220 @@
+/*
+    离线打包工具：把网站根目录下的所有文件打包成一个带索引的静态资源包（格式见bundle.h）
+    编译：g++ -O2 -o bundle_pack bundle_pack.cpp -lz
+    用法：bundle_pack [-z] <doc_root> <bundle_file>
+        -z  为文本类内容额外生成gzip预压缩版本（压缩后更小时才保留）
+    资源包先写入<bundle_file>.tmp，完成后rename为<bundle_file>，服务器通过inotify感知并原子地切换
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "../bundle.h"
+
+struct pack_file
+{
+    std::string path;       // URL路径，如"/images/image1.jpg"
+    std::string type;       // Content-Type
+    std::string etag;       // ETag
+    std::string data;       // 文件内容
+    std::string gzip;       // gzip预压缩内容，可能为空
+};
+
+static std::vector<pack_file> g_files;
+static size_t g_root_len = 0;
+static bool g_gzip = false;
+
+// 根据扩展名确定Content-Type
+static const char* content_type(const std::string& path)
+{
+    static const char* types[][2] = {
+        { ".html", "text/html" },           { ".htm", "text/html" },
+        { ".css", "text/css" },             { ".js", "application/javascript" },
+        { ".json", "application/json" },    { ".txt", "text/plain" },
+        { ".xml", "text/xml" },             { ".svg", "image/svg+xml" },
+        { ".jpg", "image/jpeg" },           { ".jpeg", "image/jpeg" },
+        { ".png", "image/png" },            { ".gif", "image/gif" },
+        { ".ico", "image/x-icon" },         { ".webp", "image/webp" },
+        { ".wasm", "application/wasm" },    { ".pdf", "application/pdf" },
+    };
+    size_t dot = path.rfind('.');
+    if(dot != std::string::npos)
+        for(auto& t : types)
+            if(strcasecmp(path.c_str() + dot, t[0]) == 0)
+                return t[1];
+    return "application/octet-stream";
+}
+
+// 图片等已经压缩过的内容再做gzip没有意义
+static bool compressible(const std::string& type)
+{
+    return type.compare(0, 5, "text/") == 0 || type == "application/javascript"
+        || type == "application/json" || type == "image/svg+xml" || type == "application/wasm";
+}
+
+// 以内容的FNV-1a哈希作为ETag，内容不变则ETag不变
+static std::string make_etag(const std::string& data)
+{
+    uint64_t hash = 1469598103934665603ULL;
+    for(unsigned char c : data)
+    {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\"%016llx\"", (unsigned long long)hash);
+    return buf;
+}
+
+static std::string gzip_data(const std::string& data)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // windowBits为15+16表示输出gzip格式而不是zlib格式
+    if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+        return "";
+    std::string out(deflateBound(&zs, data.size()) + 32, '\0');
+    zs.next_in = (Bytef*)data.data();
+    zs.avail_in = data.size();
+    zs.next_out = (Bytef*)&out[0];
+    zs.avail_out = out.size();
+    int ret = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END ? out : "";
+}
+
+static int visit(const char* fpath, const struct stat* sb, int typeflag, struct FTW*)
+{
+    if(typeflag != FTW_F || !S_ISREG(sb->st_mode))
+        return 0;
+    if(!(sb->st_mode & S_IROTH))    // 与服务器的规则一致，其他用户不可读的文件不对外提供
+        return 0;
+    FILE* fp = fopen(fpath, "rb");
+    if(!fp)
+    {
+        perror(fpath);
+        return 1;
+    }
+    pack_file file;
+    file.path = fpath + g_root_len;
+    file.data.resize(sb->st_size);
+    if(sb->st_size > 0 && fread(&file.data[0], 1, sb->st_size, fp) != (size_t)sb->st_size)
+    {
+        perror(fpath);
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+    file.type = content_type(file.path);
+    file.etag = make_etag(file.data);
+    if(g_gzip && compressible(file.type))
+    {
+        file.gzip = gzip_data(file.data);
+        if(file.gzip.size() >= file.data.size() * 9 / 10)   // 压缩效果不明显就不保留
+            file.gzip.clear();
+    }
+    g_files.push_back(std::move(file));
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    int opt;
+    while((opt = getopt(argc, argv, "z")) != -1)
+    {
+        if(opt == 'z')
+            g_gzip = true;
+        else
+            return 2;
+    }
+    if(argc - optind != 2)
+    {
+        printf("usage: %s [-z] doc_root bundle_file\n", basename(argv[0]));
+        return 2;
+    }
+    std::string root = argv[optind];
+    while(root.size() > 1 && root.back() == '/')
+        root.pop_back();
+    g_root_len = root.size();
+    if(nftw(root.c_str(), visit, 16, FTW_PHYS) != 0)
+        return 1;
+
+    // 索引按路径排序，服务器端用二分查找
+    std::sort(g_files.begin(), g_files.end(),
+              [](const pack_file& a, const pack_file& b) { return strcmp(a.path.c_str(), b.path.c_str()) < 0; });
+
+    // 依次排布：文件头、索引、字符串表、数据区（数据按8字节对齐）
+    std::vector<bundle_entry> entries(g_files.size());
+    std::string strings;
+    strings.push_back('\0');
+    for(size_t i = 0; i < g_files.size(); ++i)
+    {
+        bundle_entry& e = entries[i];
+        e.path_off = strings.size();
+        e.path_len = g_files[i].path.size();
+        strings += g_files[i].path;
+        strings.push_back('\0');
+        e.type_off = strings.size();
+        strings += g_files[i].type;
+        strings.push_back('\0');
+        e.etag_off = strings.size();
+        strings += g_files[i].etag;
+        strings.push_back('\0');
+    }
+
+    bundle_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.version = BUNDLE_VERSION;
+    header.count = entries.size();
+    header.index_offset = sizeof(header);
+    header.strings_offset = header.index_offset + entries.size() * sizeof(bundle_entry);
+    header.strings_size = strings.size();
+
+    std::string data;
+    uint64_t data_offset = (header.strings_offset + strings.size() + 7) & ~7ULL;
+    for(size_t i = 0; i < g_files.size(); ++i)
+    {
+        entries[i].data_off = data_offset + data.size();
+        entries[i].data_len = g_files[i].data.size();
+        data += g_files[i].data;
+        data.resize((data.size() + 7) & ~7ULL, '\0');
+        entries[i].gzip_off = data_offset + data.size();
+        entries[i].gzip_len = g_files[i].gzip.size();
+        data += g_files[i].gzip;
+        data.resize((data.size() + 7) & ~7ULL, '\0');
+    }
+
+    std::string tmp = std::string(argv[optind + 1]) + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if(!fp)
+    {
+        perror(tmp.c_str());
+        return 1;
+    }
+    std::string pad(data_offset - header.strings_offset - strings.size(), '\0');
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+        && (entries.empty() || fwrite(entries.data(), sizeof(bundle_entry), entries.size(), fp) == entries.size())
+        && fwrite(strings.data(), 1, strings.size(), fp) == strings.size()
+        && fwrite(pad.data(), 1, pad.size(), fp) == pad.size()
+        && fwrite(data.data(), 1, data.size(), fp) == data.size();
+    ok = (fflush(fp) == 0) && ok && fsync(fileno(fp)) == 0;
+    fclose(fp);
+    // 写完整后再rename，服务器看到的永远是完整的资源包
+    if(!ok || rename(tmp.c_str(), argv[optind + 1]) != 0)
+    {
+        perror(argv[optind + 1]);
+        unlink(tmp.c_str());
+        return 1;
+    }
+    printf("packed %zu files into %s\n", g_files.size(), argv[optind + 1]);
+    return 0;
+}
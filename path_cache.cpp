@@ -0,0 +1,223 @@
+#include "path_cache.h"
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <linux/openat2.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <string>
+
+// 缓存中的一个槽，generation与当前代数不同的槽视为空
+struct cache_slot
+{
+    uint64_t hash;
+    unsigned generation;
+    char path[path_resolver::MAX_PATH_LEN];
+    std::shared_ptr<resolved_file> file;
+};
+
+struct cache_shard
+{
+    std::mutex mutex;
+    cache_slot slots[path_resolver::SLOTS_PER_SHARD];
+};
+
+static cache_shard g_shards[path_resolver::SHARDS];
+static std::atomic<unsigned> g_generation(1);   // 缓存的当前代数，根目录下有任何变化时加1
+static int g_root_fd = -1;                      // 网站根目录的O_PATH描述符
+static int g_watch_fd = -1;
+static std::map<int, std::string> g_watch_dirs; // inotify监视描述符 -> 被监视的目录，只在主线程中访问
+static bool g_has_openat2 = true;               // 内核不支持openat2时退化为openat加上路径检查
+
+resolved_file::~resolved_file()
+{
+    if(fd >= 0)
+        close(fd);
+}
+
+static uint64_t hash_path(const char* path)
+{
+    uint64_t hash = 1469598103934665603ULL;
+    for(; *path; ++path)
+    {
+        hash ^= (unsigned char)*path;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// 路径中是否含有".."这一段
+static bool has_dotdot(const char* path)
+{
+    for(const char* p = path; (p = strstr(p, "..")) != NULL; p += 2)
+        if((p == path || p[-1] == '/') && (p[2] == '\0' || p[2] == '/'))
+            return true;
+    return false;
+}
+
+// 相对于根目录打开path，不允许解析到根目录之外
+static int open_beneath(const char* path)
+{
+    if(g_has_openat2)
+    {
+        struct open_how how;
+        memset(&how, 0, sizeof(how));
+        how.flags = O_RDONLY | O_CLOEXEC;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        int fd = syscall(SYS_openat2, g_root_fd, path, &how, sizeof(how));
+        if(fd >= 0 || errno != ENOSYS)
+            return fd;
+        g_has_openat2 = false;
+    }
+    // 没有openat2时只能在用户态拒绝".."，并且不跟随最后一级的符号链接
+    if(has_dotdot(path))
+    {
+        errno = EXDEV;
+        return -1;
+    }
+    return openat(g_root_fd, path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+}
+
+static std::shared_ptr<resolved_file> do_resolve(const char* path)
+{
+    std::shared_ptr<resolved_file> file(new resolved_file);
+    file->fd = open_beneath(path);
+    if(file->fd < 0)
+        file->err = errno;
+    else if(fstat(file->fd, &file->st) < 0)
+    {
+        file->err = errno;
+        close(file->fd);
+        file->fd = -1;
+    }
+    return file;
+}
+
+std::shared_ptr<resolved_file> path_resolver::resolve(const char* url, bool cache_only)
+{
+    // 去掉开头的'/'和'?'之后的查询参数，得到相对于根目录的路径
+    char path[MAX_PATH_LEN];
+    size_t len = strcspn(url + 1, "?");
+    if(len >= sizeof(path))
+    {
+        if(cache_only)
+            return NULL;
+        std::shared_ptr<resolved_file> file(new resolved_file);
+        file->err = ENAMETOOLONG;
+        return file;
+    }
+    if(len == 0)
+        strcpy(path, ".");
+    else
+    {
+        memcpy(path, url + 1, len);
+        path[len] = '\0';
+    }
+
+    // 先读代数再访问文件系统：解析期间根目录发生了变化，则写入的结果已经是过期的
+    unsigned generation = g_generation.load(std::memory_order_acquire);
+    uint64_t hash = hash_path(path);
+    cache_shard& shard = g_shards[hash % SHARDS];
+    cache_slot& slot = shard.slots[(hash / SHARDS) % SLOTS_PER_SHARD];
+    {
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        if(slot.generation == generation && slot.hash == hash && strcmp(slot.path, path) == 0)
+            return slot.file;
+    }
+    if(cache_only)
+        return NULL;
+
+    std::shared_ptr<resolved_file> file = do_resolve(path);
+    {
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        slot.hash = hash;
+        slot.generation = generation;
+        strcpy(slot.path, path);
+        slot.file = file;   // 被替换的旧结果在最后一个使用者释放后才关闭文件描述符
+    }
+    return file;
+}
+
+static int add_watch(const char* fpath, const struct stat*, int typeflag, struct FTW*)
+{
+    if(typeflag != FTW_D)
+        return 0;
+    int wd = inotify_add_watch(g_watch_fd, fpath, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                               | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_ONLYDIR);
+    if(wd >= 0)
+        g_watch_dirs[wd] = fpath;
+    return 0;
+}
+
+int path_resolver::init(const char* doc_root)
+{
+    g_root_fd = open(doc_root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if(g_root_fd < 0)
+    {
+        printf("failed to open doc_root %s: %s\n", doc_root, strerror(errno));
+        return -1;
+    }
+    g_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(g_watch_fd < 0)
+        return -1;
+    // inotify不能递归监视，需要监视每一个子目录；先解析出真实路径，根目录本身是符号链接时也能被遍历
+    char real_root[PATH_MAX];
+    if(realpath(doc_root, real_root))
+        nftw(real_root, add_watch, 16, FTW_PHYS);
+    return g_watch_fd;
+}
+
+void path_resolver::on_watch_event(int fd)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    while(true)     // inotify文件描述符以边沿触发方式注册，需要一次读完
+    {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if(len <= 0)
+            break;
+        changed = true;
+        for(char* p = buf; p < buf + len; )
+        {
+            struct inotify_event* event = (struct inotify_event*)p;
+            if(event->mask & IN_IGNORED)
+                g_watch_dirs.erase(event->wd);
+            else if((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)) && event->len > 0)
+            {
+                auto iter = g_watch_dirs.find(event->wd);
+                if(iter != g_watch_dirs.end())     // 新的子目录（可能是整棵目录树移入）也要监视
+                    nftw((iter->second + "/" + event->name).c_str(), add_watch, 16, FTW_PHYS);
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    if(changed)
+        g_generation.fetch_add(1, std::memory_order_release);
+}
+
+std::string path_resolver::hot_paths()
+{
+    std::string list;
+    unsigned generation = g_generation.load(std::memory_order_acquire);
+    for(cache_shard& shard : g_shards)
+    {
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        for(cache_slot& slot : shard.slots)
+            if(slot.generation == generation && slot.file && slot.file->fd >= 0)
+            {
+                list += '/';
+                if(strcmp(slot.path, ".") != 0)
+                    list += slot.path;
+                list += '\n';
+            }
+    }
+    return list;
+}
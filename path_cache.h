@@ -0,0 +1,43 @@
+#ifndef PATH_CACHE_H
+#define PATH_CACHE_H
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+
+// 一次路径解析的结果。解析成功时持有打开的文件描述符，供mmap使用；失败时记录errno（负缓存）
+struct resolved_file
+{
+    int fd;                 // 只读打开的文件描述符，解析失败时为-1
+    int err;                // 解析失败时的errno，成功为0
+    struct stat st;         // 文件的状态，解析成功时有效
+
+    resolved_file() : fd(-1), err(0) {}
+    ~resolved_file();
+};
+
+/*
+    路径解析器：持有网站根目录的O_PATH目录描述符，用openat2(RESOLVE_BENEATH)相对于它解析URL，
+    既不必每次从'/'开始逐级查找路径，也从内核层面禁止了".."和符号链接逃逸出根目录。
+    解析结果（包括文件不存在这样的失败结果）放入一个有界的分片哈希表中，扫描器的404洪水不会
+    每次都访问文件系统。根目录下的任何变化由inotify通知，使整个缓存失效（增加代数）
+*/
+class path_resolver
+{
+public:
+    static const int SHARDS = 16;               // 分片数，每个分片一把锁
+    static const int SLOTS_PER_SHARD = 64;      // 每个分片的槽数，直接映射，冲突时替换旧结果
+    static const int MAX_PATH_LEN = 200;        // 缓存的路径的最大长度，更长的路径不缓存
+
+    // 打开根目录并建立inotify监视，返回inotify的文件描述符（需加入epoll），失败返回-1
+    static int init(const char* doc_root);
+    // 解析url（以'/'开头，'?'之后的查询参数被忽略）对应的文件；cache_only为true时只查缓存，未命中返回NULL
+    static std::shared_ptr<resolved_file> resolve(const char* url, bool cache_only = false);
+    // inotify文件描述符可读时调用，使缓存失效并监视新建的子目录
+    static void on_watch_event(int fd);
+    // 缓存中解析成功的路径，每行一个URL，热升级时交给新进程预热（见upgrade.h）
+    static std::string hot_paths();
+};
+
+#endif // PATH_CACHE_H
@@ -0,0 +1,296 @@
+#include "proxy.h"
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+std::atomic<long> proxy::m_requests(0);
+std::atomic<long> proxy::m_errors(0);
+
+static proxy_route routes[proxy::MAX_ROUTES];
+static int route_count = 0;
+static std::vector<upstream*> all_upstreams;    // 启动时建立，之后只读
+static thread_local std::vector<std::vector<int>> idle_conns;  // 当前线程的空闲连接，以upstream::index为下标
+
+static int64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool proxy::add_route(const char* spec)
+{
+    const char* eq = strchr(spec, '=');
+    if(route_count >= MAX_ROUTES || !eq || eq == spec || eq - spec >= (int)sizeof(routes[0].prefix) || spec[0] != '/')
+        return false;
+    proxy_route& route = routes[route_count];
+    memcpy(route.prefix, spec, eq - spec);
+    route.prefix[eq - spec] = '\0';
+    route.least_conn = false;
+
+    char list[256];
+    snprintf(list, sizeof(list), "%s", eq + 1);
+    char* save = NULL;
+    for(char* item = strtok_r(list, ",", &save); item; item = strtok_r(NULL, ",", &save))
+    {
+        if(strcmp(item, "leastconn") == 0)
+        {
+            route.least_conn = true;
+            continue;
+        }
+        if(strcmp(item, "roundrobin") == 0)
+            continue;
+        char* colon = strrchr(item, ':');
+        if(!colon)
+            return false;
+        *colon = '\0';
+        upstream* up = new upstream;
+        memset(&up->addr, 0, sizeof(up->addr));
+        up->addr.sin_family = AF_INET;
+        up->addr.sin_port = htons(atoi(colon + 1));
+        if(inet_pton(AF_INET, item, &up->addr.sin_addr) != 1 || up->addr.sin_port == 0)
+        {
+            delete up;
+            return false;
+        }
+        up->index = all_upstreams.size();
+        all_upstreams.push_back(up);
+        route.upstreams.push_back(up);
+    }
+    if(route.upstreams.empty())
+        return false;
+    ++route_count;
+    return true;
+}
+
+const proxy_route* proxy::match(const char* url)
+{
+    const proxy_route* matched = NULL;
+    size_t matched_len = 0;
+    for(int i = 0; i < route_count; ++i)
+    {
+        size_t len = strlen(routes[i].prefix);
+        if(len > matched_len && strncmp(url, routes[i].prefix, len) == 0)
+        {
+            matched = &routes[i];
+            matched_len = len;
+        }
+    }
+    return matched;
+}
+
+upstream* proxy::pick(const proxy_route* route)
+{
+    size_t n = route->upstreams.size();
+    unsigned start = route->next.fetch_add(1, std::memory_order_relaxed);
+    int64_t now = now_ms();
+    upstream* best = NULL;
+    for(size_t i = 0; i < n; ++i)
+    {
+        upstream* up = route->upstreams[(start + i) % n];
+        if(up->down_until.load(std::memory_order_relaxed) > now)
+            continue;
+        if(!route->least_conn)
+            return up;
+        if(!best || up->active.load(std::memory_order_relaxed) < best->active.load(std::memory_order_relaxed))
+            best = up;
+    }
+    return best ? best : route->upstreams[start % n];
+}
+
+void proxy::report(upstream* up, bool ok)
+{
+    if(ok)
+    {
+        up->fails.store(0, std::memory_order_relaxed);
+        up->down_until.store(0, std::memory_order_relaxed);
+        return;
+    }
+    m_errors.fetch_add(1, std::memory_order_relaxed);
+    if(up->fails.fetch_add(1, std::memory_order_relaxed) + 1 >= MAX_FAILS)
+        up->down_until.store(now_ms() + FAIL_TIMEOUT_MS, std::memory_order_relaxed);
+}
+
+int proxy::take_idle(upstream* up)
+{
+    if(idle_conns.size() <= (size_t)up->index)
+        return -1;
+    std::vector<int>& idle = idle_conns[up->index];
+    while(!idle.empty())
+    {
+        int fd = idle.back();
+        idle.pop_back();
+        // 空闲期间上游可能已经关闭了连接（读到0），或者发来了不该有的数据，这样的连接不能再用
+        char c;
+        if(recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return fd;
+        close(fd);
+    }
+    return -1;
+}
+
+void proxy::put_idle(upstream* up, int fd)
+{
+    if(idle_conns.size() <= (size_t)up->index)
+        idle_conns.resize(all_upstreams.size());
+    std::vector<int>& idle = idle_conns[up->index];
+    if((int)idle.size() >= MAX_IDLE_PER_UPSTREAM)
+    {
+        close(fd);
+        return;
+    }
+    idle.push_back(fd);
+}
+
+int proxy::connect_to(upstream* up)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return -1;
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if(connect(fd, (struct sockaddr*)&up->addr, sizeof(up->addr)) < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool proxy::hop_by_hop(const char* line)
+{
+    static const char* const names[] = { "Connection:", "Keep-Alive:", "Proxy-Connection:", "TE:", "Upgrade:" };
+    for(const char* name : names)
+        if(strncasecmp(line, name, strlen(name)) == 0)
+            return true;
+    return false;
+}
+
+int proxy::parse_response(const char* buf, int len, upstream_response* resp, char* out, int out_size, int* out_len)
+{
+    const char* end = (const char*)memmem(buf, len, "\r\n\r\n", 4);
+    if(!end)
+        return len >= BUFFER_SIZE ? -1 : 0;
+    int minor;
+    if(sscanf(buf, "HTTP/1.%d %d", &minor, &resp->status) != 2 || resp->status < 200)
+        return -1;      // 只转发GET请求，不会收到100 Continue之类的临时响应
+    resp->content_length = -1;
+    resp->chunked = false;
+    resp->close = minor == 0;
+    resp->header_len = end + 4 - buf;
+
+    int n = 0;
+    const char* line = buf;
+    bool first = true;
+    while(line < end + 2)
+    {
+        const char* eol = (const char*)memmem(line, end + 2 - line, "\r\n", 2);
+        int line_len = eol - line;
+        if(!first)
+        {
+            if(strncasecmp(line, "Content-Length:", 15) == 0)
+                resp->content_length = atoll(line + 15);
+            else if(strncasecmp(line, "Transfer-Encoding:", 18) == 0 && memmem(line, line_len, "chunked", 7))
+                resp->chunked = true;
+            else if(strncasecmp(line, "Connection:", 11) == 0)
+            {
+                const char* value = line + 11 + strspn(line + 11, " \t");
+                if(strncasecmp(value, "close", 5) == 0)
+                    resp->close = true;
+                else if(strncasecmp(value, "keep-alive", 10) == 0)
+                    resp->close = false;
+            }
+        }
+        if(first || !hop_by_hop(line))
+        {
+            if(n + line_len + 2 > out_size)
+                return -1;
+            memcpy(out + n, line, line_len + 2);
+            n += line_len + 2;
+        }
+        first = false;
+        line = eol + 2;
+    }
+    if(resp->chunked)
+        resp->content_length = -1;
+    *out_len = n;
+    return 1;
+}
+
+int chunk_scanner::feed(const char* data, int len)
+{
+    for(int i = 0; i < len; ++i)
+    {
+        char c = data[i];
+        switch(state)
+        {
+            case SIZE:
+                if(isxdigit((unsigned char)c))
+                {
+                    if(size >> 40)      // 不合理的块大小
+                        return -1;
+                    size = size * 16 + (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+                }
+                else if(c == ';' || c == ' ' || c == '\t')
+                    state = EXTENSION;
+                else if(c == '\r')
+                    state = SIZE_LF;
+                else
+                    return -1;
+                break;
+            case EXTENSION:
+                if(c == '\r')
+                    state = SIZE_LF;
+                break;
+            case SIZE_LF:
+                if(c != '\n')
+                    return -1;
+                state = size == 0 ? TRAILER : DATA;
+                break;
+            case DATA:
+            {
+                uint64_t n = len - i;
+                if(n > size)
+                    n = size;
+                size -= n;
+                i += n - 1;
+                if(size == 0)
+                    state = DATA_CR;
+                break;
+            }
+            case DATA_CR:
+                if(c != '\r')
+                    return -1;
+                state = DATA_LF;
+                break;
+            case DATA_LF:
+                if(c != '\n')
+                    return -1;
+                state = SIZE;
+                break;
+            case TRAILER:       // 最后一个块之后是可选的尾部字段，以空行结束
+                state = c == '\r' ? END_LF : TRAILER_LINE;
+                break;
+            case TRAILER_LINE:
+                if(c == '\n')
+                    state = TRAILER;
+                break;
+            case END_LF:
+                if(c != '\n')
+                    return -1;
+                state = DONE;
+                return i + 1;
+            case DONE:
+                return i;
+        }
+    }
+    return len;
+}
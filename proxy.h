@@ -0,0 +1,91 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+// 一个上游服务器，健康状态由转发的结果被动维护
+struct upstream
+{
+    int index;                          // 在所有上游服务器中的序号，用于索引每个线程的空闲连接池
+    sockaddr_in addr;
+    std::atomic<int> active{0};         // 正在转发的请求数（最少连接数均衡使用）
+    std::atomic<int> fails{0};          // 连续失败的次数
+    std::atomic<int64_t> down_until{0}; // 连续失败过多时暂停选择它，直到这个时间（毫秒）
+};
+
+// 一个代理路由：以prefix开头的URL转发给这组上游服务器
+struct proxy_route
+{
+    char prefix[64];
+    bool least_conn;                    // true为最少连接数，false为轮询
+    std::vector<upstream*> upstreams;
+    mutable std::atomic<unsigned> next{0};  // 轮询的位置
+};
+
+// 上游响应头部的解析结果
+struct upstream_response
+{
+    int status;
+    long long content_length;   // -1表示没有Content-Length
+    bool chunked;               // Transfer-Encoding: chunked
+    bool close;                 // 上游在响应之后关闭连接（Connection: close或HTTP/1.0）
+    int header_len;             // 头部（包括空行）的长度
+};
+
+// 逐字节跟踪chunked编码的消息体以找到它的结尾，数据本身不做修改，原样转发给客户端
+struct chunk_scanner
+{
+    enum STATE { SIZE, EXTENSION, SIZE_LF, DATA, DATA_CR, DATA_LF, TRAILER, TRAILER_LINE, END_LF, DONE };
+    STATE state = SIZE;
+    uint64_t size = 0;
+
+    // 扫描len字节，返回其中属于消息体的字节数（消息体在其中结束时小于len），格式错误返回-1
+    int feed(const char* data, int len);
+};
+
+/*
+    反向代理：URL以配置的前缀开头的请求被转发给一组上游HTTP/1.1服务器。到上游的连接是非阻塞的，注册在
+    客户连接所在reactor的epoll中，由同一个事件循环驱动；请求结束后可复用的连接放回当前线程的空闲连接池。
+    每次只读取一个缓冲区的响应，发送给客户端之后再继续读取，响应不会被完整地缓存在内存中
+*/
+class proxy
+{
+public:
+    static const int MAX_ROUTES = 16;
+    static const int CONNECT_TIMEOUT_MS = 1000;     // 连接上游的超时
+    static const int READ_TIMEOUT_MS = 30000;       // 等待上游数据（包括发送请求）的超时，每次等待单独计时
+    static const int MAX_FAILS = 3;                 // 连续失败这么多次后暂时不再选择该上游
+    static const int FAIL_TIMEOUT_MS = 5000;        // 暂停选择的时长，之后重新尝试
+    static const int MAX_IDLE_PER_UPSTREAM = 32;    // 每个线程为每个上游保留的空闲连接数
+    static const int BUFFER_SIZE = 16384;           // 转发请求和响应使用的缓冲区大小，响应头部不能超过它
+
+    // 解析"prefix=host:port[,host:port...][,leastconn]"形式的配置并加入路由表
+    static bool add_route(const char* spec);
+    // 最长前缀匹配，没有配置代理或不匹配时返回NULL
+    static const proxy_route* match(const char* url);
+    // 按路由的均衡策略选择一个上游，跳过暂停选择的上游；全部暂停时仍然轮询选择，让它们有机会恢复
+    static upstream* pick(const proxy_route* route);
+    // 报告一次转发的结果，维护上游的健康状态
+    static void report(upstream* up, bool ok);
+
+    // 从当前线程的空闲连接池中取出一个仍然有效的连接，没有返回-1
+    static int take_idle(upstream* up);
+    // 把可复用的连接放回当前线程的空闲连接池，池满时关闭
+    static void put_idle(upstream* up, int fd);
+    // 发起非阻塞连接，返回socket（连接可能仍在进行中），失败返回-1
+    static int connect_to(upstream* up);
+
+    /* 解析buf中的响应头部，返回1表示完整，0表示还需要更多数据，-1表示格式错误或头部过大。
+       完整时把状态行和除逐跳头部（Connection、Keep-Alive等）之外的头部写入out（不含结尾的空行） */
+    static int parse_response(const char* buf, int len, upstream_response* resp, char* out, int out_size, int* out_len);
+    // 是否是不应转发的逐跳头部
+    static bool hop_by_hop(const char* line);
+
+    static std::atomic<long> m_requests;        // 转发的请求数
+    static std::atomic<long> m_errors;          // 上游失败（连接失败、超时、错误的响应）的次数
+};
+
+#endif // PROXY_H
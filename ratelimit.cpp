@@ -0,0 +1,172 @@
+#include "ratelimit.h"
+#include <time.h>
+#include <mutex>
+
+bool rate_limiter::m_enabled = false;
+std::atomic<long> rate_limiter::m_rejected_conns(0);
+std::atomic<long> rate_limiter::m_limited_requests(0);
+std::atomic<long> rate_limiter::m_table_full(0);
+
+struct limiter_shard
+{
+    std::mutex mutex;       // 只在占用新槽时使用
+    client_slot slots[rate_limiter::SLOTS_PER_SHARD];
+};
+
+static limiter_shard* shards = NULL;
+static int conn_limit = 0;
+static uint64_t request_interval = 0;   // 请求桶的发送间隔（纳秒），0表示不限制
+static uint64_t request_tolerance = 0;  // 请求桶允许的突发（纳秒）
+static double byte_cost = 0;            // 每字节的发送间隔（纳秒），0表示不限制
+static uint64_t byte_tolerance = 0;
+
+static uint64_t now_ns()
+{
+    // 限流不需要很高的精度，CLOCK_MONOTONIC_COARSE最便宜
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t hash_ip(uint32_t ip)
+{
+    ip ^= ip >> 16;
+    ip *= 0x7feb352d;
+    ip ^= ip >> 15;
+    ip *= 0x846ca68b;
+    ip ^= ip >> 16;
+    return ip;
+}
+
+void rate_limiter::init(int max_conns, int requests_per_sec, int request_burst, long long bytes_per_sec, long long bytes_burst)
+{
+    conn_limit = max_conns > 0 ? max_conns : 0;
+    if(requests_per_sec > 0)
+    {
+        request_interval = 1000000000ULL / requests_per_sec;
+        int burst = request_burst > 0 ? request_burst : requests_per_sec;  // 默认允许一秒的突发
+        request_tolerance = request_interval * (burst - 1);
+    }
+    if(bytes_per_sec > 0)
+    {
+        byte_cost = 1e9 / bytes_per_sec;
+        byte_tolerance = (uint64_t)(byte_cost * (bytes_burst > 0 ? bytes_burst : bytes_per_sec));
+    }
+    m_enabled = conn_limit || request_interval || byte_cost > 0;
+    if(m_enabled)
+        shards = new limiter_shard[SHARDS];
+}
+
+// 查找ip的槽，没有时占用一个空槽或过期的槽，表满返回NULL
+static client_slot* find_slot(uint32_t ip, uint64_t now)
+{
+    uint32_t h = hash_ip(ip);
+    limiter_shard& shard = shards[h % rate_limiter::SHARDS];
+    uint32_t start = (h / rate_limiter::SHARDS) % rate_limiter::SLOTS_PER_SHARD;
+    // 无锁的查找
+    for(int i = 0; i < rate_limiter::PROBE; ++i)
+    {
+        client_slot& slot = shard.slots[(start + i) % rate_limiter::SLOTS_PER_SHARD];
+        if(slot.ip.load(std::memory_order_acquire) == ip)
+            return &slot;
+    }
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    client_slot* free_slot = NULL;
+    for(int i = 0; i < rate_limiter::PROBE; ++i)
+    {
+        client_slot& slot = shard.slots[(start + i) % rate_limiter::SLOTS_PER_SHARD];
+        uint32_t owner = slot.ip.load(std::memory_order_acquire);
+        if(owner == ip)         // 加锁之前被其他线程占用了
+            return &slot;
+        if(free_slot)
+            continue;
+        /* 空槽，或者没有连接、空闲已久、令牌桶早已回满的槽（惰性过期）。复用的瞬间如果恰好有线程无锁地找到了旧IP，
+           它的计数会记到新IP上，但这要求旧IP在空闲了EXPIRE_MS之后的同一时刻再次出现，影响可以忽略 */
+        if(owner == 0 || (slot.conns.load(std::memory_order_relaxed) == 0
+            && slot.last_seen.load(std::memory_order_relaxed) + (uint64_t)rate_limiter::EXPIRE_MS * 1000000 < now
+            && slot.request_tat.load(std::memory_order_relaxed) < now && slot.bytes_tat.load(std::memory_order_relaxed) < now))
+            free_slot = &slot;
+    }
+    if(free_slot)
+    {
+        free_slot->conns.store(0, std::memory_order_relaxed);
+        free_slot->request_tat.store(0, std::memory_order_relaxed);
+        free_slot->bytes_tat.store(0, std::memory_order_relaxed);
+        free_slot->last_seen.store(now, std::memory_order_relaxed);
+        free_slot->ip.store(ip, std::memory_order_release);
+    }
+    return free_slot;
+}
+
+client_slot* rate_limiter::connect(uint32_t ip, bool* rejected)
+{
+    *rejected = false;
+    if(!m_enabled || ip == 0)
+        return NULL;
+    uint64_t now = now_ns();
+    client_slot* slot = find_slot(ip, now);
+    if(!slot)
+    {
+        m_table_full.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+    }
+    slot->last_seen.store(now, std::memory_order_relaxed);
+    if(slot->conns.fetch_add(1, std::memory_order_relaxed) >= conn_limit && conn_limit)
+    {
+        slot->conns.fetch_sub(1, std::memory_order_relaxed);
+        m_rejected_conns.fetch_add(1, std::memory_order_relaxed);
+        *rejected = true;
+        return NULL;
+    }
+    return slot;
+}
+
+void rate_limiter::disconnect(client_slot* slot)
+{
+    slot->last_seen.store(now_ns(), std::memory_order_relaxed);
+    slot->conns.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool rate_limiter::allow_request(client_slot* slot, int* retry_after)
+{
+    uint64_t now = now_ns();
+    // 之前的响应透支了字节桶：拒绝，直到透支的部分按速率还清
+    if(byte_cost > 0)
+    {
+        uint64_t tat = slot->bytes_tat.load(std::memory_order_relaxed);
+        if(tat > now + byte_tolerance)
+        {
+            *retry_after = (int)((tat - now - byte_tolerance) / 1000000000) + 1;
+            m_limited_requests.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    }
+    if(request_interval)
+    {
+        uint64_t tat = slot->request_tat.load(std::memory_order_relaxed);
+        while(true)
+        {
+            uint64_t new_tat = (tat > now ? tat : now) + request_interval;
+            if(new_tat > now + request_tolerance + request_interval)
+            {
+                *retry_after = (int)((new_tat - now - request_tolerance - request_interval) / 1000000000) + 1;
+                m_limited_requests.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            if(slot->request_tat.compare_exchange_weak(tat, new_tat, std::memory_order_relaxed))
+                break;
+        }
+    }
+    return true;
+}
+
+void rate_limiter::charge_bytes(client_slot* slot, long long bytes)
+{
+    if(byte_cost <= 0 || bytes <= 0)
+        return;
+    uint64_t now = now_ns();
+    uint64_t cost = (uint64_t)(bytes * byte_cost);
+    uint64_t tat = slot->bytes_tat.load(std::memory_order_relaxed);
+    while(!slot->bytes_tat.compare_exchange_weak(tat, (tat > now ? tat : now) + cost, std::memory_order_relaxed))
+        ;
+}
@@ -0,0 +1,56 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+#include <atomic>
+
+/*
+    一个客户端IP的限流状态。请求数和字节数的令牌桶用GCRA（通用信元速率算法）表示：每个桶只有一个
+    "理论到达时间"（TAT），放行一个请求就是用CAS把TAT向后推一个发送间隔，不需要锁，也不需要定时补充令牌
+*/
+struct client_slot
+{
+    std::atomic<uint32_t> ip{0};            // IPv4地址（网络字节序），0表示空槽
+    std::atomic<int> conns{0};              // 当前的连接数
+    std::atomic<uint64_t> request_tat{0};   // 请求桶的理论到达时间（纳秒）
+    std::atomic<uint64_t> bytes_tat{0};     // 字节桶的理论到达时间（纳秒）
+    std::atomic<uint64_t> last_seen{0};     // 最后一次使用的时间，空闲超过EXPIRE_MS且没有连接的槽可以被其他IP复用
+};
+
+/*
+    按客户端IP限流：每个IP的并发连接数上限、每秒请求数和每秒响应字节数（令牌桶，允许一定的突发）。
+    状态放在一个定长的分片哈希表中，按IP哈希到分片内的一段槽上线性探测，查找和更新都是无锁的原子操作；
+    只有为新IP占用槽时持有分片的锁，占用时顺便回收（惰性过期）长期空闲的槽，不需要后台清理。
+    表满时不限流（放行），只计数。所有限制为0表示不启用，此时不访问哈希表
+*/
+class rate_limiter
+{
+public:
+    static const int SHARDS = 64;               // 分片数，每个分片一把锁（只在占用新槽时使用）
+    static const int SLOTS_PER_SHARD = 1024;    // 每个分片的槽数
+    static const int PROBE = 8;                 // 线性探测的最大长度
+    static const int EXPIRE_MS = 60000;         // 没有连接的槽空闲这么久后可以被其他IP复用
+
+    /* 设置限制：每个IP最多max_conns个并发连接，每秒requests_per_sec个请求（突发request_burst个），
+       每秒bytes_per_sec字节的响应（突发bytes_burst字节），为0的项不限制，突发为0时允许一秒的量 */
+    static void init(int max_conns, int requests_per_sec, int request_burst, long long bytes_per_sec, long long bytes_burst);
+    static bool enabled() { return m_enabled; }
+
+    // 接受连接时调用：返回客户端的槽（未启用或表满时为NULL，表示不限流）；连接数超过上限时返回NULL并把*rejected置为true
+    static client_slot* connect(uint32_t ip, bool* rejected);
+    // 连接关闭时调用
+    static void disconnect(client_slot* slot);
+    // 请求解析完后调用：请求数或者之前的响应字节数超过限制时返回false，应回复429；retry_after为建议的重试间隔（秒）
+    static bool allow_request(client_slot* slot, int* retry_after);
+    // 响应生成后调用，记入响应的字节数（可以透支，透支的部分让之后的请求被拒绝）
+    static void charge_bytes(client_slot* slot, long long bytes);
+
+    static std::atomic<long> m_rejected_conns;      // 因连接数超过上限而拒绝的连接数
+    static std::atomic<long> m_limited_requests;    // 回复429的请求数
+    static std::atomic<long> m_table_full;          // 因表满而没有限流的连接数
+
+private:
+    static bool m_enabled;
+};
+
+#endif // RATELIMIT_H
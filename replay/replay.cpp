@@ -0,0 +1,569 @@
+/*
+    流量重放工具：读取服务器捕获的流量（server -d，格式见capture.h），按原来的时间间隔（或按比例加速）
+    重新建立每个连接，在原来的时刻发送同样的字节，从而重现生产环境中的请求头大小、keep-alive的复用、
+    请求之间的间隔和流水线的突发，并统计每个请求的延迟（从请求的最后一个字节写入socket到响应接收完整）
+    编译：g++ -O2 -o replay replay.cpp ../proxy.cpp
+    用法：replay [-s speed] [-t timeout_ms] host port capture_file
+        -s  回放速度的倍数，2表示两倍速（间隔减半），0表示忽略时间间隔尽快发送（默认1）
+        -t  连接在捕获中结束之后，等待尚未收到的响应的超时（毫秒，默认10000）
+    HTTPS连接捕获的是解密后的明文，一律以明文HTTP重放
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <algorithm>
+#include <unordered_map>
+#include "../capture.h"
+#include "../proxy.h"
+
+struct replay_chunk
+{
+    uint64_t time;          // 捕获中的时间（纳秒）
+    size_t off;             // 在g_data中的位置
+    uint32_t len;
+};
+
+// 一个已发送、等待响应的请求
+struct pending_request
+{
+    uint64_t sent;          // 最后一个字节写入socket的时间
+    bool head;              // HEAD请求的响应没有消息体
+};
+
+struct replay_conn
+{
+    uint64_t open_time = 0;
+    uint64_t close_time = 0;        // 捕获中没有CLOSE时为最后一次数据的时间
+    std::vector<replay_chunk> chunks;
+    size_t next = 0;                // 下一个要发送的数据块，chunks.size()之后是关闭
+    bool opened = false;
+    bool closing = false;           // 捕获中的连接已经结束，等响应收完后关闭
+    bool done = false;
+    int fd = -1;
+    bool connected = false;
+    std::string out;                // 到了发送时刻但还没有写入socket的数据
+    size_t out_off = 0;
+
+    // 扫描写入socket的字节以划分请求
+    std::string req_head;           // 当前请求已经写入的头部
+    long long req_body = -1;        // 当前请求剩余的消息体字节数，-1表示还在头部
+    bool req_is_head = false;
+    std::deque<pending_request> pending;
+
+    // 解析响应
+    std::string in;
+    bool in_body = false;
+    int resp_status = 0;
+    long long resp_left = 0;        // 剩余的消息体字节数，-1表示chunked，-2表示直到连接关闭
+    chunk_scanner chunks_in;
+};
+
+// 调度事件：到时间时执行连接的下一个动作，或者检查关闭时的超时
+struct replay_event
+{
+    uint64_t due;
+    uint32_t conn;
+    bool deadline;
+    bool operator>(const replay_event& o) const { return due > o.due; }
+};
+
+static std::string g_data;                  // 所有数据块的内容
+static std::vector<replay_conn> g_conns;
+static std::priority_queue<replay_event, std::vector<replay_event>, std::greater<replay_event>> g_events;
+static double g_speed = 1.0;
+static uint64_t g_timeout_ns = 10000ULL * 1000000;
+static uint64_t g_start = 0;                // 开始重放的时间
+static uint64_t g_first = 0;                // 捕获中第一个连接建立的时间
+static int g_epollfd = -1;
+static sockaddr_in g_addr;
+static int g_active = 0;                    // 尚未结束的连接数
+
+// 统计
+static std::vector<uint32_t> g_latencies;   // 微秒
+static long g_requests = 0, g_errors = 0, g_timeouts = 0, g_unmatched = 0, g_conn_failed = 0;
+static long g_status[6];
+static uint64_t g_lag_total = 0, g_lag_max = 0, g_lag_count = 0;
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 捕获中的时间换算成重放时的时刻
+static uint64_t due_time(uint64_t t)
+{
+    if(g_speed <= 0)
+        return g_start;
+    return g_start + (uint64_t)((t - g_first) / g_speed);
+}
+
+static bool load(const char* path)
+{
+    FILE* fp = fopen(path, "r");
+    if(!fp)
+    {
+        printf("failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    capture_file_header header;
+    if(fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        printf("%s is not a capture file\n", path);
+        fclose(fp);
+        return false;
+    }
+    std::unordered_map<uint32_t, uint32_t> index;   // 捕获中的连接编号 -> g_conns的下标
+    capture_record r;
+    char buf[UINT16_MAX];
+    while(fread(&r, sizeof(r), 1, fp) == 1)
+    {
+        if(r.len && fread(buf, 1, r.len, fp) != r.len)
+            break;      // 进程被杀死时最后一条记录可能不完整
+        if(r.type == CAPTURE_OPEN)
+        {
+            index[r.conn] = g_conns.size();
+            g_conns.emplace_back();
+            g_conns.back().open_time = g_conns.back().close_time = r.time;
+            continue;
+        }
+        auto it = index.find(r.conn);
+        if(it == index.end())
+            continue;
+        replay_conn& c = g_conns[it->second];
+        c.close_time = r.time;
+        if(r.type == CAPTURE_DATA && r.len)
+        {
+            c.chunks.push_back({ r.time, g_data.size(), r.len });
+            g_data.append(buf, r.len);
+        }
+        else if(r.type == CAPTURE_CLOSE)
+            index.erase(it);
+    }
+    fclose(fp);
+    if(!g_conns.empty())
+        g_first = g_conns[0].open_time;
+    return true;
+}
+
+static void finish(replay_conn& c)
+{
+    if(c.done)
+        return;
+    c.done = true;
+    if(c.fd >= 0)
+        close(c.fd);
+    c.fd = -1;
+    --g_active;
+}
+
+// 连接异常结束：已发送的请求计为错误，剩下的数据不再发送
+static void fail(replay_conn& c)
+{
+    g_errors += c.pending.size();
+    c.pending.clear();
+    finish(c);
+}
+
+static void update_events(replay_conn& c)
+{
+    epoll_event ev;
+    ev.data.u32 = &c - &g_conns[0];
+    ev.events = EPOLLIN;
+    if(!c.connected || c.out_off < c.out.size())
+        ev.events |= EPOLLOUT;
+    epoll_ctl(g_epollfd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+static void maybe_close(replay_conn& c)
+{
+    if(c.closing && c.out_off == c.out.size() && c.pending.empty() && c.req_head.empty() && c.req_body <= 0)
+        finish(c);
+}
+
+// 扫描刚写入socket的字节，每当一个请求写完整就记录下时间
+static void scan_sent(replay_conn& c, const char* data, size_t len, uint64_t t)
+{
+    while(len > 0)
+    {
+        if(c.req_body > 0)
+        {
+            size_t n = (size_t)c.req_body < len ? (size_t)c.req_body : len;
+            c.req_body -= n;
+            data += n;
+            len -= n;
+            if(c.req_body == 0)
+            {
+                c.pending.push_back({ t, c.req_is_head });
+                ++g_requests;
+                c.req_body = -1;
+            }
+            continue;
+        }
+        // 在头部中，找到空行为止
+        size_t old = c.req_head.size();
+        c.req_head.append(data, len);
+        size_t end = c.req_head.find("\r\n\r\n", old >= 3 ? old - 3 : 0);
+        if(end == std::string::npos)
+            return;
+        size_t used = end + 4 - old;
+        data += used;
+        len -= used;
+        c.req_is_head = strncmp(c.req_head.c_str(), "HEAD ", 5) == 0;
+        long long body = 0;
+        for(size_t pos = c.req_head.find("\r\n"); pos < end; pos = c.req_head.find("\r\n", pos + 2))
+            if(strncasecmp(c.req_head.c_str() + pos + 2, "Content-Length:", 15) == 0)
+                body = atoll(c.req_head.c_str() + pos + 17);
+        c.req_head.clear();
+        c.req_body = body;
+        if(body == 0)
+        {
+            c.pending.push_back({ t, c.req_is_head });
+            ++g_requests;
+            c.req_body = -1;
+        }
+    }
+}
+
+static void flush(replay_conn& c)
+{
+    while(c.out_off < c.out.size())
+    {
+        ssize_t n = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL);
+        if(n < 0)
+        {
+            if(errno == EAGAIN)
+                break;
+            fail(c);
+            return;
+        }
+        scan_sent(c, c.out.data() + c.out_off, n, now());
+        c.out_off += n;
+    }
+    if(c.out_off == c.out.size())
+    {
+        c.out.clear();
+        c.out_off = 0;
+    }
+    update_events(c);
+    maybe_close(c);
+}
+
+static void response_done(replay_conn& c, int status)
+{
+    if(status >= 100 && status < 600)
+        ++g_status[status / 100];
+    if(c.pending.empty())
+    {
+        ++g_unmatched;
+        return;
+    }
+    g_latencies.push_back((now() - c.pending.front().sent) / 1000);
+    c.pending.pop_front();
+}
+
+// 解析收到的响应，返回false表示响应格式错误
+static bool parse_responses(replay_conn& c)
+{
+    while(!c.in.empty())
+    {
+        if(!c.in_body)
+        {
+            upstream_response resp;
+            char out[proxy::BUFFER_SIZE];
+            int out_len;
+            int ret = proxy::parse_response(c.in.data(), c.in.size(), &resp, out, sizeof(out), &out_len);
+            if(ret < 0)
+                return false;
+            if(ret == 0)
+                return true;
+            c.in.erase(0, resp.header_len);
+            c.resp_status = resp.status;
+            bool head = !c.pending.empty() && c.pending.front().head;
+            if(head || resp.content_length == 0)
+            {
+                response_done(c, c.resp_status);
+                continue;
+            }
+            c.in_body = true;
+            c.resp_left = resp.chunked ? -1 : (resp.content_length > 0 ? resp.content_length : -2);
+            c.chunks_in = chunk_scanner();
+        }
+        if(c.resp_left == -2)       // 直到连接关闭
+        {
+            c.in.clear();
+            return true;
+        }
+        size_t used;
+        bool complete;
+        if(c.resp_left == -1)
+        {
+            int n = c.chunks_in.feed(c.in.data(), c.in.size());
+            if(n < 0)
+                return false;
+            used = n;
+            complete = c.chunks_in.state == chunk_scanner::DONE;
+        }
+        else
+        {
+            used = (size_t)c.resp_left < c.in.size() ? (size_t)c.resp_left : c.in.size();
+            c.resp_left -= used;
+            complete = c.resp_left == 0;
+        }
+        c.in.erase(0, used);
+        if(!complete)
+            return true;
+        c.in_body = false;
+        response_done(c, c.resp_status);
+    }
+    return true;
+}
+
+static void on_readable(replay_conn& c)
+{
+    char buf[65536];
+    while(!c.done)
+    {
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if(n < 0)
+        {
+            if(errno != EAGAIN)
+                fail(c);
+            return;
+        }
+        if(n == 0)      // 服务器关闭了连接
+        {
+            if(c.in_body && c.resp_left == -2)
+            {
+                c.in_body = false;
+                response_done(c, c.resp_status);
+            }
+            if(!c.pending.empty() || c.next < c.chunks.size())
+                fail(c);
+            else
+                finish(c);
+            return;
+        }
+        c.in.append(buf, n);
+        if(!parse_responses(c))
+        {
+            fail(c);
+            return;
+        }
+        maybe_close(c);
+    }
+}
+
+// 执行连接的下一个动作：建立连接、发送一个数据块或结束
+static void run_action(uint32_t i)
+{
+    replay_conn& c = g_conns[i];
+    if(c.done)
+        return;
+    uint64_t t = now();
+    if(!c.opened)
+    {
+        c.opened = true;
+        c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        int one = 1;
+        setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if(c.fd < 0 || (connect(c.fd, (sockaddr*)&g_addr, sizeof(g_addr)) < 0 && errno != EINPROGRESS))
+        {
+            ++g_conn_failed;
+            finish(c);
+            return;
+        }
+        epoll_event ev;
+        ev.data.u32 = i;
+        ev.events = EPOLLIN | EPOLLOUT;
+        epoll_ctl(g_epollfd, EPOLL_CTL_ADD, c.fd, &ev);
+    }
+    else if(c.next < c.chunks.size())
+    {
+        const replay_chunk& chunk = c.chunks[c.next++];
+        uint64_t lag = t - due_time(chunk.time);
+        g_lag_total += lag;
+        g_lag_count++;
+        if(lag > g_lag_max)
+            g_lag_max = lag;
+        c.out.append(g_data, chunk.off, chunk.len);
+        if(c.connected)
+            flush(c);
+    }
+    else
+    {
+        c.closing = true;
+        maybe_close(c);
+        if(!c.done)
+            g_events.push({ t + g_timeout_ns, i, true });
+        return;
+    }
+    if(c.done)
+        return;
+    uint64_t next = c.next < c.chunks.size() ? c.chunks[c.next].time : c.close_time;
+    g_events.push({ due_time(next), i, false });
+}
+
+static void on_writable(replay_conn& c)
+{
+    if(!c.connected)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if(err)
+        {
+            ++g_conn_failed;
+            fail(c);
+            return;
+        }
+        c.connected = true;
+    }
+    flush(c);
+}
+
+static uint32_t percentile(double p)
+{
+    if(g_latencies.empty())
+        return 0;
+    size_t i = (size_t)(p * (g_latencies.size() - 1));
+    return g_latencies[i];
+}
+
+static void report(uint64_t elapsed)
+{
+    std::sort(g_latencies.begin(), g_latencies.end());
+    unsigned long long total = 0;
+    for(uint32_t l : g_latencies)
+        total += l;
+    uint64_t span = 0;
+    for(auto& c : g_conns)
+        if(c.close_time - g_first > span)
+            span = c.close_time - g_first;
+    printf("Replayed %zu connections from a %.3f s capture in %.3f s (speed %g).\n",
+           g_conns.size(), span / 1e9, elapsed / 1e9, g_speed);
+    printf("Requests: %ld sent, %zu answered, %ld failed, %ld timed out, %ld unmatched responses; %ld connections failed.\n",
+           g_requests, g_latencies.size(), g_errors, g_timeouts, g_unmatched, g_conn_failed);
+    printf("Status: 1xx %ld, 2xx %ld, 3xx %ld, 4xx %ld, 5xx %ld.\n", g_status[1], g_status[2], g_status[3], g_status[4], g_status[5]);
+    printf("Latency (us): avg %llu, p50 %u, p90 %u, p99 %u, p99.9 %u, max %u.\n",
+           g_latencies.empty() ? 0 : total / g_latencies.size(), percentile(0.50), percentile(0.90),
+           percentile(0.99), percentile(0.999), g_latencies.empty() ? 0 : g_latencies.back());
+    // 重放本身落后于时间表太多时，测得的间隔和并发已经与捕获不同
+    printf("Schedule lag (us): avg %llu, max %llu.\n",
+           g_lag_count ? (unsigned long long)(g_lag_total / g_lag_count / 1000) : 0ULL, (unsigned long long)(g_lag_max / 1000));
+}
+
+static void usage(const char* prog)
+{
+    printf("usage: %s [-s speed] [-t timeout_ms] host port capture_file\n"
+           "  -s  replay speed multiplier, 2 halves every gap, 0 sends as fast as possible (default 1)\n"
+           "  -t  how long to wait for outstanding responses after a connection ends in the capture (default 10000)\n",
+           prog);
+}
+
+int main(int argc, char* argv[])
+{
+    int opt;
+    while((opt = getopt(argc, argv, "s:t:")) != -1)
+    {
+        switch(opt)
+        {
+            case 's': g_speed = atof(optarg); break;
+            case 't': g_timeout_ns = strtoull(optarg, NULL, 10) * 1000000; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(argc - optind != 3 || g_speed < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(argv[optind], argv[optind + 1], &hints, &res) != 0)
+    {
+        printf("cannot resolve %s\n", argv[optind]);
+        return 1;
+    }
+    memcpy(&g_addr, res->ai_addr, sizeof(g_addr));
+    freeaddrinfo(res);
+
+    if(!load(argv[optind + 2]))
+        return 1;
+    if(g_conns.empty())
+    {
+        printf("no connections in %s\n", argv[optind + 2]);
+        return 1;
+    }
+
+    // 捕获中同时打开的连接可能很多
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    g_epollfd = epoll_create1(0);
+    g_start = now();
+    g_active = g_conns.size();
+    for(uint32_t i = 0; i < g_conns.size(); ++i)
+        g_events.push({ due_time(g_conns[i].open_time), i, false });
+
+    std::vector<epoll_event> events(1024);
+    while(g_active > 0)
+    {
+        uint64_t t = now();
+        while(!g_events.empty() && g_events.top().due <= t)
+        {
+            replay_event e = g_events.top();
+            g_events.pop();
+            replay_conn& c = g_conns[e.conn];
+            if(!e.deadline)
+                run_action(e.conn);
+            else if(!c.done)
+            {
+                g_timeouts += c.pending.size();
+                c.pending.clear();
+                finish(c);
+            }
+        }
+        int timeout = -1;
+        if(!g_events.empty())
+        {
+            uint64_t wait = g_events.top().due > t ? g_events.top().due - t : 0;
+            timeout = (int)(wait / 1000000);    // 向下取整，最后不到1毫秒忙等，发送时刻不会整体推迟
+        }
+        int n = epoll_wait(g_epollfd, events.data(), events.size(), timeout);
+        for(int i = 0; i < n; ++i)
+        {
+            replay_conn& c = g_conns[events[i].data.u32];
+            if(!c.done && (events[i].events & (EPOLLOUT | EPOLLERR)))
+                on_writable(c);
+            if(!c.done && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                on_readable(c);
+        }
+    }
+    report(now() - g_start);
+    return 0;
+}
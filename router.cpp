@@ -0,0 +1,227 @@
+#include "router.h"
+
+// 健康检查，负载均衡器用它判断进程是否存活
+static http_conn::HTTP_CODE handle_health(http_conn& conn)
+{
+    const char* body = "ok\n";
+    if(!conn.add_status_line(200, "OK") || !conn.add_headers(strlen(body), "text/plain")
+        || !conn.add_content(body))
+        return http_conn::INTERNAL_ERROR;
+    return http_conn::DYNAMIC_REQUEST;
+}
+
+// 整个主机上TCP socket占用的内存（KB），取自/proc/net/sockstat中以页为单位的mem，读不到时返回-1
+static long tcp_memory_kb()
+{
+    FILE* fp = fopen("/proc/net/sockstat", "r");
+    if(!fp)
+        return -1;
+    char line[256];
+    long pages = -1;
+    while(fgets(line, sizeof(line), fp))
+    {
+        const char* p = strncmp(line, "TCP:", 4) == 0 ? strstr(line, " mem ") : NULL;
+        if(p && sscanf(p, " mem %ld", &pages) == 1)
+            break;
+    }
+    fclose(fp);
+    return pages < 0 ? -1 : pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* /status响应体的三段格式：计数器、各通道的排队情况、线程池等数组。
+   计数器只增不减，缓冲区按所有数值都取最大宽度的情况分配，忙碌的服务器上也不会因为放不下而返回500 */
+static constexpr char STATUS_COUNTERS_FORMAT[] =
+    "{\"users\":%d,\"shed_queue_full\":%ld,\"shed_queue_delay\":%ld,\"coroutine_frames\":%zu,\"coroutine_oversize\":%ld,"
+    "\"inline_requests\":%ld,\"offloaded_requests\":%ld,\"cold_file_requests\":%ld,\"tls_handshakes\":%ld,\"tls_resumed\":%ld,"
+    "\"ktls_connections\":%ld,\"trace_sampled\":%ld,\"trace_slow\":%ld,\"trace_dropped\":%ld,"
+    "\"proxied_requests\":%ld,\"upstream_errors\":%ld,\"captured_connections\":%ld,\"capture_bytes\":%ld,"
+    "\"capture_truncated\":%ld,\"ip_rejected_conns\":%ld,\"ip_limited_requests\":%ld,\"ip_table_full\":%ld,"
+    "\"sse_subscribers\":%ld,\"sse_published\":%ld,\"sse_delivered\":%ld,\"sse_dropped\":%ld,\"stale_events\":%ld";
+static constexpr char STATUS_LANES_PREFIX[] = ",\"lanes\":{";
+static constexpr char STATUS_LANE_FORMAT[] = "%s\"%s\":[%ld,%ld,%ld]";
+static constexpr const char* STATUS_LANE_NAMES[http_conn::LANES] = { "small", "large", "admin" };
+static constexpr char STATUS_POOLS_FORMAT[] =
+    "},\"pools\":{\"workers\":[%d,%d,%ld,%ld,%d,%d,%ld],\"io\":[%d,%d,%ld,%ld,%d,%d,%ld]},"
+    "\"reactor_spin\":[%ld,%ld,%ld,%ld],\"send\":[%ld,%ld,%ld],\"shaping\":[%ld,%ld,%ld]}\n";
+// 最长的响应头部，Content-Length按%d的最大宽度计算
+static constexpr char STATUS_HEADERS[] =
+    "HTTP/1.1 200 OK\r\nDate: Sun, 06 Nov 1994 08:49:37 GMT\r\nContent-Length: %d\r\n"
+    "Content-Type:application/json\r\nConnection: keep-alive\r\n\r\n";
+
+// 格式串在所有数值都取最大宽度时展开的长度：%d为11个字符，%ld和%zu为20个字符，%s不计（由调用者另外加上）
+static constexpr size_t max_formatted_len(const char* format)
+{
+    size_t len = 0;
+    for(const char* p = format; *p; ++p)
+    {
+        if(*p != '%')
+            ++len;
+        else if(*++p == 'd')
+            len += 11;
+        else if(*p != 's')
+        {
+            ++p;
+            len += 20;
+        }
+    }
+    return len;
+}
+
+static constexpr size_t status_body_max()
+{
+    size_t len = max_formatted_len(STATUS_COUNTERS_FORMAT) + max_formatted_len(STATUS_POOLS_FORMAT);
+    for(int i = 0; i < http_conn::LANES; ++i)
+        len += max_formatted_len(STATUS_LANE_FORMAT) + max_formatted_len(STATUS_LANES_PREFIX) + max_formatted_len(STATUS_LANE_NAMES[i]);
+    return len;
+}
+
+static constexpr size_t STATUS_BODY_MAX = status_body_max();
+static_assert(STATUS_BODY_MAX + max_formatted_len(STATUS_HEADERS) <= (size_t)http_conn::WRITE_BUFFER_SIZE,
+              "/status响应在最坏情况下放不进写缓冲区");
+
+// 以JSON格式输出服务器的运行状态
+static http_conn::HTTP_CODE handle_status(http_conn& conn)
+{
+    char body[STATUS_BODY_MAX + 1];
+    int len = snprintf(body, sizeof(body), STATUS_COUNTERS_FORMAT,
+                       http_conn::m_user_count.load(), http_conn::m_shed_queue_full.load(), http_conn::m_shed_queue_delay.load(),
+                       frame_pool::allocated_blocks(), frame_pool::oversize_frames(),
+                       http_conn::m_inline_requests.load(), http_conn::m_offloaded_requests.load(), http_conn::m_cold_requests.load(),
+                       http_conn::m_tls_handshakes.load(), http_conn::m_tls_resumed.load(), http_conn::m_ktls_connections.load(),
+                       tracer::m_sampled.load(), tracer::m_slow.load(), tracer::m_dropped.load(),
+                       proxy::m_requests.load(), proxy::m_errors.load(),
+                       capture::m_connections.load(), capture::m_bytes.load(), capture::m_truncated.load(),
+                       rate_limiter::m_rejected_conns.load(), rate_limiter::m_limited_requests.load(), rate_limiter::m_table_full.load(),
+                       sse_hub::m_subscribers.load(), sse_hub::m_published.load(), sse_hub::m_delivered.load(), sse_hub::m_dropped.load(),
+                       conn_table::m_stale.load());
+    // 各通道的排队情况：[取出的任务数, 平均排队时间, p99排队时间]（微秒）
+    for(int i = 0; i < http_conn::LANES; ++i)
+    {
+        long tasks, avg_us, p99_us;
+        http_conn::m_pool->laneStats(i, &tasks, &avg_us, &p99_us);
+        len += snprintf(body + len, sizeof(body) - len, STATUS_LANE_FORMAT, i == 0 ? STATUS_LANES_PREFIX : ",",
+                        STATUS_LANE_NAMES[i], tasks, avg_us, p99_us);
+    }
+    // 线程池的伸缩：[线程数, 空闲线程数, 累计增加, 累计回收, 阻塞时间比例%, 进程CPU使用率%, 排队时间（微秒）]
+    threadPool<http_conn>::scalingStats pool, io;
+    http_conn::m_pool->scaling(&pool);
+    http_conn::m_io_pool->scaling(&io);
+    // 低延迟模式的轮询：[非阻塞的epoll_wait次数, 轮询中取到事件的次数, 阻塞次数, 轮询花掉的时间（微秒）]
+    // 发送：[等待EPOLLOUT的次数, 其中用完写量子的次数, 主机上TCP socket占用的内存（KB）]
+    // 限速：[限速发送的响应数, 等待令牌的次数, 限速发送的字节数]
+    len += snprintf(body + len, sizeof(body) - len, STATUS_POOLS_FORMAT,
+                    pool.threads, pool.idle, pool.grown, pool.shrunk, pool.blocked_pct, pool.cpu_pct, pool.wait_us,
+                    io.threads, io.idle, io.grown, io.shrunk, io.blocked_pct, io.cpu_pct, io.wait_us,
+                    low_latency::m_polls.load(), low_latency::m_spin_hits.load(), low_latency::m_sleeps.load(), low_latency::m_spin_us.load(),
+                    http_conn::m_write_waits.load(), http_conn::m_quantum_yields.load(), tcp_memory_kb(),
+                    bandwidth_shaper::m_shaped.load(), bandwidth_shaper::m_paused.load(), bandwidth_shaper::m_bytes.load());
+    if(!conn.add_status_line(200, "OK") || !conn.add_headers(len, "application/json")
+        || !conn.add_bytes(body, len))
+        return http_conn::INTERNAL_ERROR;
+    return http_conn::DYNAMIC_REQUEST;
+}
+
+// 访问网站根目录时重定向到首页
+static http_conn::HTTP_CODE handle_root(http_conn& conn)
+{
+    if(!conn.add_status_line(302, "Found") || !conn.add_literal("Location: /index.html\r\n")
+        || !conn.add_headers(0))
+        return http_conn::INTERNAL_ERROR;
+    return http_conn::DYNAMIC_REQUEST;
+}
+
+// 订阅SSE频道：GET /events/<channel>，响应头发送后连接一直打开，接收发布到这个频道的事件
+static http_conn::HTTP_CODE handle_events(http_conn& conn)
+{
+    const char* name = conn.url() + strlen("/events/");
+    sse_channel* channel = sse_hub::open_channel(name, (int)strcspn(name, "?"));
+    if(!channel)
+        return http_conn::NO_RESOURCE;
+    if(!conn.add_status_line(200, "OK")
+        || !conn.add_literal("Content-Type: text/event-stream\r\nCache-Control: no-cache\r\nX-Accel-Buffering: no\r\n\r\n"))
+        return http_conn::INTERNAL_ERROR;
+    conn.set_event_stream(channel);
+    return http_conn::EVENT_STREAM;
+}
+
+static int hex_value(char c)
+{
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+// 取出查询参数name的值并做URL解码（"+"为空格），返回解码后的长度，没有这个参数返回-1
+static int query_param(const char* url, const char* name, char* out, int size)
+{
+    const char* p = strchr(url, '?');
+    size_t name_len = strlen(name);
+    while(p)
+    {
+        ++p;
+        if(strncmp(p, name, name_len) == 0 && p[name_len] == '=')
+        {
+            int len = 0;
+            for(p += name_len + 1; *p && *p != '&' && len < size - 1; ++p)
+            {
+                if(*p == '%' && hex_value(p[1]) >= 0 && hex_value(p[2]) >= 0)
+                {
+                    out[len++] = (char)(hex_value(p[1]) << 4 | hex_value(p[2]));
+                    p += 2;
+                }
+                else
+                    out[len++] = *p == '+' ? ' ' : *p;
+            }
+            out[len] = '\0';
+            return len;
+        }
+        p = strchr(p, '&');
+    }
+    return -1;
+}
+
+/* 发布事件：GET /publish/<channel>?data=...[&event=name]，只接受来自本机（回环地址或Unix域socket）的请求。
+   服务器只支持GET，所以事件的内容放在URL编码的查询参数中；进程内的其他模块可以直接调用sse_hub::publish */
+static http_conn::HTTP_CODE handle_publish(http_conn& conn)
+{
+    if(conn.client_address().sin_family != AF_UNIX && conn.client_address().sin_addr.s_addr != htonl(INADDR_LOOPBACK))
+        return http_conn::FORBIDDEN_REQUEST;
+    const char* url = conn.url();
+    char name[sse_hub::MAX_CHANNEL_NAME + 1];
+    int name_len = (int)strcspn(url + strlen("/publish/"), "?");
+    if(name_len <= 0 || name_len > sse_hub::MAX_CHANNEL_NAME)
+        return http_conn::NO_RESOURCE;
+    memcpy(name, url + strlen("/publish/"), name_len);
+    name[name_len] = '\0';
+    char event[64];
+    char data[4096];
+    int data_len = query_param(url, "data", data, sizeof(data));
+    if(data_len < 0)
+        return http_conn::BAD_REQUEST;
+    if(query_param(url, "event", event, sizeof(event)) < 0)
+        event[0] = '\0';
+    int subscribers = sse_hub::publish(name, event, data, data_len);
+    char body[64];
+    int len = snprintf(body, sizeof(body), "{\"subscribers\":%d}\n", subscribers);
+    if(!conn.add_status_line(200, "OK") || !conn.add_headers(len, "application/json")
+        || !conn.add_bytes(body, len))
+        return http_conn::INTERNAL_ERROR;
+    return http_conn::DYNAMIC_REQUEST;
+}
+
+// 路由表，在此处声明所有的动态请求处理器
+static constexpr route routes[] = {
+    { "/",         false, handle_root    },
+    { "/healthz",  false, handle_health  },
+    { "/status",   false, handle_status  },
+    { "/events/",  true,  handle_events  },
+    { "/publish/", true,  handle_publish },
+};
+
+static constexpr route_trie<sizeof(routes) / sizeof(routes[0]), route_trie_size(routes)> trie(routes);
+
+const route* find_route(const char* url)
+{
+    return trie.find(url);
+}
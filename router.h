@@ -0,0 +1,109 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stddef.h>
+#include "http_conn.h"
+
+/* 进程内的动态请求处理器：处理器直接把完整的响应（状态行、头部、内容）写入连接的写缓冲区，
+   返回DYNAMIC_REQUEST表示响应已就绪；返回其他HTTP_CODE则由process_write生成对应的错误页面 */
+typedef http_conn::HTTP_CODE (*route_handler)(http_conn& conn);
+
+// 路由声明：path为URL路径，prefix为true时匹配以path开头的所有URL
+struct route
+{
+    const char* path;
+    bool prefix;
+    route_handler handler;
+};
+
+// 路由前缀树的结点，采用"左孩子右兄弟"的方式存储，全部放在一个定长数组中
+struct route_node
+{
+    char ch = '\0';       // 该结点对应的字符
+    short child = -1;     // 第一个孩子结点的下标，-1表示没有
+    short sibling = -1;   // 下一个兄弟结点的下标，-1表示没有
+    short route = -1;     // 在该结点结束的路由的下标，-1表示没有
+};
+
+// 计算所有路由路径的字符总数，即前缀树结点数的上界（再加上根结点）
+template <size_t N>
+constexpr size_t route_trie_size(const route (&routes)[N])
+{
+    size_t total = 1;
+    for(size_t i = 0; i < N; ++i)
+        for(const char* p = routes[i].path; *p; ++p)
+            ++total;
+    return total;
+}
+
+/* 编译期构建的路由前缀树。构造函数是constexpr的，所以路由表在编译时就被展开成结点数组，
+   运行时查找只是沿着数组下标走，不分配内存也不做字符串拷贝。重复的路由会导致编译失败 */
+template <size_t N, size_t MaxNodes>
+class route_trie
+{
+public:
+    constexpr route_trie(const route (&routes)[N]) : m_routes(routes), m_nodes(), m_count(1)
+    {
+        for(size_t i = 0; i < N; ++i)
+        {
+            short cur = 0;
+            for(const char* p = routes[i].path; *p; ++p)
+                cur = insert(cur, *p);
+            if(m_nodes[cur].route != -1)
+                throw "duplicate route";     // 常量求值中抛出异常即为编译错误
+            m_nodes[cur].route = (short)i;
+        }
+    }
+
+    /* 查找url对应的路由，url中'?'之后的查询参数不参与匹配。
+       精确匹配优先，否则返回最长的前缀路由，都没有则返回NULL */
+    const route* find(const char* url) const
+    {
+        const route* matched = NULL;
+        short cur = 0;
+        for(const char* p = url; *p && *p != '?'; ++p)
+        {
+            short next = m_nodes[cur].child;
+            while(next != -1 && m_nodes[next].ch != *p)
+                next = m_nodes[next].sibling;
+            if(next == -1)
+                return matched;
+            cur = next;
+            if(m_nodes[cur].route != -1 && m_routes[m_nodes[cur].route].prefix)
+                matched = &m_routes[m_nodes[cur].route];
+        }
+        if(m_nodes[cur].route != -1)
+            return &m_routes[m_nodes[cur].route];
+        return matched;
+    }
+
+private:
+    // 在parent的孩子中查找字符为ch的结点，没有则新建一个
+    constexpr short insert(short parent, char ch)
+    {
+        short last = -1;
+        for(short i = m_nodes[parent].child; i != -1; i = m_nodes[i].sibling)
+        {
+            if(m_nodes[i].ch == ch)
+                return i;
+            last = i;
+        }
+        short idx = (short)m_count++;
+        m_nodes[idx] = route_node{ch, -1, -1, -1};
+        if(last == -1)
+            m_nodes[parent].child = idx;
+        else
+            m_nodes[last].sibling = idx;
+        return idx;
+    }
+
+private:
+    const route* m_routes;
+    route_node m_nodes[MaxNodes];
+    size_t m_count;
+};
+
+// 在编译期路由表中查找url对应的处理器，在访问文件系统之前调用
+const route* find_route(const char* url);
+
+#endif // ROUTER_H
@@ -0,0 +1,90 @@
+#include "shaper.h"
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+
+std::atomic<long> bandwidth_shaper::m_shaped(0);
+std::atomic<long> bandwidth_shaper::m_paused(0);
+std::atomic<long> bandwidth_shaper::m_bytes(0);
+shape_rule bandwidth_shaper::m_rules[bandwidth_shaper::MAX_RULES];
+int bandwidth_shaper::m_rule_count = 0;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void shape_state::start(const shape_rule* r)
+{
+    rule = r;
+    if(!r)
+        return;
+    chunk = r->rate / 10 > bandwidth_shaper::MIN_CHUNK ? r->rate / 10 : bandwidth_shaper::MIN_CHUNK;
+    // 至少有一个发送块的令牌：没有突发额度时，响应头和小文件也不必等待
+    tokens = r->burst > chunk ? r->burst : chunk;
+    last_ns = now_ns();
+}
+
+long shape_state::budget()
+{
+    uint64_t now = now_ns();
+    double refilled = tokens + (double)(now - last_ns) * rule->rate / 1e9;
+    // 开头的突发额度不受上限的影响，补充的令牌最多攒到一个发送块
+    double cap = tokens > chunk ? tokens : chunk;
+    tokens = refilled < cap ? refilled : cap;
+    last_ns = now;
+    return tokens > 0 ? (long)tokens : 0;
+}
+
+uint64_t shape_state::wait_ns(long remaining) const
+{
+    double need = remaining < chunk ? remaining : chunk;
+    if(tokens >= need)
+        return 0;
+    return (uint64_t)((need - tokens) * 1e9 / rule->rate) + 1;
+}
+
+bool bandwidth_shaper::add_rule(const char* spec)
+{
+    const char* eq = strchr(spec, '=');
+    if(m_rule_count >= MAX_RULES || !eq || eq == spec || eq - spec >= (int)sizeof(m_rules[0].prefix) || spec[0] != '/')
+        return false;
+    char* end;
+    long rate_kb = strtol(eq + 1, &end, 10);
+    long burst_kb = 0;
+    if(end == eq + 1 || rate_kb <= 0)
+        return false;
+    if(*end == ',')
+    {
+        const char* burst = end + 1;
+        burst_kb = strtol(burst, &end, 10);
+        if(end == burst || burst_kb < 0)
+            return false;
+    }
+    if(*end != '\0')
+        return false;
+    shape_rule& rule = m_rules[m_rule_count++];
+    memcpy(rule.prefix, spec, eq - spec);
+    rule.prefix[eq - spec] = '\0';
+    rule.rate = rate_kb * 1024;
+    rule.burst = burst_kb * 1024;
+    return true;
+}
+
+const shape_rule* bandwidth_shaper::match(const char* url)
+{
+    const shape_rule* matched = NULL;
+    size_t matched_len = 0;
+    for(int i = 0; i < m_rule_count; ++i)
+    {
+        size_t len = strlen(m_rules[i].prefix);
+        if(len > matched_len && strncmp(url, m_rules[i].prefix, len) == 0)
+        {
+            matched = &m_rules[i];
+            matched_len = len;
+        }
+    }
+    return matched;
+}
@@ -0,0 +1,63 @@
+#ifndef SHAPER_H
+#define SHAPER_H
+
+#include <stdint.h>
+#include <atomic>
+
+// 一条限速规则：以prefix开头的URL的响应，每个连接每秒最多发送rate字节，开头的burst字节不限速
+struct shape_rule
+{
+    char prefix[64];
+    long rate;
+    long burst;
+};
+
+/*
+    一个正在限速发送的响应的令牌桶，由连接协程在发送循环中使用，只在连接自己的线程中访问。
+    开头有burst字节（至少一个发送块）的令牌；之后按速率补充，但补充的令牌最多攒到一个发送块（约100毫秒的量），
+    客户端停顿一会儿之后不会再突发一大段
+*/
+struct shape_state
+{
+    const shape_rule* rule = nullptr;   // 没有匹配的规则时为nullptr，不限速
+    double tokens = 0;                  // 现在可以发送的字节数
+    long chunk = 0;                     // 每次发送的大小，也是补充令牌的上限
+    uint64_t last_ns = 0;               // 上次补充令牌的时间
+
+    void start(const shape_rule* r);
+    // 补充令牌后返回现在可以发送的字节数
+    long budget();
+    // 发送了n字节
+    void consume(long n) { tokens -= n; }
+    // 还有remaining字节没有发送时，应该等待多久（纳秒）再发送下一块
+    uint64_t wait_ns(long remaining) const;
+};
+
+/*
+    按连接的带宽限制（limit_rate）：大文件的下载不占满出口带宽，不挤占交互的流量。
+    规则为"prefix=rate_kb[,burst_kb]"，按URL最长前缀匹配，前缀为"/"的规则对所有的响应生效。
+    令牌用完时发送循环不等待EPOLLOUT，也不让线程睡眠，而是用连接的定时器在reactor上挂起，
+    到时由reactor恢复协程，按令牌的数量发送下一块
+*/
+class bandwidth_shaper
+{
+public:
+    static const int MAX_RULES = 16;
+    static const long MIN_CHUNK = 4096;     // 发送块的下限，速率很低时也不会每次只发送几十个字节
+
+    // 解析"prefix=rate_kb[,burst_kb]"形式的配置并加入规则表
+    static bool add_rule(const char* spec);
+    // 最长前缀匹配，没有配置限速或不匹配时返回NULL
+    static const shape_rule* match(const char* url);
+    static bool enabled() { return m_rule_count > 0; }
+
+    static std::atomic<long> m_shaped;      // 限速发送的响应数
+    static std::atomic<long> m_paused;      // 令牌用完、等待定时器的次数
+    static std::atomic<long> m_bytes;       // 限速发送的字节数
+
+private:
+    static shape_rule m_rules[MAX_RULES];
+    static int m_rule_count;
+};
+
+#endif // SHAPER_H
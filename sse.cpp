@@ -0,0 +1,243 @@
+#include "sse.h"
+#include "http_conn.h"
+#include <sys/eventfd.h>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+
+int sse_hub::m_backlog = 64;
+std::atomic<long> sse_hub::m_subscribers(0);
+std::atomic<long> sse_hub::m_published(0);
+std::atomic<long> sse_hub::m_delivered(0);
+std::atomic<long> sse_hub::m_dropped(0);
+
+// 频道在一个reactor上的订阅者，只被这个reactor线程访问
+struct subscriber_list
+{
+    std::vector<http_conn*> conns;  // 取消订阅的项为NULL，连接的m_sse_slot是它在这里的下标
+    int holes = 0;                  // NULL项的个数
+};
+
+struct sse_channel
+{
+    std::string name;
+    std::atomic<int> subscribers{0};    // 所有reactor上的订阅者总数，发布时据此跳过没有订阅者的频道
+    std::vector<subscriber_list> lists; // 每个reactor一个
+};
+
+// 每个reactor一个收件箱，发布者把(频道, 事件)放进来后写eventfd唤醒reactor
+struct reactor_inbox
+{
+    int epollfd = -1;
+    int eventfd = -1;
+    std::mutex mutex;
+    std::vector<std::pair<sse_channel*, sse_event>> pending;
+};
+
+static std::mutex channels_mutex;      // 保护channels，只在订阅和发布时查找频道用
+static std::unordered_map<std::string, sse_channel*> channels;
+static std::vector<reactor_inbox>* inboxes = NULL;
+
+static bool valid_channel_name(const char* name, int len)
+{
+    if(len <= 0 || len > sse_hub::MAX_CHANNEL_NAME)
+        return false;
+    for(int i = 0; i < len; ++i)
+    {
+        char c = name[i];
+        if(!(isalnum((unsigned char)c) || c == '-' || c == '_' || c == '.'))
+            return false;
+    }
+    return true;
+}
+
+// 连接所属的reactor的序号
+static int reactor_index(int epollfd)
+{
+    for(size_t i = 0; i < inboxes->size(); ++i)
+        if((*inboxes)[i].epollfd == epollfd)
+            return (int)i;
+    return 0;
+}
+
+void sse_hub::init(int reactors, int backlog)
+{
+    m_backlog = backlog > 0 ? backlog : 1;
+    inboxes = new std::vector<reactor_inbox>(reactors);
+}
+
+int sse_hub::register_reactor(int index, int epollfd)
+{
+    reactor_inbox& inbox = (*inboxes)[index];
+    inbox.epollfd = epollfd;
+    inbox.eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return inbox.eventfd;
+}
+
+sse_channel* sse_hub::open_channel(const char* name, int len)
+{
+    if(!valid_channel_name(name, len))
+        return NULL;
+    std::string key(name, len);
+    std::lock_guard<std::mutex> guard(channels_mutex);
+    auto it = channels.find(key);
+    if(it != channels.end())
+        return it->second;
+    if((int)channels.size() >= MAX_CHANNELS)
+        return NULL;
+    sse_channel* channel = new sse_channel;
+    channel->name = key;
+    channel->lists.resize(inboxes->size());
+    channels.emplace(key, channel);
+    return channel;
+}
+
+/* 取消订阅留下的空项超过一半时压缩列表，同时更新连接记录的下标。
+   分发和end_streams按下标遍历列表，其间被恢复的连接会取消订阅，所以unsubscribe只置空、不压缩 */
+void sse_hub::compact(subscriber_list& list)
+{
+    if(list.holes <= 16 || list.holes * 2 <= (int)list.conns.size())
+        return;
+    size_t live = 0;
+    for(http_conn* conn : list.conns)
+        if(conn)
+        {
+            conn->m_sse_slot = (int)live;
+            list.conns[live++] = conn;
+        }
+    list.conns.resize(live);
+    list.holes = 0;
+}
+
+void sse_hub::subscribe(sse_channel* channel, http_conn* conn, int epollfd)
+{
+    subscriber_list& list = channel->lists[reactor_index(epollfd)];
+    // 没有事件的频道不会分发，订阅时也要压缩，否则反复订阅、断开的连接会让列表无限增长
+    compact(list);
+    conn->m_sse_slot = (int)list.conns.size();
+    list.conns.push_back(conn);
+    channel->subscribers.fetch_add(1, std::memory_order_relaxed);
+    m_subscribers.fetch_add(1, std::memory_order_relaxed);
+}
+
+void sse_hub::unsubscribe(sse_channel* channel, http_conn* conn, int epollfd)
+{
+    subscriber_list& list = channel->lists[reactor_index(epollfd)];
+    list.conns[conn->m_sse_slot] = NULL;
+    ++list.holes;
+    channel->subscribers.fetch_sub(1, std::memory_order_relaxed);
+    m_subscribers.fetch_sub(1, std::memory_order_relaxed);
+}
+
+/* data中的每一行都要加上"data: "前缀（浏览器把多个data行用换行连起来），空行结束一个事件；
+   事件名和数据中的"\r"会被当作行尾，这里把它们都当作换行处理 */
+static sse_event format_event(const char* event, const char* data, int len)
+{
+    std::string* buf = new std::string;
+    buf->reserve(len + 32);
+    if(event && *event)
+    {
+        buf->append("event: ");
+        for(const char* p = event; *p; ++p)
+            if(*p != '\r' && *p != '\n')
+                buf->push_back(*p);
+        buf->push_back('\n');
+    }
+    int start = 0;
+    for(int i = 0; i <= len; ++i)
+    {
+        if(i < len && data[i] != '\n' && data[i] != '\r')
+            continue;
+        buf->append("data: ");
+        buf->append(data + start, i - start);
+        buf->push_back('\n');
+        if(i + 1 < len && data[i] == '\r' && data[i + 1] == '\n')
+            ++i;
+        start = i + 1;
+    }
+    buf->push_back('\n');
+    return sse_event(buf);
+}
+
+int sse_hub::publish(const char* name, const char* event, const char* data, int len)
+{
+    sse_channel* channel;
+    {
+        std::lock_guard<std::mutex> guard(channels_mutex);
+        auto it = channels.find(name);
+        if(it == channels.end())
+            return 0;
+        channel = it->second;
+    }
+    int subscribers = channel->subscribers.load(std::memory_order_relaxed);
+    if(subscribers == 0)
+        return 0;
+    sse_event ev = format_event(event, data, len);
+    m_published.fetch_add(1, std::memory_order_relaxed);
+    // 收件箱原本为空时才需要唤醒reactor，否则reactor还没有处理上一次的唤醒，会一并取走
+    for(reactor_inbox& inbox : *inboxes)
+    {
+        bool wake;
+        {
+            std::lock_guard<std::mutex> guard(inbox.mutex);
+            wake = inbox.pending.empty();
+            inbox.pending.emplace_back(channel, ev);
+        }
+        if(wake)
+        {
+            uint64_t one = 1;
+            ssize_t ret = write(inbox.eventfd, &one, sizeof(one));
+            (void)ret;
+        }
+    }
+    return subscribers;
+}
+
+void sse_hub::end_streams(int index)
+{
+    std::vector<sse_channel*> all;
+    {
+        std::lock_guard<std::mutex> guard(channels_mutex);
+        for(auto& item : channels)
+            all.push_back(item.second);
+    }
+    for(sse_channel* channel : all)
+    {
+        // 与分发相同，被恢复的连接关闭时只把自己的项置空，可以按下标遍历
+        subscriber_list& list = channel->lists[index];
+        for(size_t i = 0; i < list.conns.size(); ++i)
+            if(list.conns[i])
+                list.conns[i]->sse_end();
+    }
+}
+
+void sse_hub::on_wakeup(int index)
+{
+    reactor_inbox& inbox = (*inboxes)[index];
+    uint64_t count;
+    ssize_t ret = read(inbox.eventfd, &count, sizeof(count));
+    (void)ret;
+    std::vector<std::pair<sse_channel*, sse_event>> batch;
+    {
+        std::lock_guard<std::mutex> guard(inbox.mutex);
+        batch.swap(inbox.pending);
+    }
+    for(auto& item : batch)
+    {
+        subscriber_list& list = item.first->lists[index];
+        /* 分发过程中连接协程被恢复，可能因为积压过多或写出错而取消订阅（把自己的项置空），
+           但不会在列表末尾追加（订阅只发生在连接协程被socket事件恢复时），所以可以按下标遍历 */
+        size_t n = list.conns.size();
+        long delivered = 0;
+        for(size_t i = 0; i < n; ++i)
+        {
+            http_conn* conn = list.conns[i];
+            if(!conn)
+                continue;
+            conn->sse_deliver(item.second);
+            ++delivered;
+        }
+        m_delivered.fetch_add(delivered, std::memory_order_relaxed);
+        compact(list);
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef SSE_H
+#define SSE_H
+
+#include <memory>
+#include <string>
+#include <atomic>
+
+class http_conn;
+struct sse_channel;
+struct subscriber_list;
+
+// 格式化好的一个事件（"event: ...\ndata: ...\n\n"），所有订阅者共享同一份，发送完毕后由最后一个持有者释放
+typedef std::shared_ptr<const std::string> sse_event;
+
+/*
+    Server-Sent Events的广播中心。连接通过GET /events/<channel>订阅命名的频道，之后一直保持打开，
+    服务器把发布到频道的事件推送给它。发布时只格式化一次事件，放进一个引用计数的缓冲区，
+    然后把(频道, 事件)放进每个reactor的收件箱并用eventfd唤醒它；reactor线程遍历频道在本reactor上的订阅者，
+    把事件的引用追加到连接的待发送队列并恢复连接协程，由协程用非阻塞写发送。
+    所以一次发布的开销是一次格式化加上每个订阅者一次引用计数和一次写，而不是每个订阅者格式化一次。
+    订阅者列表按reactor分开，只被所属的reactor线程访问，不需要加锁；取消订阅只把列表中的项置空，
+    空项超过一半时在下一次分发后或下一次订阅时压缩。连接的待发送队列有上限，写得慢的连接（队列满）被断开
+*/
+class sse_hub
+{
+public:
+    static const int MAX_CHANNELS = 1024;       // 频道的数量上限，频道由订阅创建，不会被删除
+    static const int MAX_CHANNEL_NAME = 64;     // 频道名的最大长度，只允许字母、数字和"-_."
+
+    // 在启动reactor之前调用：设置reactor的数量和每个连接最多积压的事件数
+    static void init(int reactors, int backlog);
+    // 为第index个reactor创建唤醒用的eventfd并返回，由调用者把它加入这个reactor的epoll
+    static int register_reactor(int index, int epollfd);
+    // reactor的eventfd可读时调用：把收件箱中的事件分发给本reactor上的订阅者
+    static void on_wakeup(int index);
+
+    // 查找频道，不存在时创建；频道名不合法或频道数达到上限时返回NULL
+    static sse_channel* open_channel(const char* name, int len);
+    // 在连接所属的reactor线程中调用，把连接加入频道在该reactor上的订阅者列表
+    static void subscribe(sse_channel* channel, http_conn* conn, int epollfd);
+    // 在连接所属的reactor线程中调用
+    static void unsubscribe(sse_channel* channel, http_conn* conn, int epollfd);
+    // 在第index个reactor线程中调用：结束本reactor上所有的事件流，连接随之关闭（热升级时）
+    static void end_streams(int index);
+    // 可以在任意线程中调用：格式化事件（event为空表示不带事件名）并发布给频道的所有订阅者，返回当前的订阅者数
+    static int publish(const char* channel, const char* event, const char* data, int len);
+
+    static int backlog() { return m_backlog; }
+
+    static std::atomic<long> m_subscribers;     // 当前的订阅连接数
+    static std::atomic<long> m_published;       // 发布的事件数
+    static std::atomic<long> m_delivered;       // 交给订阅连接发送的事件数（每个订阅者计一次）
+    static std::atomic<long> m_dropped;         // 因积压的事件超过上限而断开的慢连接数
+
+private:
+    // 取消订阅留下的空项过多时压缩订阅者列表
+    static void compact(subscriber_list& list);
+
+    static int m_backlog;
+};
+
+#endif // SSE_H
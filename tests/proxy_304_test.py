@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""
+反向代理转发没有消息体的响应（204、304）：不能按304带的Content-Length等待消息体，
+也不能在没有长度时一直读到上游关闭。响应要立即转发，客户连接和上游连接都要保持复用。
+
+用法：python3 tests/proxy_304_test.py <server可执行文件>
+"""
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+# 上游对每个路径的响应：304带着200响应的Content-Length，304没有长度，204
+RESPONSES = {
+    b"/up/etag": b"HTTP/1.1 304 Not Modified\r\nETag: \"v1\"\r\nContent-Length: 5\r\n\r\n",
+    b"/up/bare": b"HTTP/1.1 304 Not Modified\r\nETag: \"v1\"\r\n\r\n",
+    b"/up/empty": b"HTTP/1.1 204 No Content\r\n\r\n",
+    b"/up/ok": b"HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello",
+}
+
+upstream_conns = 0
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def serve_upstream(conn):
+    buf = b""
+    while True:
+        data = conn.recv(4096)
+        if not data:
+            break
+        buf += data
+        while b"\r\n\r\n" in buf:
+            head, buf = buf.split(b"\r\n\r\n", 1)
+            path = head.split(b" ")[1]
+            conn.sendall(RESPONSES[path])
+    conn.close()
+
+
+def run_upstream(listener):
+    global upstream_conns
+    while True:
+        conn, _ = listener.accept()
+        upstream_conns += 1
+        threading.Thread(target=serve_upstream, args=(conn,), daemon=True).start()
+
+
+def read_response(sock):
+    """读一个响应（头部加上Content-Length长度的消息体，304和204除外），超时返回None"""
+    data = b""
+    while b"\r\n\r\n" not in data:
+        chunk = sock.recv(4096)
+        if not chunk:
+            return None
+        data += chunk
+    head, body = data.split(b"\r\n\r\n", 1)
+    status = int(head.split(b" ")[1])
+    length = 0
+    for line in head.split(b"\r\n")[1:]:
+        name, _, value = line.partition(b":")
+        if name.strip().lower() == b"content-length" and status not in (204, 304):
+            length = int(value)
+    while len(body) < length:
+        body += sock.recv(4096)
+    return status, body
+
+
+def main():
+    server = sys.argv[1]
+    upstream = socket.socket()
+    upstream.bind(("127.0.0.1", 0))
+    upstream.listen(16)
+    threading.Thread(target=run_upstream, args=(upstream,), daemon=True).start()
+
+    port = free_port()
+    doc_root = tempfile.mkdtemp()
+    proc = subprocess.Popen([server, "-o", "doc_root=" + doc_root,
+                             "-u", "/up/=127.0.0.1:%d" % upstream.getsockname()[1], str(port)],
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        for _ in range(50):
+            try:
+                client = socket.create_connection(("127.0.0.1", port))
+                break
+            except OSError:
+                time.sleep(0.1)
+        client.settimeout(2)    # 远小于上游的读超时（30秒）
+
+        failures = 0
+        # 同一个客户连接上依次请求，没有消息体的响应之后连接必须还能用
+        for path, want in ((b"/up/etag", 304), (b"/up/bare", 304), (b"/up/empty", 204), (b"/up/ok", 200)):
+            client.sendall(b"GET " + path + b" HTTP/1.1\r\nHost: x\r\nIf-None-Match: \"v1\"\r\n"
+                           b"Connection: keep-alive\r\n\r\n")
+            try:
+                got = read_response(client)
+            except socket.timeout:
+                got = None
+            ok = got is not None and got[0] == want and got[1] == (b"hello" if want == 200 else b"")
+            print("%-12s %s" % (path.decode(), "ok" if ok else "FAILED: %r" % (got,)))
+            failures += not ok
+        # 上游的连接也被复用，整个过程只有一个
+        print("upstream connections: %d" % upstream_conns)
+        failures += upstream_conns != 1
+    finally:
+        proc.terminate()
+        proc.wait()
+        os.rmdir(doc_root)
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -9,104 +9,480 @@
 #include <exception>
 #include <functional>
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <sys/resource.h>
+#include <sched.h>
 
-// 线程池类，将它定义为模板类是为了代码复用，模板参数T是任务类
+/* 线程池类，将它定义为模板类是为了代码复用，模板参数T是任务类。
+   任务按通道（lane）分别排队，避免一类慢任务排在前面时其他任务也跟着等待（队头阻塞）：
+   每个通道可以预留若干只处理该通道任务的工作线程，其余的共享线程在非空的通道之间按权重轮流取任务（平滑加权轮询）。
+   只有一个通道时就是原来的单个FIFO队列。
+   线程数可以在[threadNum, maxThreads]之间伸缩（见setMaxThreads）：控制线程每个CONTROL_INTERVAL检查一次，
+   没有空闲线程，并且任务的排队时间超过GROW_WAIT_TARGET或工作线程阻塞（睡眠等待I/O）的时间比例超过BLOCKED_TARGET_PCT时
+   增加共享线程。进程已经用满了所有CPU时，排队只是因为CPU不够，增加线程只会带来更多的上下文切换，这时只按阻塞比例增加；空闲了IDLE_TIMEOUT的共享线程自行退出，直到回到threadNum。退出的线程由控制线程join，析构时join所有线程 */
 template <typename Task>
 class threadPool 
 {
 public:
-    /* threadNum是线程池中线程的数量，max_requests是请求队列中最多允许的、等待处理的请求的数量 */
-    threadPool(int threadNum = 8, int max_requests = 10000);
+    // 一个通道的调度参数
+    struct laneConfig
+    {
+        int weight;     // 共享线程取任务时的权重，必须大于0
+        int reserved;   // 预留给这个通道的工作线程数，它们只处理这个通道的任务
+    };
+    static const int WAIT_BUCKETS = 32;     // 排队时间的直方图按2的幂分桶（微秒）
+    static const int BLOCKED_TARGET_PCT = 50;   // 工作线程阻塞的时间比例超过它时增加线程
+    static const int CPU_SATURATED_PCT = 90;    // 进程的CPU使用率超过它时不因排队而增加线程
+    // 伸缩的状态和决策的累计次数
+    struct scalingStats
+    {
+        int threads;        // 当前的工作线程数
+        int idle;           // 其中空闲的共享线程数
+        long grown;         // 累计增加的线程数
+        long shrunk;        // 累计因空闲而退出的线程数
+        int blocked_pct;    // 上一个控制周期中工作线程阻塞的时间比例
+        int cpu_pct;        // 上一个控制周期中进程的CPU使用率（相对于所有可用的CPU）
+        long wait_us;       // 上一个控制周期中的排队时间（平均值与最老任务的等待时间中较大的）
+    };
+
+    /* threadNum是线程池中线程的数量，max_requests是请求队列中最多允许的、等待处理的请求的数量（所有通道合计，
+       按权重分给各通道，每个通道只受自己的份额限制，一个通道排满不会让其他通道的请求被拒绝），
+       threadInit在每个工作线程开始处理任务之前以线程的序号为参数调用一次（如绑定CPU），可以为空；
+       lanes为各通道的调度参数，预留的线程总数不能超过threadNum */
+    threadPool(int threadNum = 8, int max_requests = 10000, std::function<void(int)> threadInit = nullptr,
+               std::vector<laneConfig> lanes = {{1, 0}});
     ~threadPool();
-    bool addTask(Task* task);
+    // 允许线程数增加到maxThreads（不超过threadNum时不伸缩），启动控制线程；在构造之后、添加任务之前调用
+    void setMaxThreads(int maxThreads);
+    bool addTask(Task* task, int lane = 0);
+    /* 通道是否过载：参考CoDel，任务在队列中的等待时间持续一个观察周期（OVERLOAD_INTERVAL）都高于
+       目标值（OVERLOAD_TARGET）时认为过载；通道的队列已满（addTask会失败）时同样认为过载。
+       此时调用者应该直接拒绝新的请求而不是继续排队。不加锁，可以在主线程中每个请求调用一次 */
+    bool overloaded(int lane = 0) const
+    {
+        const struct lane& l = m_lanes[lane];
+        size_t size = l.size.load(std::memory_order_relaxed);
+        return (l.overloaded.load(std::memory_order_relaxed) && size > 0) || size >= l.limit;
+    }
+    // 通道的队列是否已满（已经排了它的份额那么多的任务）
+    bool queueFull(int lane = 0) const { return m_lanes[lane].size.load(std::memory_order_relaxed) >= m_lanes[lane].limit; }
+    int laneCount() const { return (int)m_lanes.size(); }
+    // 通道的排队统计：已取出的任务数，平均排队时间和p99排队时间（微秒，直方图桶的上界）
+    void laneStats(int lane, long* tasks, long* avg_us, long* p99_us);
+    void scaling(scalingStats* stats);
 private:
-    void threadFunc();  // 工作线程运行的函数，它不断从工作队列中取出任务并执行之
+    struct worker
+    {
+        std::thread thread;
+        bool done = false;      // 线程已经退出（空闲过久），等待控制线程join
+    };
+    void spawn(int own);         // 创建一个工作线程，own为预留的通道，-1表示共享线程；调用者持有m_mutex
+    void threadFunc(worker* self, int index, int own);  // 工作线程运行的函数，它不断从工作队列中取出任务并执行之
+    void controlFunc();          // 控制线程：定期决定是否增加线程，并join已经退出的线程
+    int pickLane(int own);       // 选择下一个取任务的通道，没有可取的任务返回-1，调用者持有m_mutex
+    void updateOverload(int lane, std::chrono::steady_clock::time_point enqueue_time);
+public:
+    static constexpr std::chrono::microseconds OVERLOAD_TARGET{5000};        // 可以接受的排队时间
+    static constexpr std::chrono::microseconds OVERLOAD_INTERVAL{100000};    // 观察周期
+    static constexpr std::chrono::microseconds GROW_WAIT_TARGET{1000};       // 排队时间超过它时增加线程，低于OVERLOAD_TARGET
+    static constexpr std::chrono::milliseconds CONTROL_INTERVAL{100};        // 伸缩的控制周期
+    static constexpr std::chrono::milliseconds IDLE_TIMEOUT{5000};           // 共享线程空闲这么久后退出（冷却时间）
 private:
-    int m_threadNum;  // 工作线程的数量
-    std::vector<std::shared_ptr<std::thread>> m_threads;  // 描述线程池的数组，大小为m_threadNum 
-    int m_max_requests;     // 任务队列中最多允许的、等待处理的请求的数量
+    struct queuedTask
+    {
+        Task* task;
+        std::chrono::steady_clock::time_point enqueue_time;  // 入队时间，用于计算排队时间
+    };
+    // 一个通道：任务队列、调度状态和统计，除了标明的原子变量之外都受m_mutex保护
+    struct lane
+    {
+        laneConfig config;
+        size_t limit = 0;           // 队列长度的上限：max_requests按权重分给这个通道的份额，至少为1
+        std::list<queuedTask> tasks;
+        int current = 0;            // 平滑加权轮询的当前值
+        int idle_reserved = 0;      // 正在等待的预留线程数
+        std::condition_variable cv; // 预留线程在这里等待
+        std::atomic<size_t> size{0};        // 队列长度，供overloaded()无锁读取
+        std::atomic<bool> overloaded{false};
+        std::chrono::steady_clock::time_point first_above_time;   // 排队时间持续高于目标值的截止时间
+        long popped = 0;
+        long long wait_total_us = 0;
+        long wait_hist[WAIT_BUCKETS] = {};
+    };
+
+    int m_threadNum;  // 工作线程数的下限（构造时创建的数量）
+    int m_maxThreads; // 工作线程数的上限
+    int m_live;       // 当前的工作线程数
+    int m_idle;       // 正在等待任务的共享线程数
+    int m_nextIndex;  // 下一个工作线程的序号，传给m_threadInit
+    std::list<worker> m_workers;    // 所有工作线程，包括已经退出、等待join的
+    std::thread m_controller;       // 控制线程，不伸缩时没有
+    std::condition_variable m_controlCv;    // 析构时唤醒控制线程
+    long m_grown;
+    long m_shrunk;
+    int m_blockedPct;
+    int m_cpuPct;
+    long m_waitUs;
+    long long m_intervalWaitUs;     // 本控制周期内取出的任务的排队时间之和
+    long m_intervalPopped;          // 本控制周期内取出的任务数
+    std::atomic<long long> m_blockedNs{0};  // 本控制周期内工作线程执行任务时阻塞的时间之和
+    int m_max_requests;     // 任务队列中最多允许的、等待处理的请求的数量（所有通道合计）
+    std::function<void(int)> m_threadInit;  // 工作线程的初始化函数
     /*     这里任务队列不宜用 std::list<std::shared_ptr<Task>> m_taskList; 因为main函数中的Task类也就是
        http_conn类，是在进行逻辑处理之前分配好的，只有当main函数即将结束时再统一释放，而不是动态分配的，且对应
        文件描述符可能会被复用，即同一对象会被重复使用，因为对象执行完process方法后还会再write，即使响应结束下一次
        请求可能还是用这个对象。
            如果用shared_ptr管理内存，当某一Task执行完毕而被m_taskList.pop_back()后，这个Task对象会被释放，如果这个
        对象再次被用到时，会出错而崩溃。如果main函数中的对象也由shared_ptr接管则可以用shared_ptr */
-    std::list<Task*> m_taskList;  // 任务队列
+    std::vector<lane> m_lanes;          // 各通道的任务队列，创建后数量不变
+    size_t m_total_size;                // 所有通道的任务数
     std::mutex m_mutex;    // 保护任务队列和条件变量的互斥锁 
-    std::condition_variable m_cv;   // 是否有任务需要处理   
+    std::condition_variable m_cv;   // 共享线程在这里等待
     bool m_stop;    // 是否结束线程                  
 };
 
 template <typename Task>
-threadPool<Task>::threadPool(int threadNum, int max_requests) : 
-        m_threadNum(threadNum), m_max_requests(max_requests), m_stop(false) 
+threadPool<Task>::threadPool(int threadNum, int max_requests, std::function<void(int)> threadInit, std::vector<laneConfig> lanes) : 
+        m_threadNum(threadNum), m_maxThreads(threadNum), m_live(0), m_idle(0), m_nextIndex(0), m_grown(0), m_shrunk(0),
+        m_blockedPct(0), m_cpuPct(0), m_waitUs(0), m_intervalWaitUs(0), m_intervalPopped(0),
+        m_max_requests(max_requests), m_threadInit(threadInit), m_lanes(lanes.size()), m_total_size(0), m_stop(false)
 {
-    if((threadNum <= 0) || (max_requests <= 0) ) 
+    if((threadNum <= 0) || (max_requests <= 0) || lanes.empty()) 
         throw std::exception();
 
-    // 创建thread_number 个线程放到m_threads队列中，并将他们设置为脱离线程。
+    // 前面的线程依次预留给各个通道，其余为共享线程
+    std::vector<int> workerLane;
+    long long totalWeight = 0;
+    for(const laneConfig& config : lanes)
+        totalWeight += config.weight > 0 ? config.weight : 0;
+    for(size_t i = 0; i < lanes.size(); ++i)
+    {
+        if(lanes[i].weight <= 0 || lanes[i].reserved < 0)
+            throw std::exception();
+        m_lanes[i].config = lanes[i];
+        long long limit = (long long)max_requests * lanes[i].weight / totalWeight;
+        m_lanes[i].limit = limit > 0 ? (size_t)limit : 1;
+        for(int j = 0; j < lanes[i].reserved; ++j)
+            workerLane.push_back(i);
+    }
+    if((int)workerLane.size() > threadNum)
+        throw std::exception();
+    workerLane.resize(threadNum, -1);
+
+    // 创建threadNum个线程放到m_workers中，析构时join
+    std::lock_guard<std::mutex> guard(m_mutex);
     for(int i = 0; i < threadNum; ++i)
     {
         std::cout << "create the " << i << "th thread" << std::endl;
-        std::shared_ptr<std::thread> spThread;
-        spThread.reset(new std::thread(std::bind(&threadPool::threadFunc, this)));
-        if(!spThread)
-            throw std::exception();
-        m_threads.push_back(spThread);
-        spThread->detach();
+        spawn(workerLane[i]);
     }
 }
 
 template <typename Task>
 threadPool<Task>::~threadPool() 
 {
-    m_stop = true;
     {
-        std::unique_lock<std::mutex> guard(m_mutex);
-        for(auto& iter : m_threads)
-            iter.reset();
-        m_threads.clear();
-        m_taskList.clear();
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_stop = true;
+        for(auto& l : m_lanes)
+            l.tasks.clear();
     }
+    // 唤醒所有等待的线程，正在执行任务的线程执行完当前的任务后退出
+    m_cv.notify_all();
+    for(auto& l : m_lanes)
+        l.cv.notify_all();
+    m_controlCv.notify_all();
+    if(m_controller.joinable())
+        m_controller.join();
+    for(auto& w : m_workers)
+        w.thread.join();
+}
+
+template <typename Task>
+void threadPool<Task>::setMaxThreads(int maxThreads)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if(maxThreads <= m_threadNum || m_controller.joinable())
+        return;
+    m_maxThreads = maxThreads;
+    m_controller = std::thread(&threadPool::controlFunc, this);
+}
+
+template <typename Task>
+void threadPool<Task>::spawn(int own)
+{
+    m_workers.emplace_back();
+    worker& w = m_workers.back();
+    w.thread = std::thread(&threadPool::threadFunc, this, &w, m_nextIndex++, own);
+    ++m_live;
 }
 
 template <typename Task>
-bool threadPool<Task>::addTask(Task* task)
+bool threadPool<Task>::addTask(Task* task, int laneIndex)
 {
+    lane& l = m_lanes[laneIndex];
+    bool wakeReserved;
     // 操作工作队列时一定要加锁，因为它被所有线程共享。
     {
         std::lock_guard<std::mutex> guard(m_mutex);   
-        if (m_taskList.size() > m_max_requests) 
+        if (l.tasks.size() >= l.limit)     // 只看这个通道自己的份额，其他通道的积压不影响它
             return false;
-        m_taskList.push_back(task);
+        l.tasks.push_back(queuedTask{task, std::chrono::steady_clock::now()});
+        l.size.store(l.tasks.size(), std::memory_order_relaxed);
+        ++m_total_size;
+        // 空闲的预留线程足够处理这个通道中所有排队的任务时唤醒预留线程，否则唤醒一个共享线程
+        wakeReserved = l.idle_reserved >= (int)l.tasks.size();
     }
-    m_cv.notify_one();
+    if(wakeReserved)
+        l.cv.notify_one();
+    else
+        m_cv.notify_one();
     return true;
 }
 
 template <typename Task>
-void threadPool<Task>::threadFunc()
+int threadPool<Task>::pickLane(int own)
 {
+    if(own >= 0)
+        return m_lanes[own].tasks.empty() ? -1 : own;
+    // 平滑加权轮询：每个非空通道的当前值加上权重，选出当前值最大的通道，它的当前值再减去权重之和
+    int best = -1, total = 0;
+    for(size_t i = 0; i < m_lanes.size(); ++i)
+    {
+        lane& l = m_lanes[i];
+        if(l.tasks.empty())
+            continue;
+        l.current += l.config.weight;
+        total += l.config.weight;
+        if(best < 0 || l.current > m_lanes[best].current)
+            best = i;
+    }
+    if(best >= 0)
+        m_lanes[best].current -= total;
+    return best;
+}
+
+// 线程自己用掉的CPU时间（纳秒）和主动让出CPU（睡眠等待）的次数
+static inline void thread_usage(long long* cpu_ns, long* voluntary_switches)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_THREAD, &ru);
+    *cpu_ns = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000LL;
+    *voluntary_switches = ru.ru_nvcsw;
+}
+
+template <typename Task>
+void threadPool<Task>::threadFunc(worker* self, int index, int own)
+{
+    if(m_threadInit)
+        m_threadInit(index);
     Task* task = nullptr;
+    bool measure = false;   // 是否统计阻塞时间，只有伸缩时需要
     while(1) 
     {
         {
             std::unique_lock<std::mutex> guard(m_mutex);
-            while(m_taskList.empty()) 
+            int laneIndex;
+            bool retire = false;
+            while((laneIndex = pickLane(own)) < 0) 
             {
                 if(m_stop)
                     break;
-                m_cv.wait(guard);
+                if(own >= 0)
+                {
+                    ++m_lanes[own].idle_reserved;
+                    m_lanes[own].cv.wait(guard);
+                    --m_lanes[own].idle_reserved;
+                }
+                else
+                {
+                    // 空闲超过IDLE_TIMEOUT的共享线程在线程数多于下限时退出
+                    ++m_idle;
+                    bool timeout = m_cv.wait_for(guard, IDLE_TIMEOUT) == std::cv_status::timeout;
+                    --m_idle;
+                    if(timeout && m_live > m_threadNum && m_total_size == 0 && !m_stop)
+                    {
+                        retire = true;
+                        break;
+                    }
+                }
+            }
+            if(retire)
+            {
+                --m_live;
+                ++m_shrunk;
+                self->done = true;
+                return;
             }
             if(m_stop)
                 break;
-            task = m_taskList.front();
-            m_taskList.pop_front();
+            lane& l = m_lanes[laneIndex];
+            task = l.tasks.front().task;
+            updateOverload(laneIndex, l.tasks.front().enqueue_time);
+            l.tasks.pop_front();
+            l.size.store(l.tasks.size(), std::memory_order_relaxed);
+            --m_total_size;
+            measure = m_maxThreads > m_threadNum;
         }
         if(!task) 
             continue;
+        if(!measure)
+        {
+            task->process();
+            continue;
+        }
+        /* 执行任务的墙钟时间减去CPU时间，是线程睡眠（等待磁盘、锁）或者被抢占的时间；
+           只有任务中发生了主动切换（睡眠）时才计为阻塞，CPU不够用时被抢占不应该导致增加线程 */
+        long long cpu0, cpu1;
+        long nvcsw0, nvcsw1;
+        thread_usage(&cpu0, &nvcsw0);
+        auto start = std::chrono::steady_clock::now();
         task->process();
+        long long wall = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        thread_usage(&cpu1, &nvcsw1);
+        if(nvcsw1 != nvcsw0 && wall > cpu1 - cpu0)
+            m_blockedNs.fetch_add(wall - (cpu1 - cpu0), std::memory_order_relaxed);
     }
 }
 
+template <typename Task>
+void threadPool<Task>::controlFunc()
+{
+    cpu_set_t set;
+    int cpus = sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set) : 1;
+    auto process_cpu_ns = [] {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000LL;
+    };
+    std::unique_lock<std::mutex> guard(m_mutex);
+    auto last = std::chrono::steady_clock::now();
+    long long last_cpu = process_cpu_ns();
+    while(!m_stop)
+    {
+        m_controlCv.wait_for(guard, CONTROL_INTERVAL);
+        if(m_stop)
+            break;
+        auto now = std::chrono::steady_clock::now();
+        long long interval_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count();
+        last = now;
+
+        // 排队时间取本周期的平均值和队列中最老的任务已经等待的时间中较大的：所有线程都阻塞时没有任务被取出
+        long long wait_us = m_intervalPopped ? m_intervalWaitUs / m_intervalPopped : 0;
+        for(auto& l : m_lanes)
+        {
+            if(l.tasks.empty())
+                continue;
+            long long oldest = std::chrono::duration_cast<std::chrono::microseconds>(now - l.tasks.front().enqueue_time).count();
+            if(oldest > wait_us)
+                wait_us = oldest;
+        }
+        m_intervalWaitUs = 0;
+        m_intervalPopped = 0;
+        long long blocked = m_blockedNs.exchange(0, std::memory_order_relaxed);
+        m_blockedPct = interval_ns > 0 ? (int)(blocked * 100 / (interval_ns * m_live)) : 0;
+        m_waitUs = (long)wait_us;
+        long long cpu = process_cpu_ns();
+        m_cpuPct = interval_ns > 0 ? (int)((cpu - last_cpu) * 100 / (interval_ns * cpus)) : 0;
+        last_cpu = cpu;
+
+        int grow = 0;
+        if(m_idle == 0 && m_live < m_maxThreads
+            && ((wait_us > GROW_WAIT_TARGET.count() && m_cpuPct < CPU_SATURATED_PCT) || m_blockedPct > BLOCKED_TARGET_PCT))
+        {
+            grow = m_live / 4 > 1 ? m_live / 4 : 1;
+            if(grow > m_maxThreads - m_live)
+                grow = m_maxThreads - m_live;
+            for(int i = 0; i < grow; ++i)
+                spawn(-1);
+            m_grown += grow;
+        }
+
+        // join已经退出的线程，不持有锁
+        std::vector<std::thread> finished;
+        for(auto it = m_workers.begin(); it != m_workers.end(); )
+        {
+            if(it->done)
+            {
+                finished.push_back(std::move(it->thread));
+                it = m_workers.erase(it);
+            }
+            else
+                ++it;
+        }
+        int live = m_live;
+        int blockedPct = m_blockedPct;
+        int cpuPct = m_cpuPct;
+        guard.unlock();
+        if(grow)
+            std::cout << "threadpool: grow by " << grow << " to " << live << " threads (queue wait " << wait_us
+                      << "us, blocked " << blockedPct << "%, cpu " << cpuPct << "%)" << std::endl;
+        for(auto& t : finished)
+            t.join();
+        guard.lock();
+    }
+}
+
+// 每取出一个任务调用一次（持有m_mutex），根据它的排队时间更新通道的过载状态和统计
+template <typename Task>
+void threadPool<Task>::updateOverload(int laneIndex, std::chrono::steady_clock::time_point enqueue_time)
+{
+    lane& l = m_lanes[laneIndex];
+    auto now = std::chrono::steady_clock::now();
+    long long wait_us = std::chrono::duration_cast<std::chrono::microseconds>(now - enqueue_time).count();
+    int bucket = 0;
+    while(bucket < WAIT_BUCKETS - 1 && (wait_us >> bucket) > 0)
+        ++bucket;
+    ++l.wait_hist[bucket];
+    l.wait_total_us += wait_us;
+    ++l.popped;
+    m_intervalWaitUs += wait_us;
+    ++m_intervalPopped;
+
+    if(now - enqueue_time < OVERLOAD_TARGET)
+    {
+        // 只要有一个任务的排队时间低于目标值，说明队列能够及时排空，退出过载状态
+        l.first_above_time = std::chrono::steady_clock::time_point();
+        l.overloaded.store(false, std::memory_order_relaxed);
+    }
+    else if(l.first_above_time == std::chrono::steady_clock::time_point())
+        l.first_above_time = now + OVERLOAD_INTERVAL;
+    else if(now >= l.first_above_time)
+        l.overloaded.store(true, std::memory_order_relaxed);
+}
+
+template <typename Task>
+void threadPool<Task>::laneStats(int laneIndex, long* tasks, long* avg_us, long* p99_us)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    const lane& l = m_lanes[laneIndex];
+    *tasks = l.popped;
+    *avg_us = l.popped ? l.wait_total_us / l.popped : 0;
+    *p99_us = 0;
+    long seen = 0;
+    for(int i = 0; i < WAIT_BUCKETS && l.popped; ++i)
+    {
+        seen += l.wait_hist[i];
+        if(seen * 100 >= l.popped * 99)
+        {
+            *p99_us = i == 0 ? 0 : (1L << i) - 1;   // 第i个桶为[2^(i-1), 2^i)微秒
+            break;
+        }
+    }
+}
+
+template <typename Task>
+void threadPool<Task>::scaling(scalingStats* stats)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    stats->threads = m_live;
+    stats->idle = m_idle;
+    stats->grown = m_grown;
+    stats->shrunk = m_shrunk;
+    stats->blocked_pct = m_blockedPct;
+    stats->cpu_pct = m_cpuPct;
+    stats->wait_us = m_waitUs;
+}
+
 #endif // THREADPOOL_H
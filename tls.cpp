@@ -0,0 +1,62 @@
+#include "tls.h"
+#include <openssl/err.h>
+#include <stdio.h>
+
+static SSL_CTX* ctx = NULL;
+
+bool tls_context::init(const char* cert_file, const char* key_file)
+{
+    ctx = SSL_CTX_new(TLS_server_method());
+    if(!ctx)
+        return false;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    /* SSL_OP_ENABLE_KTLS：握手后由OpenSSL设置TCP_ULP并把密钥交给内核，内核不支持时忽略。
+       禁止重协商，这样写数据时不会要求先读（SSL_ERROR_WANT_READ） */
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    // 非阻塞写可能只写出一部分，重试时缓冲区的地址会随着已发送的字节数变化
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    // 会话恢复：TLS 1.2的会话ID缓存在服务端，会话票据（包括TLS 1.3）由客户端保存
+    static const unsigned char sid_ctx[] = "webserver";
+    SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, SESSION_TIMEOUT);
+
+    if(SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1
+        || SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx) != 1)
+    {
+        ERR_print_errors_fp(stdout);
+        SSL_CTX_free(ctx);
+        ctx = NULL;
+        return false;
+    }
+    return true;
+}
+
+SSL* tls_context::new_session(int sockfd)
+{
+    if(!ctx)
+        return NULL;
+    SSL* ssl = SSL_new(ctx);
+    if(!ssl)
+        return NULL;
+    if(SSL_set_fd(ssl, sockfd) != 1)
+    {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+bool tls_context::ktls_send(SSL* ssl)
+{
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+}
+
+bool tls_context::ktls_recv(SSL* ssl)
+{
+    return BIO_get_ktls_recv(SSL_get_rbio(ssl));
+}
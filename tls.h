@@ -0,0 +1,27 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <openssl/ssl.h>
+
+/*
+    HTTPS监听端口使用的TLS上下文。握手由OpenSSL在用户态完成，握手之后如果内核支持kTLS（TCP_ULP "tls"），
+    OpenSSL把对称密钥交给内核，此后socket上的明文直接由内核加密发送，响应仍可以用sendmsg把mmap的文件
+    内容交给内核，不在用户态做一次加密拷贝；内核不支持时自动退化为用户态的SSL_read/SSL_write。
+    服务端会话缓存和会话票据（session ticket）都是打开的，客户端重连时可以恢复会话，省去完整握手
+*/
+class tls_context
+{
+public:
+    static const long SESSION_CACHE_SIZE = 20480;   // 服务端会话缓存的最大会话数
+    static const long SESSION_TIMEOUT = 300;        // 会话的有效期（秒）
+
+    // 加载证书和私钥，创建全局的SSL_CTX，失败返回false
+    static bool init(const char* cert_file, const char* key_file);
+    // 为新接受的连接创建SSL对象，失败返回NULL
+    static SSL* new_session(int sockfd);
+    // 握手完成后，发送方向是否已经交给了内核（kTLS）
+    static bool ktls_send(SSL* ssl);
+    static bool ktls_recv(SSL* ssl);
+};
+
+#endif // TLS_H
@@ -0,0 +1,195 @@
+#include "trace.h"
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <string.h>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <chrono>
+
+// 一条请求记录
+struct trace_record
+{
+    request_trace trace;
+    int status;
+    char url[tracer::URL_LEN];
+};
+
+// 一个线程的环形缓冲区，由该线程写入、后台线程读出
+struct trace_ring
+{
+    trace_record records[tracer::RING_SIZE];
+    std::atomic<unsigned> head{0};  // 下一个写入的位置，只由生产者修改
+    std::atomic<unsigned> tail{0};  // 下一个读出的位置，只由后台线程修改
+};
+
+bool tracer::m_enabled = false;
+std::atomic<long> tracer::m_sampled(0);
+std::atomic<long> tracer::m_slow(0);
+std::atomic<long> tracer::m_dropped(0);
+
+static FILE* trace_file = NULL;
+static uint64_t slow_ns = 0;
+static int sample_every = 1;
+static uint64_t epoch = 0;                  // 追踪开始的时间，文件中的时间戳相对于它
+static std::mutex rings_mutex;
+static std::vector<trace_ring*> rings;      // 所有线程的环形缓冲区，线程退出后也不释放
+static thread_local trace_ring* my_ring = NULL;
+static thread_local unsigned sample_counter = 0;
+static thread_local int my_tid = 0;
+
+static int thread_id()
+{
+    if(!my_tid)
+        my_tid = syscall(SYS_gettid);
+    return my_tid;
+}
+
+uint64_t tracer::now()
+{
+    // CLOCK_MONOTONIC经由vDSO读取TSC，不陷入内核，而且不需要自己换算TSC的频率
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void request_trace::begin(uint64_t accept_time)
+{
+    sampled = tracer::enabled() && tracer::sample();
+    if(!sampled)
+        return;
+    out_waits = 0;
+    memset(stamp, 0, sizeof(stamp));
+    memset(tid, 0, sizeof(tid));
+    if(accept_time)
+    {
+        stamp[TRACE_START] = accept_time;
+        tid[TRACE_START] = thread_id();
+    }
+}
+
+void request_trace::mark(trace_stage stage)
+{
+    if(!sampled)
+        return;
+    stamp[stage] = tracer::now();
+    tid[stage] = thread_id();
+}
+
+bool tracer::sample()
+{
+    return ++sample_counter % sample_every == 0;
+}
+
+void tracer::finish(const request_trace& trace, const char* url, int status)
+{
+    if(!trace.sampled)
+        return;
+    m_sampled.fetch_add(1, std::memory_order_relaxed);
+    if(!my_ring)
+    {
+        my_ring = new trace_ring;
+        std::lock_guard<std::mutex> guard(rings_mutex);
+        rings.push_back(my_ring);
+    }
+    unsigned head = my_ring->head.load(std::memory_order_relaxed);
+    if(head - my_ring->tail.load(std::memory_order_acquire) >= RING_SIZE)
+    {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    trace_record& r = my_ring->records[head % RING_SIZE];
+    r.trace = trace;
+    if(!r.trace.stamp[TRACE_START])     // 不是连接上的第一个请求，从读到请求开始计时
+    {
+        r.trace.stamp[TRACE_START] = r.trace.stamp[TRACE_READ];
+        r.trace.tid[TRACE_START] = r.trace.tid[TRACE_READ];
+    }
+    r.status = status;
+    snprintf(r.url, sizeof(r.url), "%s", url ? url : "");
+    my_ring->head.store(head + 1, std::memory_order_release);
+}
+
+// 输出一个阶段（Chrome trace-event的complete事件，时间单位为微秒）
+static void write_span(const trace_record& r, const char* name, int from, int to, unsigned long id)
+{
+    const request_trace& t = r.trace;
+    if(!t.stamp[from] || !t.stamp[to])
+        return;
+    fprintf(trace_file, "{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+            "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"id\":%lu}},\n",
+            name, getpid(), t.tid[to], (t.stamp[from] - epoch) / 1000.0, (t.stamp[to] - t.stamp[from]) / 1000.0, id);
+}
+
+static void write_record(const trace_record& r, unsigned long id)
+{
+    const request_trace& t = r.trace;
+    // URL中的'"'和'\\'会破坏JSON，替换掉
+    char url[tracer::URL_LEN];
+    int i = 0;
+    for(; r.url[i]; ++i)
+        url[i] = (r.url[i] == '"' || r.url[i] == '\\' || (unsigned char)r.url[i] < 0x20) ? '_' : r.url[i];
+    url[i] = '\0';
+    fprintf(trace_file, "{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+            "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"id\":%lu,\"http_code\":%d,\"out_waits\":%d}},\n",
+            url, getpid(), t.tid[TRACE_DONE], (t.stamp[TRACE_START] - epoch) / 1000.0,
+            (t.stamp[TRACE_DONE] - t.stamp[TRACE_START]) / 1000.0, id, r.status, t.out_waits);
+    if(t.stamp[TRACE_START] != t.stamp[TRACE_READ])
+        write_span(r, "accept", TRACE_START, TRACE_READ, id);
+    write_span(r, "read", TRACE_READ, TRACE_PARSED, id);
+    write_span(r, "queue", TRACE_QUEUED, TRACE_DEQUEUED, id);
+    write_span(r, "handle", t.stamp[TRACE_DEQUEUED] ? TRACE_DEQUEUED : TRACE_PARSED, TRACE_HANDLED, id);
+    write_span(r, "write", TRACE_HANDLED, TRACE_DONE, id);
+}
+
+// 后台线程：定期取出所有线程的记录，写入慢请求
+static void flush_loop()
+{
+    unsigned long id = 0;
+    while(true)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(tracer::FLUSH_INTERVAL_MS));
+        std::vector<trace_ring*> snapshot;
+        {
+            std::lock_guard<std::mutex> guard(rings_mutex);
+            snapshot = rings;
+        }
+        bool written = false;
+        for(trace_ring* ring : snapshot)
+        {
+            unsigned tail = ring->tail.load(std::memory_order_relaxed);
+            unsigned head = ring->head.load(std::memory_order_acquire);
+            for(; tail != head; ++tail)
+            {
+                const trace_record& r = ring->records[tail % tracer::RING_SIZE];
+                ++id;
+                if(r.trace.stamp[TRACE_DONE] - r.trace.stamp[TRACE_START] >= slow_ns)
+                {
+                    write_record(r, id);
+                    tracer::m_slow.fetch_add(1, std::memory_order_relaxed);
+                    written = true;
+                }
+            }
+            ring->tail.store(tail, std::memory_order_release);
+        }
+        if(written)
+            fflush(trace_file);
+    }
+}
+
+bool tracer::init(const char* file, int slow_ms, int sample)
+{
+    trace_file = fopen(file, "w");
+    if(!trace_file)
+        return false;
+    // JSON数组格式允许省略结尾的']'，进程随时退出时文件仍然可以被加载
+    fprintf(trace_file, "[\n");
+    slow_ns = (uint64_t)(slow_ms > 0 ? slow_ms : 0) * 1000000;
+    sample_every = sample > 0 ? sample : 1;
+    epoch = now();
+    m_enabled = true;
+    std::thread(flush_loop).detach();
+    return true;
+}
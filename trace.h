@@ -0,0 +1,64 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <atomic>
+
+/*
+    请求的处理阶段。每个被采样的请求在经过各阶段时记录时间戳（CLOCK_MONOTONIC，纳秒）和所在线程，
+    没有经过的阶段时间戳为0（例如run-to-completion模式下在reactor线程中处理的请求没有排队阶段）
+*/
+enum trace_stage
+{
+    TRACE_START,        // 请求开始：连接上的第一个请求为接受连接的时间（包括TLS握手和等待请求），否则为读到请求的时间
+    TRACE_READ,         // 读到请求的第一批数据
+    TRACE_PARSED,       // 请求解析完整
+    TRACE_QUEUED,       // 加入线程池的任务队列
+    TRACE_DEQUEUED,     // 工作线程开始处理
+    TRACE_HANDLED,      // 响应已生成（do_request、process_write）
+    TRACE_DONE,         // 响应发送完毕
+    TRACE_STAGES
+};
+
+// 一个请求的各阶段时间戳，由连接对象持有；同一时刻只有一个线程在处理连接，不需要同步
+struct request_trace
+{
+    bool sampled;                   // 这个请求是否被采样
+    int out_waits;                  // 发送响应时等待EPOLLOUT的次数
+    uint64_t stamp[TRACE_STAGES];
+    int tid[TRACE_STAGES];          // 记录各阶段的线程
+
+    void begin(uint64_t accept_time);
+    void mark(trace_stage stage);
+    void mark_once(trace_stage stage) { if(sampled && !stamp[stage]) mark(stage); }
+};
+
+/*
+    请求追踪：采样的请求完成时，记录被放入完成它的线程的环形缓冲区（每个线程一个，单生产者单消费者，无锁），
+    后台线程定期取出记录，把总耗时超过阈值的请求的各阶段按Chrome trace-event JSON格式追加到追踪文件中，
+    可以直接用chrome://tracing或Perfetto打开。采样率可调，低采样率下可以在生产环境中一直开启
+*/
+class tracer
+{
+public:
+    static constexpr int RING_SIZE = 1024;          // 每个线程的环形缓冲区能容纳的记录数，写满时丢弃新记录
+    static constexpr int FLUSH_INTERVAL_MS = 100;   // 后台线程取出记录的间隔
+    static constexpr int URL_LEN = 64;              // 记录中保存的URL的最大长度
+
+    // 打开追踪文件并启动后台线程；slow_ms为慢请求的阈值，每sample_every个请求采样一个
+    static bool init(const char* trace_file, int slow_ms, int sample_every);
+    static bool enabled() { return m_enabled; }
+    static bool sample();   // 是否采样下一个请求
+    static uint64_t now();
+    // 请求完成时调用，status为http_conn::HTTP_CODE
+    static void finish(const request_trace& trace, const char* url, int status);
+
+    static std::atomic<long> m_sampled;     // 采样的请求数
+    static std::atomic<long> m_slow;        // 其中写入追踪文件的慢请求数
+    static std::atomic<long> m_dropped;     // 因环形缓冲区写满而丢弃的记录数
+
+private:
+    static bool m_enabled;
+};
+
+#endif // TRACE_H
@@ -0,0 +1,219 @@
+#include "upgrade.h"
+#include "path_cache.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+
+// 旧进程发送的消息头，后面紧跟着list_len字节的热点文件列表；监听socket在消息头的辅助数据中
+struct handoff_header
+{
+    uint32_t magic;
+    uint32_t fd_count;
+    uint32_t list_len;
+};
+static const uint32_t HANDOFF_MAGIC = 0x48555047;  // "HUPG"
+static const char READY = 'R';
+
+static int control_fd = -1;     // 新进程与旧进程的控制连接，ready之后关闭
+
+static socklen_t unix_address(const char* path, struct sockaddr_un* address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    size_t len = strlen(path);
+    if(len >= sizeof(address->sun_path))
+        len = sizeof(address->sun_path) - 1;
+    memcpy(address->sun_path, path, len);
+    return offsetof(struct sockaddr_un, sun_path) + len + 1;
+}
+
+// 读满len字节，对方关闭或出错时返回false
+static bool read_full(int fd, char* buf, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = read(fd, buf, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const char* buf, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool hot_upgrade::inherit(const char* path, std::vector<int>* fds, std::string* hot_paths)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un address;
+    socklen_t addrlen = unix_address(path, &address);
+    if(connect(fd, (struct sockaddr*)&address, addrlen) < 0)
+    {
+        close(fd);      // 没有旧进程（ENOENT），或者旧进程已经退出留下了socket文件（ECONNREFUSED）
+        return false;
+    }
+    // 旧进程卡住时不要一直等下去
+    struct timeval tv = { 5, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    handoff_header header;
+    union { char buf[CMSG_SPACE(sizeof(int) * MAX_FDS)]; struct cmsghdr align; } control;
+    struct iovec iv = { &header, sizeof(header) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iv;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for(int i = 0; i < count; ++i)
+        {
+            int received;
+            memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            fds->push_back(received);
+        }
+    }
+    if(n != sizeof(header) || header.magic != HANDOFF_MAGIC || header.fd_count != fds->size())
+    {
+        printf("upgrade: bad handoff from %s\n", path);
+        for(int received : *fds)
+            close(received);
+        fds->clear();
+        close(fd);
+        return false;
+    }
+    hot_paths->resize(header.list_len);
+    if(!read_full(fd, &(*hot_paths)[0], header.list_len))
+        hot_paths->clear();
+    control_fd = fd;
+    return true;
+}
+
+int hot_upgrade::warm_up(const std::string& hot_paths)
+{
+    int warmed = 0;
+    size_t start = 0;
+    while(start < hot_paths.size())
+    {
+        size_t end = hot_paths.find('\n', start);
+        if(end == std::string::npos)
+            end = hot_paths.size();
+        std::string url = hot_paths.substr(start, end - start);
+        start = end + 1;
+        if(url.empty() || url[0] != '/')
+            continue;
+        // 解析的结果留在路径缓存中；文件内容同步读入页缓存，就绪之后的第一个请求不会阻塞在磁盘上
+        std::shared_ptr<resolved_file> file = path_resolver::resolve(url.c_str());
+        if(file->fd >= 0 && S_ISREG(file->st.st_mode))
+        {
+            readahead(file->fd, 0, file->st.st_size);
+            ++warmed;
+        }
+    }
+    return warmed;
+}
+
+void hot_upgrade::ready()
+{
+    if(control_fd < 0)
+        return;
+    if(!write_full(control_fd, &READY, 1))
+        printf("upgrade: the old process went away before the handoff finished\n");
+    close(control_fd);
+    control_fd = -1;
+}
+
+int hot_upgrade::listen(const char* path)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_un address;
+    socklen_t addrlen = unix_address(path, &address);
+    unlink(path);   // 上一个进程的socket文件：它已经把监听socket交给了我们，或者已经退出
+    if(bind(fd, (struct sockaddr*)&address, addrlen) < 0 || ::listen(fd, 4) < 0)
+    {
+        printf("failed to listen on upgrade socket %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    chmod(path, 0600);  // 拿到监听socket就等于接管了服务，只允许同一个用户
+    return fd;
+}
+
+int hot_upgrade::hand_over(int listenfd, const std::vector<int>& fds)
+{
+    int fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+    if(fd < 0)
+        return -1;
+    /* 消息很小，新进程正在等待接收，阻塞地发送；设置超时，新进程卡住时不会拖住reactor。
+       热点文件列表最多是路径缓存的容量（约1000个路径） */
+    struct timeval tv = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    int count = fds.size() < (size_t)MAX_FDS ? (int)fds.size() : MAX_FDS;
+    std::string hot_paths = path_resolver::hot_paths();
+    handoff_header header = { HANDOFF_MAGIC, (uint32_t)count, (uint32_t)hot_paths.size() };
+
+    union { char buf[CMSG_SPACE(sizeof(int) * MAX_FDS)]; struct cmsghdr align; } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iv = { &header, sizeof(header) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iv;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * count);
+    if(sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(header) || !write_full(fd, hot_paths.data(), hot_paths.size()))
+    {
+        printf("upgrade: failed to hand over the listeners: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    printf("upgrade: handed %d listeners and %zu hot paths to the new process\n",
+           count, (size_t)std::count(hot_paths.begin(), hot_paths.end(), '\n'));
+    return fd;
+}
+
+int hot_upgrade::on_control(int fd)
+{
+    char c;
+    ssize_t n = read(fd, &c, 1);
+    if(n < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    if(n == 1 && c == READY)
+        return 1;
+    printf("upgrade: the new process exited before it was ready, keep serving\n");
+    return -1;
+}
@@ -0,0 +1,39 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <string>
+#include <vector>
+
+/*
+    不停机的二进制升级。配置了upgrade_socket的进程在这个Unix域socket上等待下一个版本连接进来：
+    1. 新进程启动时先连接upgrade_socket。连不上说明没有旧进程在运行，照常启动；
+       连上了就从旧进程收到它所有的监听socket（SCM_RIGHTS）和路径缓存中的热点文件列表。
+    2. 新进程直接使用收到的监听socket（按地址匹配，没有匹配的才自己创建），按热点列表预热路径缓存和页缓存，
+       然后通知旧进程已就绪。在此之前旧进程照常接受连接，之后两个进程共用同一批监听socket，
+       排在监听队列中的连接由新进程接受，不会被拒绝。
+    3. 旧进程收到就绪通知后不再接受新连接，已有连接的下一个响应带上Connection: close，
+       所有连接关闭或者超过drain_timeout秒后退出。新进程在就绪之前退出时，旧进程继续照常服务
+*/
+class hot_upgrade
+{
+public:
+    static const int MAX_FDS = 250;     // 一次传递的监听socket的上限（内核的SCM_MAX_FD为253）
+
+    /* 新进程：连接旧进程的upgrade_socket，收到的监听socket放进fds，热点文件列表（每行一个URL）放进hot_paths；
+       没有旧进程在运行时返回false。成功时与旧进程的连接保持打开，直到ready */
+    static bool inherit(const char* path, std::vector<int>* fds, std::string* hot_paths);
+    // 新进程：按热点列表预热路径缓存，并让内核预读这些文件，返回预热的文件数
+    static int warm_up(const std::string& hot_paths);
+    // 新进程：已经可以接受连接，通知旧进程开始退出
+    static void ready();
+
+    // 在path上创建等待下一个版本的监听socket（删除上一个进程留下的路径），返回文件描述符，失败返回-1
+    static int listen(const char* path);
+    /* 旧进程：upgrade_socket可读时调用，接受新进程的连接并把监听socket和热点文件列表发送给它。
+       返回与新进程的控制连接（需加入epoll，等待就绪通知），失败返回-1 */
+    static int hand_over(int listenfd, const std::vector<int>& fds);
+    // 旧进程：控制连接可读时调用，返回1表示新进程已就绪，0表示继续等待，-1表示新进程已经放弃
+    static int on_control(int fd);
+};
+
+#endif // UPGRADE_H
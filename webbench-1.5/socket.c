@@ -15,6 +15,8 @@
  
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -56,3 +58,32 @@ int Socket(const char *host, int clientPort)
     return sock;
 }
 
+
+/* connect to an AF_UNIX stream socket; a leading '@' names a socket in
+   the abstract namespace */
+int UnixSocket(const char *path)
+{
+    int sock;
+    size_t len;
+    struct sockaddr_un ad;
+
+    len = strlen(path);
+    if (len >= sizeof(ad.sun_path))
+        return -1;
+    memset(&ad, 0, sizeof(ad));
+    ad.sun_family = AF_UNIX;
+    memcpy(ad.sun_path, path, len);
+    if (path[0] == '@')
+        ad.sun_path[0] = '\0';
+    else
+        len++;
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return sock;
+    if (connect(sock, (struct sockaddr *)&ad, offsetof(struct sockaddr_un, sun_path) + len) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
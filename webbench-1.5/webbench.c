@@ -23,12 +23,19 @@
 #include <strings.h>
 #include <time.h>
 #include <signal.h>
+#include <sys/time.h>
 
 /* values */
 volatile int timerexpired=0;
 int speed=0;
 int failed=0;
 int bytes=0;
+/* latency histogram: 4 buckets per power of two, microseconds */
+#define LAT_BUCKETS 128
+int lat_hist[LAT_BUCKETS];
+long long lat_total=0;
+int lat_max=0;
+long segments=-1; /* TCP segments sent by the host during the run */
 /* globals */
 int http10=1; /* 0 - http/0.9, 1 - http/1.0, 2 - http/1.1 */
 /* Allow: GET, HEAD, OPTIONS, TRACE */
@@ -43,7 +50,9 @@ int force=0;
 int force_reload=0;
 int proxyport=80;
 char *proxyhost=NULL;
+char *unix_path=NULL; /* connect to this AF_UNIX socket instead of host:port */
 int benchtime=30;
+char *compare_url=NULL;
 /* internal */
 int mypipe[2];
 char host[MAXHOSTNAMELEN];
@@ -66,6 +75,8 @@ static const struct option long_options[]=
  {"version",no_argument,NULL,'V'},
  {"proxy",required_argument,NULL,'p'},
  {"clients",required_argument,NULL,'c'},
+ {"compare",required_argument,NULL,'C'},
+ {"unix",required_argument,NULL,'u'},
  {NULL,0,NULL,0}
 };
 
@@ -73,6 +84,10 @@ static const struct option long_options[]=
 static void benchcore(const char* host,const int port, const char *request);
 static int bench(void);
 static void build_request(const char *url);
+static int compare(const char *url);
+static void lat_record(long us);
+static int lat_percentile(double p);
+static long tcp_out_segments(void);
 
 static void alarm_handler(int signal)
 {
@@ -88,6 +103,12 @@ static void usage(void)
 	"  -t|--time <sec>          Run benchmark for <sec> seconds. Default 30.\n"
 	"  -p|--proxy <server:port> Use proxy server for request.\n"
 	"  -c|--clients <n>         Run <n> HTTP clients at once. Default one.\n"
+	"  -C|--compare <URL2>      Afterwards run the same benchmark against URL2\n"
+	"                           (e.g. a second server instance with a different\n"
+	"                           configuration) and print both results side by side.\n"
+	"  -u|--unix <path>         Connect to the AF_UNIX socket <path> (@name for the\n"
+	"                           abstract namespace) instead of the URL's host:port.\n"
+	"                           URL2 of --compare still uses TCP.\n"
 	"  -9|--http09              Use HTTP/0.9 style requests.\n"
 	"  -1|--http10              Use HTTP/1.0 protocol.\n"
 	"  -2|--http11              Use HTTP/1.1 protocol.\n"
@@ -111,7 +132,7 @@ int main(int argc, char *argv[])
           return 2;
  } 
 
- while((opt=getopt_long(argc,argv,"912Vfrt:p:c:?h",long_options,&options_index))!=EOF )
+ while((opt=getopt_long(argc,argv,"912Vfrt:p:c:C:u:?h",long_options,&options_index))!=EOF )
  {
   switch(opt)
   {
@@ -147,6 +168,8 @@ int main(int argc, char *argv[])
    case 'h':
    case '?': usage();return 2;break;
    case 'c': clients=atoi(optarg);break;
+   case 'C': compare_url=optarg;break;
+   case 'u': unix_path=optarg;break;
   }
  }
  
@@ -191,9 +214,60 @@ int main(int argc, char *argv[])
  printf(", running %d sec", benchtime);
  if(force) printf(", early socket close");
  if(proxyhost!=NULL) printf(", via proxy server %s:%d",proxyhost,proxyport);
+ if(unix_path!=NULL) printf(", via unix socket %s",unix_path);
  if(force_reload) printf(", forcing reload");
  printf(".\n");
- return bench();
+ if(compare_url==NULL)
+   return bench();
+ return compare(argv[optind]);
+}
+
+/* run the benchmark against the main URL and then against compare_url */
+static int compare(const char *url)
+{
+ int rc,nclients=clients;
+ int speed_a,failed_a,bytes_a;
+ int p50_a,p99_a;
+ long long avg_a;
+ long segments_a;
+
+ rc=bench();
+ if(rc>=1 && failed==0 && speed==0) return rc;
+ speed_a=speed;failed_a=failed;bytes_a=bytes;
+ avg_a=speed>0?lat_total/speed:0;
+ p50_a=lat_percentile(0.50);p99_a=lat_percentile(0.99);
+ segments_a=segments;
+
+ /* reset state changed by the first run */
+ clients=nclients;
+ timerexpired=0;
+ speed=failed=bytes=0; /* children inherit these counters */
+ lat_total=lat_max=0;
+ memset(lat_hist,0,sizeof(lat_hist));
+ if(proxyhost==NULL) proxyport=80;
+ unix_path=NULL; /* so that -u path -C URL URL compares the two transports */
+ build_request(compare_url);
+ printf("\nBenchmarking: %s\n",compare_url);
+ rc=bench();
+
+ printf("\nComparison            %16s %16s %9s\n","A","B","B/A");
+ printf("pages/min             %16d %16d %+8.1f%%\n",
+	(int)((speed_a+failed_a)/(benchtime/60.0f)),
+	(int)((speed+failed)/(benchtime/60.0f)),
+	speed_a+failed_a>0?100.0*(speed+failed-speed_a-failed_a)/(speed_a+failed_a):0.0);
+ printf("bytes/sec             %16d %16d %+8.1f%%\n",
+	(int)(bytes_a/(float)benchtime),(int)(bytes/(float)benchtime),
+	bytes_a>0?100.0*(bytes-(double)bytes_a)/bytes_a:0.0);
+ printf("avg latency (us)      %16lld %16lld %+8.1f%%\n",avg_a,speed>0?lat_total/speed:0,
+	avg_a>0 && speed>0?100.0*(lat_total/speed-avg_a)/avg_a:0.0);
+ printf("p50 latency (us)      %16d %16d\n",p50_a,lat_percentile(0.50));
+ printf("p99 latency (us)      %16d %16d\n",p99_a,lat_percentile(0.99));
+ if(segments_a>=0 && segments>=0 && speed_a+failed_a>0 && speed+failed>0)
+	 printf("segments/request      %16.2f %16.2f\n",
+		segments_a/(double)(speed_a+failed_a),segments/(double)(speed+failed));
+ printf("failed                %16d %16d\n",failed_a,failed);
+ printf("A = %s\nB = %s\n",url,compare_url);
+ return rc;
 }
 
 void build_request(const char *url)
@@ -293,17 +367,20 @@ void build_request(const char *url)
 /* vraci system rc error kod */
 static int bench(void)
 {
-  int i,j,k;	
+  int i,j,k,m,n;	
+  long long t;
+  long segs;
   pid_t pid=0;
   FILE *f;
 
   /* check avaibility of target server */
-  i=Socket(proxyhost==NULL?host:proxyhost,proxyport);
+  i=unix_path!=NULL?UnixSocket(unix_path):Socket(proxyhost==NULL?host:proxyhost,proxyport);
   if(i<0) { 
 	   fprintf(stderr,"\nConnect to server failed. Aborting benchmark.\n");
            return 1;
          }
   close(i);
+  segs=tcp_out_segments();
   /* create pipe */
   if(pipe(mypipe))
   {
@@ -354,9 +431,12 @@ static int bench(void)
 		 return 3;
 	 }
 	 /* fprintf(stderr,"Child - %d %d\n",speed,failed); */
-	 fprintf(f,"%d %d %d\n",speed,failed,bytes);
+	 fprintf(f,"%d %d %d %d %lld",speed,failed,bytes,lat_max,lat_total);
+	 for(i=0;i<LAT_BUCKETS;i++)
+		 fprintf(f," %d",lat_hist[i]);
+	 fprintf(f,"\n");
 	 fclose(f);
-	 return 0;
+	 exit(0);
   } else
   {
 	  f=fdopen(mypipe[0],"r");
@@ -369,10 +449,13 @@ static int bench(void)
 	  speed=0;
           failed=0;
           bytes=0;
+	  lat_max=0;
+	  lat_total=0;
+	  memset(lat_hist,0,sizeof(lat_hist));
 
 	  while(1)
 	  {
-		  pid=fscanf(f,"%d %d %d",&i,&j,&k);
+		  pid=fscanf(f,"%d %d %d %d %lld",&i,&j,&k,&m,&t);
 		  if(pid<2)
                   {
                        fprintf(stderr,"Some of our childrens died.\n");
@@ -381,6 +464,10 @@ static int bench(void)
 		  speed+=i;
 		  failed+=j;
 		  bytes+=k;
+		  if(m>lat_max) lat_max=m;
+		  lat_total+=t;
+		  for(m=0;m<LAT_BUCKETS && fscanf(f,"%d",&n)==1;m++)
+			  lat_hist[m]+=n;
 		  /* fprintf(stderr,"*Knock* %d %d read=%d\n",speed,failed,pid); */
 		  if(--clients==0) break;
 	  }
@@ -391,6 +478,14 @@ static int bench(void)
 		  (int)(bytes/(float)benchtime),
 		  speed,
 		  failed);
+  if(speed>0)
+	  printf("Latency (us): avg %lld, p50 %d, p90 %d, p99 %d, max %d.\n",
+		  lat_total/speed,lat_percentile(0.50),lat_percentile(0.90),
+		  lat_percentile(0.99),lat_max);
+  segments=segs>=0?tcp_out_segments()-segs:-1;
+  if(segments>=0 && speed+failed>0)
+	  printf("TCP segments sent (whole host): %ld, %.2f per request.\n",
+		  segments,segments/(double)(speed+failed));
   }
   return i;
 }
@@ -401,6 +496,7 @@ void benchcore(const char *host,const int port,const char *req)
  char buf[1500];
  int s,i;
  struct sigaction sa;
+ struct timeval start,end;
 
  /* setup alarm signal handler */
  sa.sa_handler=alarm_handler;
@@ -421,7 +517,8 @@ void benchcore(const char *host,const int port,const char *req)
        }
        return;
     }
-    s=Socket(host,port);                          
+    gettimeofday(&start,NULL);
+    s=unix_path!=NULL?UnixSocket(unix_path):Socket(host,port);
     if(s<0) { failed++;continue;} 
     if(rlen!=write(s,req,rlen)) {failed++;close(s);continue;}
     if(http10==0) 
@@ -447,6 +544,71 @@ void benchcore(const char *host,const int port,const char *req)
 	    }
     }
     if(close(s)) {failed++;continue;}
+    gettimeofday(&end,NULL);
+    lat_record((end.tv_sec-start.tv_sec)*1000000L+(end.tv_usec-start.tv_usec));
     speed++;
  }
 }
+
+/* bucket = (exponent, two mantissa bits), exact below 4us, <25% error above */
+static int lat_bucket(long us)
+{
+ int e,b;
+ if(us<4) return us<0?0:(int)us;
+ e=63-__builtin_clzl((unsigned long)us);
+ b=(e-1)*4+(int)((us>>(e-2))&3);
+ return b<LAT_BUCKETS?b:LAT_BUCKETS-1;
+}
+
+/* lower bound of a bucket in microseconds */
+static int lat_bucket_value(int b)
+{
+ int e;
+ if(b<4) return b;
+ e=b/4+1;
+ return (1<<e)+((b%4)<<(e-2));
+}
+
+static void lat_record(long us)
+{
+ lat_hist[lat_bucket(us)]++;
+ lat_total+=us;
+ if(us>lat_max) lat_max=(int)us;
+}
+
+static int lat_percentile(double p)
+{
+ long long seen=0,count=0;
+ int b;
+ for(b=0;b<LAT_BUCKETS;b++) count+=lat_hist[b];
+ for(b=0;b<LAT_BUCKETS;b++)
+ {
+	 seen+=lat_hist[b];
+	 if(seen>0 && seen>=p*count) return lat_bucket_value(b);
+ }
+ return lat_max;
+}
+
+/* OutSegs from the Tcp line of /proc/net/snmp, -1 if not available */
+static long tcp_out_segments(void)
+{
+ char line[1024];
+ char *p;
+ int i,col=-1;
+ long segs=-1;
+ FILE *f=fopen("/proc/net/snmp","r");
+ if(f==NULL) return -1;
+ while(fgets(line,sizeof(line),f))
+ {
+	 if(strncmp(line,"Tcp:",4)) continue;
+	 p=strtok(line," \n");
+	 for(i=0;p;i++,p=strtok(NULL," \n"))
+	 {
+		 if(col<0 && !strcmp(p,"OutSegs")) { col=i;break; }
+		 if(col>=0 && i==col) { segs=atol(p);break; }
+	 }
+	 if(segs>=0) break;
+ }
+ fclose(f);
+ return segs;
+}